@@ -0,0 +1,147 @@
+#include "bench.h"
+
+#include "buddy_allocator.h"
+#include "buddy_arena.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <threads.h>
+
+// throughput of the same churn as the threads benchmark from 1 to N threads,
+// comparing one heap (behind a mutex or lock-free) to an arena of shards
+
+#define ARENA_PAGES ((uint64_t)1 << 16)
+#define ARENA_OPS 200000
+#define ARENA_LIVE 64
+
+struct arena_arg_s {
+  // exactly one of ba and as is set
+  struct buddy_allocator_s *ba;
+  mtx_t *lock;
+  struct buddy_arena_s *as;
+  uint64_t seed;
+};
+
+static buddy_status_t arena_bench_alloc(struct arena_arg_s *a,
+                                        uint64_t n_pages, uint64_t *page_id) {
+  if (a->as != NULL) {
+    return buddy_arena_page_alloc(a->as, n_pages, page_id);
+  }
+  if (a->lock) {
+    mtx_lock(a->lock);
+  }
+  buddy_status_t s = buddy_page_alloc(a->ba, n_pages, page_id);
+  if (a->lock) {
+    mtx_unlock(a->lock);
+  }
+  return s;
+}
+
+static void arena_bench_free(struct arena_arg_s *a, uint64_t page_id) {
+  if (a->as != NULL) {
+    buddy_arena_page_free(a->as, page_id);
+    return;
+  }
+  if (a->lock) {
+    mtx_lock(a->lock);
+  }
+  buddy_page_free(a->ba, page_id);
+  if (a->lock) {
+    mtx_unlock(a->lock);
+  }
+}
+
+static int arena_worker(void *arg) {
+  struct arena_arg_s *a = arg;
+  uint64_t live[ARENA_LIVE];
+  uint64_t n_live = 0;
+  uint64_t rng = a->seed;
+
+  for (uint64_t i = 0; i < ARENA_OPS; i++) {
+    uint64_t r = bench_rand(&rng);
+    if (n_live < ARENA_LIVE && (n_live == 0 || r % 2 == 0)) {
+      // orders 0 to 3
+      uint64_t n_pages = (uint64_t)1 << ((r >> 8) % 4);
+      if (arena_bench_alloc(a, n_pages, &live[n_live]) ==
+          BUDDY_STATUS_SUCCESS) {
+        n_live++;
+      }
+    } else {
+      uint64_t victim = (r >> 8) % n_live;
+      arena_bench_free(a, live[victim]);
+      live[victim] = live[--n_live];
+    }
+  }
+  return 0;
+}
+
+// n_shards of 0 runs against a single heap
+static double arena_run(uint64_t n_threads, uint32_t n_shards,
+                        buddy_flags_t flags) {
+  struct buddy_allocator_s *ba = NULL;
+  struct buddy_arena_s *as = NULL;
+  mtx_t lock;
+  mtx_init(&lock, mtx_plain);
+  if (n_shards == 0) {
+    ba = malloc(buddy_get_bytes(ARENA_PAGES));
+    buddy_init_flags(ba, ARENA_PAGES, 4096, 0, flags);
+    buddy_ready(ba);
+  } else {
+    as = aligned_alloc(64, buddy_arena_get_bytes(ARENA_PAGES, n_shards, flags));
+    buddy_arena_init(as, ARENA_PAGES, 4096, 0, n_shards, flags);
+    buddy_arena_ready(as);
+  }
+
+  thrd_t *threads = malloc(n_threads * sizeof(thrd_t));
+  struct arena_arg_s *args = malloc(n_threads * sizeof(struct arena_arg_s));
+
+  uint64_t start = bench_now_ns();
+  for (uint64_t t = 0; t < n_threads; t++) {
+    args[t] = (struct arena_arg_s){
+        .ba = ba,
+        .lock = (flags & BUDDY_FLAG_LOCKFREE) ? NULL : &lock,
+        .as = as,
+        .seed = t + 1};
+    thrd_create(&threads[t], arena_worker, &args[t]);
+  }
+  for (uint64_t t = 0; t < n_threads; t++) {
+    thrd_join(threads[t], NULL);
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+
+  free(args);
+  free(threads);
+  if (as != NULL) {
+    buddy_arena_destroy(as);
+  }
+  free(as);
+  free(ba);
+  mtx_destroy(&lock);
+
+  // millions of operations per second
+  return (double)(n_threads * ARENA_OPS) * 1e3 / (double)elapsed;
+}
+
+int bench_arena(int argc, char **argv) {
+  uint64_t max_threads = 64;
+  uint32_t n_shards = 16;
+  if (argc > 0) {
+    max_threads = strtoull(argv[0], NULL, 10);
+  }
+  if (argc > 1) {
+    n_shards = (uint32_t)strtoul(argv[1], NULL, 10);
+  }
+
+  printf("threads,single_mutex_mops,single_lockfree_mops,arena_mutex_mops,"
+         "arena_lockfree_mops\n");
+  for (uint64_t n = 1; n <= max_threads; n *= 2) {
+    double single_mutex = arena_run(n, 0, 0);
+    double single_lockfree = arena_run(n, 0, BUDDY_FLAG_LOCKFREE);
+    double arena_mutex = arena_run(n, n_shards, 0);
+    double arena_lockfree = arena_run(n, n_shards, BUDDY_FLAG_LOCKFREE);
+    printf("%zu,%.2f,%.2f,%.2f,%.2f\n", n, single_mutex, single_lockfree,
+           arena_mutex, arena_lockfree);
+  }
+  return 0;
+}
@@ -0,0 +1,32 @@
+#ifndef bench_h_INCLUDED
+#define bench_h_INCLUDED
+
+#include <stdint.h>
+
+// current time in nanoseconds
+uint64_t bench_now_ns(void);
+
+// xorshift64, never returns 0 given a nonzero state
+uint64_t bench_rand(uint64_t *state);
+
+// sorts n latency samples in place
+void bench_sort(uint32_t *samples, uint64_t n);
+
+// the sample below which a fraction p of the n sorted samples lie
+uint32_t bench_percentile(const uint32_t *sorted, uint64_t n, double p);
+
+// each benchmark accepts the arguments after its name
+int bench_threads(int argc, char **argv);
+int bench_layout(int argc, char **argv);
+int bench_bulk(int argc, char **argv);
+int bench_slab(int argc, char **argv);
+int bench_engine(int argc, char **argv);
+int bench_arena(int argc, char **argv);
+int bench_lazy(int argc, char **argv);
+int bench_workload(int argc, char **argv);
+int bench_replay(int argc, char **argv);
+int bench_snapshot(int argc, char **argv);
+int bench_journal(int argc, char **argv);
+int bench_defrag(int argc, char **argv);
+
+#endif // bench_h_INCLUDED
@@ -0,0 +1,66 @@
+#include "bench.h"
+
+#include "buddy_allocator.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// cost per block of filling and releasing a batch of same order blocks, one
+// call at a time versus buddy_page_alloc_bulk/buddy_page_free_bulk
+
+#define BULK_PAGES ((uint64_t)1 << 20)
+#define BULK_BATCH 256
+#define BULK_ROUNDS 2000
+
+static double bulk_run(uint64_t n_pages, bool bulk) {
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes(BULK_PAGES));
+  buddy_init(ba, BULK_PAGES, 4096, 0);
+  buddy_ready(ba);
+
+  // leave some scattered allocations behind so the tree is not pristine
+  uint64_t rng = 88172645463325252;
+  for (uint64_t i = 0; i < BULK_PAGES / 64; i++) {
+    uint64_t page_id;
+    if (buddy_page_alloc(ba, 1, &page_id) == BUDDY_STATUS_SUCCESS &&
+        bench_rand(&rng) % 2 == 0) {
+      buddy_page_free(ba, page_id);
+    }
+  }
+
+  uint64_t page_ids[BULK_BATCH];
+  uint64_t start = bench_now_ns();
+  for (uint64_t round = 0; round < BULK_ROUNDS; round++) {
+    if (bulk) {
+      uint64_t n = buddy_page_alloc_bulk(ba, n_pages, BULK_BATCH, page_ids);
+      buddy_page_free_bulk(ba, page_ids, n);
+    } else {
+      uint64_t n = 0;
+      while (n < BULK_BATCH &&
+             buddy_page_alloc(ba, n_pages, &page_ids[n]) ==
+                 BUDDY_STATUS_SUCCESS) {
+        n++;
+      }
+      for (uint64_t i = 0; i < n; i++) {
+        buddy_page_free(ba, page_ids[i]);
+      }
+    }
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+
+  free(ba);
+  return (double)elapsed / (double)(BULK_ROUNDS * BULK_BATCH);
+}
+
+int bench_bulk(int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+
+  printf("n_pages,single_ns_per_block,bulk_ns_per_block\n");
+  for (uint64_t n_pages = 1; n_pages <= 8; n_pages *= 2) {
+    double single = bulk_run(n_pages, false);
+    double bulk = bulk_run(n_pages, true);
+    printf("%zu,%.1f,%.1f\n", n_pages, single, bulk);
+  }
+  return 0;
+}
@@ -0,0 +1,92 @@
+#include "bench.h"
+
+#include "buddy_allocator.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// compaction on demand: a heap is filled with small allocations and half of
+// them are freed at random, so that large allocations fail with most of the
+// pages still free. for each order, an allocation that fails is retried
+// after buddy_defrag_plan and the buddy_page_migrate calls it asks for
+
+// the most pages of one allocation, and the most moves per plan
+#define DEFRAG_MAX_PAGES 4
+#define DEFRAG_MAX_MOVES 256
+
+static void defrag_run(uint8_t log2_pages) {
+  const uint64_t n_pages = (uint64_t)1 << log2_pages;
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes(n_pages));
+  buddy_init(ba, n_pages, 4096, 0);
+  buddy_ready(ba);
+
+  uint64_t *live = malloc(n_pages * sizeof(uint64_t));
+  uint64_t n_live = 0;
+  uint64_t rng = 88172645463325252;
+  while (buddy_page_alloc(ba, 1 + bench_rand(&rng) % DEFRAG_MAX_PAGES,
+                          &live[n_live]) == BUDDY_STATUS_SUCCESS) {
+    n_live++;
+  }
+  for (uint64_t i = 0; i < n_live; i++) {
+    if (bench_rand(&rng) % 2 == 0) {
+      buddy_page_free(ba, live[i]);
+    }
+  }
+
+  struct buddy_move_s *moves = malloc(DEFRAG_MAX_MOVES * sizeof(*moves));
+  for (uint8_t order = 3; order <= log2_pages; order++) {
+    uint64_t page_id;
+    if (buddy_page_alloc(ba, (uint64_t)1 << order, &page_id) ==
+        BUDDY_STATUS_SUCCESS) {
+      continue;
+    }
+
+    struct buddy_stats_s stats;
+    buddy_get_stats(ba, &stats);
+    uint64_t start = bench_now_ns();
+    uint64_t n_moves;
+    const buddy_status_t s = buddy_defrag_plan(
+        ba, order, moves, DEFRAG_MAX_MOVES, &n_moves, &page_id);
+    const uint64_t plan_ns = bench_now_ns() - start;
+    if (s != BUDDY_STATUS_SUCCESS) {
+      printf("%u,%u,%zu,%.1f,,,,no plan\n", log2_pages, order,
+             stats.free_pages, (double)plan_ns / 1e3);
+      break;
+    }
+
+    uint64_t moved = 0;
+    start = bench_now_ns();
+    for (uint64_t i = 0; i < n_moves; i++) {
+      (void)buddy_page_migrate(ba, moves[i].page_id, moves[i].dest_page_id);
+      moved += moves[i].n_pages;
+    }
+    const uint64_t migrate_ns = bench_now_ns() - start;
+    const buddy_status_t retry =
+        buddy_page_alloc(ba, (uint64_t)1 << order, &page_id);
+    printf("%u,%u,%zu,%.1f,%zu,%zu,%.1f,%s\n", log2_pages, order,
+           stats.free_pages, (double)plan_ns / 1e3, n_moves, moved,
+           (double)migrate_ns / 1e3,
+           retry == BUDDY_STATUS_SUCCESS ? "ok" : "failed");
+  }
+
+  free(moves);
+  free(live);
+  free(ba);
+}
+
+int bench_defrag(int argc, char **argv) {
+  uint8_t sizes[] = {12, 16, 20};
+  uint64_t n_sizes = sizeof(sizes) / sizeof(sizes[0]);
+  if (argc > 0) {
+    sizes[0] = (uint8_t)strtoul(argv[0], NULL, 10);
+    n_sizes = 1;
+  }
+
+  printf("log2_pages,order,free_pages,plan_us,moves,moved_pages,migrate_us,"
+         "retry\n");
+  for (uint64_t i = 0; i < n_sizes; i++) {
+    defrag_run(sizes[i]);
+  }
+  return 0;
+}
@@ -0,0 +1,75 @@
+#include "bench.h"
+
+#include "buddy_allocator.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// single threaded alloc/free cost of the tree and of BUDDY_FLAG_BITMAP at
+// several heap sizes, with the same churn as the layout benchmark
+
+#define ENGINE_LIVE ((uint64_t)1 << 20)
+#define ENGINE_OPS ((uint64_t)1 << 22)
+
+static double engine_run(uint8_t log2_pages, buddy_flags_t flags) {
+  const uint64_t n_pages = (uint64_t)1 << log2_pages;
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes(n_pages));
+  buddy_init_flags(ba, n_pages, 4096, 0, flags);
+  buddy_ready(ba);
+
+  // keep at most a quarter of the heap live so that allocations rarely fail
+  uint64_t max_live = n_pages / 4 / 8;
+  if (max_live > ENGINE_LIVE) {
+    max_live = ENGINE_LIVE;
+  }
+  uint64_t *live = malloc(max_live * sizeof(uint64_t));
+  uint64_t n_live = 0;
+  uint64_t rng = 88172645463325252;
+
+  // fill the heap half way first so that it is split all over
+  while (n_live < max_live / 2) {
+    uint64_t r = bench_rand(&rng);
+    if (buddy_page_alloc(ba, (uint64_t)1 << (r % 4), &live[n_live]) ==
+        BUDDY_STATUS_SUCCESS) {
+      n_live++;
+    }
+  }
+
+  uint64_t start = bench_now_ns();
+  for (uint64_t i = 0; i < ENGINE_OPS; i++) {
+    uint64_t r = bench_rand(&rng);
+    if (n_live < max_live && (r & 1)) {
+      if (buddy_page_alloc(ba, (uint64_t)1 << ((r >> 1) % 4),
+                           &live[n_live]) == BUDDY_STATUS_SUCCESS) {
+        n_live++;
+      }
+    } else if (n_live > 0) {
+      uint64_t victim = (r >> 8) % n_live;
+      buddy_page_free(ba, live[victim]);
+      live[victim] = live[--n_live];
+    }
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+
+  free(live);
+  free(ba);
+  return (double)elapsed / (double)ENGINE_OPS;
+}
+
+int bench_engine(int argc, char **argv) {
+  uint8_t sizes[] = {12, 16, 20, 24};
+  uint64_t n_sizes = sizeof(sizes) / sizeof(sizes[0]);
+  if (argc > 0) {
+    sizes[0] = (uint8_t)strtoul(argv[0], NULL, 10);
+    n_sizes = 1;
+  }
+
+  printf("log2_pages,tree_ns_per_op,bitmap_ns_per_op\n");
+  for (uint64_t i = 0; i < n_sizes; i++) {
+    double tree = engine_run(sizes[i], 0);
+    double bitmap = engine_run(sizes[i], BUDDY_FLAG_BITMAP);
+    printf("%u,%.1f,%.1f\n", sizes[i], tree, bitmap);
+  }
+  return 0;
+}
@@ -0,0 +1,137 @@
+// pwrite, fsync and unlink are not part of strict c23
+#define _DEFAULT_SOURCE
+#include "bench.h"
+
+#include "buddy_allocator.h"
+#include "buddy_journal.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// the cost of keeping a heap durable while it changes: buddy_journal_commit
+// after every batch of operations, against writing and syncing a whole
+// snapshot after every batch. the files are in the current directory, so the
+// times depend on what fsync costs there
+
+#define JOURNAL_OPS 4096
+// the most pages of one allocation
+#define JOURNAL_MAX_PAGES 16
+
+static const char *snapshot_path = "ba-bench-journal.snapshot";
+static const char *log_path = "ba-bench-journal.log";
+
+// a heap half full of small allocations, with live holding them
+static struct buddy_allocator_s *journal_heap(uint64_t n_pages, uint64_t *live,
+                                              uint64_t *n_live) {
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes(n_pages));
+  buddy_init(ba, n_pages, 4096, 0);
+  buddy_ready(ba);
+  uint64_t rng = 88172645463325252;
+  uint64_t used = 0;
+  *n_live = 0;
+  while (used < n_pages / 2) {
+    const uint64_t size = 1 + bench_rand(&rng) % JOURNAL_MAX_PAGES;
+    if (buddy_page_alloc(ba, size, &live[*n_live]) != BUDDY_STATUS_SUCCESS) {
+      break;
+    }
+    (*n_live)++;
+    used += size;
+  }
+  return ba;
+}
+
+// frees a random allocation or makes a new one, keeping the heap half full
+static void journal_op(struct buddy_allocator_s *ba, uint64_t *live,
+                       uint64_t *n_live, uint64_t *rng) {
+  if (*n_live > 0 && bench_rand(rng) % 2 == 0) {
+    const uint64_t i = bench_rand(rng) % *n_live;
+    (void)buddy_page_free(ba, live[i]);
+    live[i] = live[--(*n_live)];
+    return;
+  }
+  const uint64_t size = 1 + bench_rand(rng) % JOURNAL_MAX_PAGES;
+  if (buddy_page_alloc(ba, size, &live[*n_live]) == BUDDY_STATUS_SUCCESS) {
+    (*n_live)++;
+  }
+}
+
+static void journal_run(uint8_t log2_pages, uint64_t batch, bool snapshot) {
+  const uint64_t n_pages = (uint64_t)1 << log2_pages;
+  uint64_t *live = malloc(n_pages * sizeof(uint64_t));
+  uint64_t n_live;
+  struct buddy_allocator_s *ba = journal_heap(n_pages, live, &n_live);
+  uint64_t rng = 2463534242;
+
+  struct buddy_journal_s *journal = NULL;
+  int fd = -1;
+  const uint64_t bytes = buddy_snapshot_get_bytes(ba);
+  void *buf = NULL;
+  if (snapshot) {
+    fd = open(snapshot_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    buf = malloc(bytes);
+  } else if (buddy_journal_open(ba, snapshot_path, log_path, &journal) !=
+             BUDDY_STATUS_SUCCESS) {
+    printf("%u,journal,%zu,open failed\n", log2_pages, batch);
+    free(ba);
+    free(live);
+    return;
+  }
+
+  uint64_t written = 0;
+  const uint64_t start = bench_now_ns();
+  for (uint64_t i = 0; i < JOURNAL_OPS; i++) {
+    journal_op(ba, live, &n_live, &rng);
+    if ((i + 1) % batch != 0) {
+      continue;
+    }
+    if (snapshot) {
+      (void)buddy_snapshot(ba, buf, bytes);
+      if (pwrite(fd, buf, bytes, 0) == (ssize_t)bytes) {
+        written += bytes;
+      }
+      (void)fsync(fd);
+    } else {
+      (void)buddy_journal_commit(journal);
+    }
+  }
+  const uint64_t ns = bench_now_ns() - start;
+
+  if (snapshot) {
+    close(fd);
+    free(buf);
+    unlink(snapshot_path);
+  } else {
+    struct stat st;
+    if (stat(log_path, &st) == 0) {
+      written = (uint64_t)st.st_size;
+    }
+    (void)buddy_journal_close(journal);
+    unlink(snapshot_path);
+    unlink(log_path);
+  }
+
+  printf("%u,%s,%zu,%u,%.2f,%.1f\n", log2_pages,
+         snapshot ? "snapshot" : "journal", batch, JOURNAL_OPS,
+         (double)ns / JOURNAL_OPS / 1e3, (double)written / JOURNAL_OPS);
+  free(ba);
+  free(live);
+}
+
+int bench_journal(int argc, char **argv) {
+  uint8_t log2_pages = 16;
+  if (argc > 0) {
+    log2_pages = (uint8_t)strtoul(argv[0], NULL, 10);
+  }
+
+  const uint64_t batches[] = {1, 16, 256};
+  printf("log2_pages,method,batch,ops,us_per_op,bytes_per_op\n");
+  for (uint64_t i = 0; i < sizeof(batches) / sizeof(batches[0]); i++) {
+    journal_run(log2_pages, batches[i], false);
+    journal_run(log2_pages, batches[i], true);
+  }
+  return 0;
+}
@@ -0,0 +1,100 @@
+#include "bench.h"
+
+#include "buddy_allocator.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// single threaded alloc/free cost at several heap sizes. run it from
+// ba-bench, ba-bench-blocked and ba-bench-compact to compare heap layouts.
+// also sizes and initializes a region one page past each size, the worst
+// case for rounding the tree up to a power of 2
+
+#define LAYOUT_LIVE ((uint64_t)1 << 20)
+#define LAYOUT_OPS ((uint64_t)1 << 22)
+
+static double layout_run(uint8_t log2_pages) {
+  const uint64_t n_pages = (uint64_t)1 << log2_pages;
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes_flags(n_pages, 0));
+  buddy_init(ba, n_pages, 4096, 0);
+  buddy_ready(ba);
+
+  // keep at most a quarter of the heap live so that allocations rarely fail
+  uint64_t max_live = n_pages / 4 / 8;
+  if (max_live > LAYOUT_LIVE) {
+    max_live = LAYOUT_LIVE;
+  }
+  uint64_t *live = malloc(max_live * sizeof(uint64_t));
+  uint64_t n_live = 0;
+  uint64_t rng = 88172645463325252;
+
+  // fill the heap half way first so that the tree is split all over
+  while (n_live < max_live / 2) {
+    uint64_t r = bench_rand(&rng);
+    if (buddy_page_alloc(ba, (uint64_t)1 << (r % 4), &live[n_live]) ==
+        BUDDY_STATUS_SUCCESS) {
+      n_live++;
+    }
+  }
+
+  uint64_t start = bench_now_ns();
+  for (uint64_t i = 0; i < LAYOUT_OPS; i++) {
+    uint64_t r = bench_rand(&rng);
+    if (n_live < max_live && (r & 1)) {
+      if (buddy_page_alloc(ba, (uint64_t)1 << ((r >> 1) % 4),
+                           &live[n_live]) == BUDDY_STATUS_SUCCESS) {
+        n_live++;
+      }
+    } else if (n_live > 0) {
+      uint64_t victim = (r >> 8) % n_live;
+      buddy_page_free(ba, live[victim]);
+      live[victim] = live[--n_live];
+    }
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+
+  free(live);
+  free(ba);
+  return (double)elapsed / (double)LAYOUT_OPS;
+}
+
+// the time to init and ready a region of 2^log2_pages + 1 pages on fresh
+// memory. sets bytes to its heap size
+static double layout_init_odd(uint8_t log2_pages, uint64_t *bytes) {
+  const uint64_t n_pages = ((uint64_t)1 << log2_pages) + 1;
+  *bytes = buddy_get_bytes_flags(n_pages, 0);
+  struct buddy_allocator_s *ba = malloc(*bytes);
+
+  const uint64_t start = bench_now_ns();
+  buddy_init(ba, n_pages, 4096, 0);
+  buddy_ready(ba);
+  const uint64_t elapsed = bench_now_ns() - start;
+
+  free(ba);
+  return (double)elapsed / 1e6;
+}
+
+int bench_layout(int argc, char **argv) {
+  uint8_t sizes[] = {16, 20, 26};
+  uint64_t n_sizes = sizeof(sizes) / sizeof(sizes[0]);
+  if (argc > 0) {
+    sizes[0] = (uint8_t)strtoul(argv[0], NULL, 10);
+    n_sizes = 1;
+  }
+
+  const char *layout = BUDDY_LAYOUT == BUDDY_LAYOUT_BLOCKED   ? "blocked"
+                       : BUDDY_LAYOUT == BUDDY_LAYOUT_COMPACT ? "compact"
+                                                              : "bfs";
+  printf("layout,log2_pages,ns_per_op,heap_bytes,odd_heap_bytes,"
+         "odd_init_ms\n");
+  for (uint64_t i = 0; i < n_sizes; i++) {
+    uint64_t odd_bytes;
+    const double odd_ms = layout_init_odd(sizes[i], &odd_bytes);
+    printf("%s,%u,%.1f,%zu,%zu,%.3f\n", layout, sizes[i],
+           layout_run(sizes[i]),
+           buddy_get_bytes_flags((uint64_t)1 << sizes[i], 0), odd_bytes,
+           odd_ms);
+  }
+  return 0;
+}
@@ -0,0 +1,82 @@
+// mmap flags and mincore are not part of strict c23
+#define _DEFAULT_SOURCE
+
+#include "bench.h"
+
+#include "buddy_allocator.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// bring-up cost of an eager heap and of BUDDY_FLAG_LAZY on fresh anonymous
+// memory: the time to init and ready, the time for the first allocations, and
+// how much of the metadata is resident afterwards
+
+#define LAZY_ALLOCS 1024
+
+// the number of bytes of [mem, mem + bytes) that are paged in
+static uint64_t lazy_resident(void *mem, uint64_t bytes) {
+  const uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+  const uint64_t n_pages = (bytes + page - 1) / page;
+  unsigned char *vec = malloc(n_pages);
+  uint64_t resident = 0;
+  if (mincore(mem, bytes, vec) == 0) {
+    for (uint64_t i = 0; i < n_pages; i++) {
+      resident += vec[i] & 1;
+    }
+  }
+  free(vec);
+  return resident * page;
+}
+
+static void lazy_run(uint8_t log2_pages, buddy_flags_t flags) {
+  // leave the last pages unusable, like a region that isn't a power of 2
+  const uint64_t n_pages = ((uint64_t)1 << log2_pages) - 3;
+  const uint64_t bytes = buddy_get_bytes(n_pages);
+  void *mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mem == MAP_FAILED) {
+    printf("%u,%s,mmap failed\n", log2_pages,
+           flags & BUDDY_FLAG_LAZY ? "lazy" : "eager");
+    return;
+  }
+  struct buddy_allocator_s *ba = mem;
+
+  uint64_t start = bench_now_ns();
+  buddy_init_flags(ba, n_pages, 4096, 0, flags);
+  buddy_ready(ba);
+  const uint64_t init_ns = bench_now_ns() - start;
+
+  start = bench_now_ns();
+  uint64_t page_id;
+  for (uint64_t i = 0; i < LAZY_ALLOCS; i++) {
+    if (buddy_page_alloc(ba, 1, &page_id) != BUDDY_STATUS_SUCCESS) {
+      break;
+    }
+  }
+  const uint64_t alloc_ns = bench_now_ns() - start;
+
+  printf("%u,%s,%.3f,%.1f,%zu,%zu\n", log2_pages,
+         flags & BUDDY_FLAG_LAZY ? "lazy" : "eager", (double)init_ns / 1e6,
+         (double)alloc_ns / LAZY_ALLOCS, lazy_resident(mem, bytes), bytes);
+  munmap(mem, bytes);
+}
+
+int bench_lazy(int argc, char **argv) {
+  uint8_t sizes[] = {16, 20, 24, 28};
+  uint64_t n_sizes = sizeof(sizes) / sizeof(sizes[0]);
+  if (argc > 0) {
+    sizes[0] = (uint8_t)strtoul(argv[0], NULL, 10);
+    n_sizes = 1;
+  }
+
+  printf("log2_pages,mode,init_ms,first_alloc_ns,resident_bytes,heap_bytes\n");
+  for (uint64_t i = 0; i < n_sizes; i++) {
+    lazy_run(sizes[i], 0);
+    lazy_run(sizes[i], BUDDY_FLAG_LAZY);
+  }
+  return 0;
+}
@@ -0,0 +1,82 @@
+#include "bench.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+uint64_t bench_now_ns(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t bench_rand(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return x;
+}
+
+static int bench_compare(const void *a, const void *b) {
+  const uint32_t x = *(const uint32_t *)a;
+  const uint32_t y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+void bench_sort(uint32_t *samples, uint64_t n) {
+  qsort(samples, n, sizeof(uint32_t), bench_compare);
+}
+
+uint32_t bench_percentile(const uint32_t *sorted, uint64_t n, double p) {
+  if (n == 0) {
+    return 0;
+  }
+  uint64_t i = (uint64_t)(p * (double)n);
+  return sorted[i < n ? i : n - 1];
+}
+
+struct bench_entry_s {
+  char *name;
+  char *usage;
+  int (*run)(int argc, char **argv);
+};
+
+static const struct bench_entry_s benches[] = {
+    {"threads", "[max_threads]", bench_threads},
+    {"layout", "[log2_pages]", bench_layout},
+    {"bulk", "", bench_bulk},
+    {"slab", "", bench_slab},
+    {"engine", "[log2_pages]", bench_engine},
+    {"arena", "[max_threads] [n_shards]", bench_arena},
+    {"lazy", "[log2_pages]", bench_lazy},
+    {"workload", "[name] [ops]", bench_workload},
+    {"replay", "trace [log2_pages] [flags]", bench_replay},
+    {"snapshot", "[log2_pages]", bench_snapshot},
+    {"journal", "[log2_pages]", bench_journal},
+    {"defrag", "[log2_pages]", bench_defrag},
+};
+
+static void usage(char *argv0) {
+  fprintf(stderr, "usage: %s <bench> [args]\n", argv0);
+  for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+    fprintf(stderr, "  %s %s\n", benches[i].name, benches[i].usage);
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    usage(argv[0]);
+    return 1;
+  }
+  for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+    if (strcmp(argv[1], benches[i].name) == 0) {
+      return benches[i].run(argc - 2, argv + 2);
+    }
+  }
+  usage(argv[0]);
+  return 1;
+}
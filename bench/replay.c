@@ -0,0 +1,218 @@
+#include "bench.h"
+
+#include "buddy_allocator.h"
+#include "buddy_trace.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// feeds a file written by buddy_trace_dump into a fresh heap of this build's
+// layout, with the given size and BUDDY_FLAG_* values. only the calls that
+// succeeded when traced are replayed, and frees of allocations that happened
+// before the trace started are skipped. prints a row every REPLAY_WINDOW
+// calls: the trace time, the mean latency of the allocs and frees in the
+// window, and the heap's stats at its end
+
+#define REPLAY_LOG2_PAGES 20
+#define REPLAY_WINDOW 4096
+
+// where a traced allocation lives in the replayed heap
+struct replay_slot_s {
+  // (heap << 48) | page_id of the traced allocation, 0 if empty
+  uint64_t key;
+  uint64_t page_id;
+};
+
+// open addressing from the traced allocations to the replayed ones
+struct replay_map_s {
+  struct replay_slot_s *slots;
+  uint64_t mask;
+};
+
+// a freed slot, probing goes on past it
+#define REPLAY_TOMBSTONE UINT64_MAX
+
+static uint64_t replay_key(const struct buddy_trace_record_s *r) {
+  // + 1 so that no key is 0
+  return ((uint64_t)r->heap << 48 | r->page_id) + 1;
+}
+
+static struct replay_slot_s *replay_find(struct replay_map_s *map,
+                                         uint64_t key) {
+  uint64_t i = (key * 0x9E3779B97F4A7C15) & map->mask;
+  while (map->slots[i].key != 0) {
+    if (map->slots[i].key == key) {
+      return &map->slots[i];
+    }
+    i = (i + 1) & map->mask;
+  }
+  return NULL;
+}
+
+static void replay_insert(struct replay_map_s *map, uint64_t key,
+                          uint64_t page_id) {
+  uint64_t i = (key * 0x9E3779B97F4A7C15) & map->mask;
+  while (map->slots[i].key != 0 && map->slots[i].key != REPLAY_TOMBSTONE) {
+    i = (i + 1) & map->mask;
+  }
+  map->slots[i].key = key;
+  map->slots[i].page_id = page_id;
+}
+
+// reads every record of the trace at path. returns NULL if it isn't one
+static struct buddy_trace_record_s *replay_read(const char *path,
+                                                uint64_t *n) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    printf("can't open %s\n", path);
+    return NULL;
+  }
+  struct buddy_trace_header_s header;
+  if (fread(&header, sizeof(header), 1, f) != 1 ||
+      header.magic != BUDDY_TRACE_MAGIC ||
+      header.version != BUDDY_TRACE_VERSION ||
+      header.record_bytes != sizeof(struct buddy_trace_record_s)) {
+    printf("%s is not a version %u trace\n", path, BUDDY_TRACE_VERSION);
+    fclose(f);
+    return NULL;
+  }
+
+  uint64_t capacity = 4096;
+  struct buddy_trace_record_s *records =
+      malloc(capacity * sizeof(struct buddy_trace_record_s));
+  *n = 0;
+  while (true) {
+    if (*n == capacity) {
+      capacity *= 2;
+      records =
+          realloc(records, capacity * sizeof(struct buddy_trace_record_s));
+    }
+    const uint64_t got = fread(records + *n, sizeof(*records), capacity - *n,
+                               f);
+    if (got == 0) {
+      break;
+    }
+    *n += got;
+  }
+  fclose(f);
+  return records;
+}
+
+// the latencies of one window of calls
+struct replay_window_s {
+  uint64_t alloc_ns;
+  uint64_t n_allocs;
+  uint64_t free_ns;
+  uint64_t n_frees;
+};
+
+// replays r, timing the allocs and frees in w
+static void replay_one(struct buddy_allocator_s *ba, struct replay_map_s *map,
+                       const struct buddy_trace_record_s *r,
+                       struct replay_window_s *w) {
+  if (r->op == BUDDY_TRACE_ALLOC || r->op == BUDDY_TRACE_ALLOC_EXACT) {
+    uint64_t page_id;
+    const uint64_t start = bench_now_ns();
+    const buddy_status_t s =
+        r->op == BUDDY_TRACE_ALLOC
+            ? buddy_page_alloc(ba, r->n_pages, &page_id)
+            : buddy_page_alloc_exact(ba, r->n_pages, &page_id);
+    w->alloc_ns += bench_now_ns() - start;
+    w->n_allocs++;
+    if (s == BUDDY_STATUS_SUCCESS) {
+      replay_insert(map, replay_key(r), page_id);
+    }
+    return;
+  }
+
+  struct replay_slot_s *slot = replay_find(map, replay_key(r));
+  if (slot == NULL) {
+    // allocated before the trace started
+    return;
+  }
+  if (r->op == BUDDY_TRACE_REALLOC) {
+    (void)buddy_page_realloc(ba, slot->page_id, r->n_pages);
+    return;
+  }
+  const uint64_t start = bench_now_ns();
+  if (r->op == BUDDY_TRACE_FREE_EXACT) {
+    buddy_page_free_exact(ba, slot->page_id, r->n_pages);
+  } else {
+    buddy_page_free(ba, slot->page_id);
+  }
+  w->free_ns += bench_now_ns() - start;
+  w->n_frees++;
+  slot->key = REPLAY_TOMBSTONE;
+}
+
+static void replay_row(struct buddy_allocator_s *ba, uint64_t trace_ns,
+                       uint64_t ops, struct replay_window_s *w) {
+  struct buddy_stats_s stats;
+  buddy_get_stats(ba, &stats);
+  printf("%.3f,%zu,%.1f,%.1f,%zu,%zu,%zu,%.3f,%zu\n", (double)trace_ns / 1e6,
+         ops, w->n_allocs ? (double)w->alloc_ns / (double)w->n_allocs : 0.0,
+         w->n_frees ? (double)w->free_ns / (double)w->n_frees : 0.0,
+         stats.allocated_pages, stats.free_pages, stats.largest_free_pages,
+         stats.fragmentation, stats.n_failed);
+  *w = (struct replay_window_s){0};
+}
+
+int bench_replay(int argc, char **argv) {
+  if (argc < 1) {
+    printf("usage: replay trace [log2_pages] [flags]\n");
+    return 1;
+  }
+  const uint8_t log2_pages =
+      argc > 1 ? (uint8_t)strtoul(argv[1], NULL, 10) : REPLAY_LOG2_PAGES;
+  const buddy_flags_t flags = argc > 2 ? strtoull(argv[2], NULL, 0) : 0;
+
+  uint64_t n;
+  struct buddy_trace_record_s *records = replay_read(argv[0], &n);
+  if (records == NULL) {
+    return 1;
+  }
+
+  const uint64_t n_pages = (uint64_t)1 << log2_pages;
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes(n_pages));
+  buddy_init_flags(ba, n_pages, 4096, 0, flags);
+  buddy_ready(ba);
+
+  // at most half full, tombstones included, as every allocation is inserted
+  // once
+  uint64_t capacity = 2;
+  while (capacity < 2 * n) {
+    capacity *= 2;
+  }
+  struct replay_map_s map = {
+      .slots = calloc(capacity, sizeof(struct replay_slot_s)),
+      .mask = capacity - 1,
+  };
+
+  printf("trace_ms,ops,alloc_ns,free_ns,allocated_pages,free_pages,"
+         "largest_free_pages,fragmentation,failed\n");
+  uint64_t ops = 0;
+  uint64_t trace_ns = 0;
+  struct replay_window_s window = {0};
+  for (uint64_t i = 0; i < n; i++) {
+    const struct buddy_trace_record_s *r = &records[i];
+    if (r->status != BUDDY_STATUS_SUCCESS) {
+      continue;
+    }
+
+    replay_one(ba, &map, r, &window);
+    ops++;
+    trace_ns = r->ns - records[0].ns;
+    if (ops % REPLAY_WINDOW == 0) {
+      replay_row(ba, trace_ns, ops, &window);
+    }
+  }
+  if (ops % REPLAY_WINDOW != 0) {
+    replay_row(ba, trace_ns, ops, &window);
+  }
+
+  free(map.slots);
+  free(ba);
+  free(records);
+  return 0;
+}
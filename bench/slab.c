@@ -0,0 +1,118 @@
+#include "bench.h"
+
+#include "buddy_allocator.h"
+#include "buddy_slab.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// small object churn: a fixed number of live objects of 64 to 256 bytes, each
+// step frees a random one and allocates a replacement. compares the slab
+// layer with one page per object from buddy_mem_alloc and with malloc
+
+#define SLAB_PAGES ((uint64_t)1 << 14)
+#define SLAB_PAGE_SIZE 4096
+#define SLAB_LIVE 16384
+#define SLAB_STEPS 10000000
+
+enum slab_mode { SLAB_MODE_SLAB, SLAB_MODE_PAGE, SLAB_MODE_MALLOC };
+
+static const char *slab_mode_names[] = {"slab", "buddy_mem", "malloc"};
+
+static uint64_t slab_size(uint64_t *rng) {
+  return 64 + bench_rand(rng) % 193;
+}
+
+static void *slab_alloc(enum slab_mode mode, struct buddy_slab_s *sa,
+                        uint64_t n_bytes) {
+  void *mem = NULL;
+  switch (mode) {
+  case SLAB_MODE_SLAB:
+    if (buddy_slab_alloc(sa, n_bytes, &mem) != BUDDY_STATUS_SUCCESS) {
+      return NULL;
+    }
+    break;
+  case SLAB_MODE_PAGE:
+    if (buddy_mem_alloc(sa->ba, n_bytes, &mem) != BUDDY_STATUS_SUCCESS) {
+      return NULL;
+    }
+    break;
+  case SLAB_MODE_MALLOC:
+    mem = malloc(n_bytes);
+    break;
+  }
+  // touch the object like a real user would
+  *(uint8_t *)mem = 1;
+  return mem;
+}
+
+static void slab_free(enum slab_mode mode, struct buddy_slab_s *sa,
+                      void *mem) {
+  switch (mode) {
+  case SLAB_MODE_SLAB:
+    buddy_slab_free(sa, mem);
+    break;
+  case SLAB_MODE_PAGE:
+    buddy_mem_free(sa->ba, mem);
+    break;
+  case SLAB_MODE_MALLOC:
+    free(mem);
+    break;
+  }
+}
+
+static void slab_run(enum slab_mode mode) {
+  uint8_t *arena = aligned_alloc(SLAB_PAGE_SIZE, SLAB_PAGES * SLAB_PAGE_SIZE);
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes(SLAB_PAGES));
+  buddy_init(ba, SLAB_PAGES, SLAB_PAGE_SIZE, (uint64_t)arena);
+  buddy_ready(ba);
+  struct buddy_slab_s sa;
+  buddy_slab_init(&sa, ba, NULL, SLAB_PAGE_SIZE);
+
+  void **live = malloc(SLAB_LIVE * sizeof(void *));
+  uint64_t rng = 88172645463325252;
+  uint64_t live_bytes = 0;
+  for (uint64_t i = 0; i < SLAB_LIVE; i++) {
+    uint64_t n_bytes = slab_size(&rng);
+    live_bytes += n_bytes;
+    live[i] = slab_alloc(mode, &sa, n_bytes);
+  }
+
+  uint64_t start = bench_now_ns();
+  for (uint64_t step = 0; step < SLAB_STEPS; step++) {
+    uint64_t i = bench_rand(&rng) % SLAB_LIVE;
+    slab_free(mode, &sa, live[i]);
+    live[i] = slab_alloc(mode, &sa, slab_size(&rng));
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+
+  printf("%s,%.1f,%zu,", slab_mode_names[mode], (double)elapsed / SLAB_STEPS,
+         live_bytes);
+  // what the heap holds on behalf of the objects at the end, unknown for malloc
+  if (mode == SLAB_MODE_SLAB) {
+    printf("%zu\n", sa.n_slabs * SLAB_PAGE_SIZE);
+  } else if (mode == SLAB_MODE_PAGE) {
+    printf("%zu\n", (uint64_t)SLAB_LIVE * SLAB_PAGE_SIZE);
+  } else {
+    printf("\n");
+  }
+
+  for (uint64_t i = 0; i < SLAB_LIVE; i++) {
+    slab_free(mode, &sa, live[i]);
+  }
+  free(live);
+  free(ba);
+  free(arena);
+}
+
+int bench_slab(int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+
+  printf("allocator,ns_per_op,live_bytes,reserved_bytes\n");
+  slab_run(SLAB_MODE_SLAB);
+  slab_run(SLAB_MODE_PAGE);
+  slab_run(SLAB_MODE_MALLOC);
+  return 0;
+}
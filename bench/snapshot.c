@@ -0,0 +1,87 @@
+#include "bench.h"
+
+#include "buddy_allocator.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// cold start of a heap that is half full of small allocations: rebuilding it
+// by redoing every allocation on a fresh heap, against buddy_restore of a
+// snapshot taken from it. the snapshot is in memory, so reading it back from
+// a file would add the time of one read of snapshot_bytes
+
+// the most pages of one allocation
+#define SNAPSHOT_MAX_PAGES 16
+
+static void snapshot_run(uint8_t log2_pages) {
+  const uint64_t n_pages = (uint64_t)1 << log2_pages;
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes(n_pages));
+  buddy_init(ba, n_pages, 4096, 0);
+  buddy_ready(ba);
+
+  // the sizes, in the order they were allocated
+  uint64_t *sizes = malloc(n_pages * sizeof(uint64_t));
+  uint64_t n_allocs = 0;
+  uint64_t rng = 88172645463325252;
+  uint64_t used = 0;
+  while (used < n_pages / 2) {
+    const uint64_t size = 1 + bench_rand(&rng) % SNAPSHOT_MAX_PAGES;
+    uint64_t page_id;
+    if (buddy_page_alloc(ba, size, &page_id) != BUDDY_STATUS_SUCCESS) {
+      break;
+    }
+    sizes[n_allocs++] = size;
+    used += size;
+  }
+
+  struct buddy_allocator_s *rebuilt = malloc(buddy_get_bytes(n_pages));
+  uint64_t start = bench_now_ns();
+  buddy_init(rebuilt, n_pages, 4096, 0);
+  buddy_ready(rebuilt);
+  for (uint64_t i = 0; i < n_allocs; i++) {
+    uint64_t page_id;
+    if (buddy_page_alloc(rebuilt, sizes[i], &page_id) !=
+        BUDDY_STATUS_SUCCESS) {
+      break;
+    }
+  }
+  const uint64_t rebuild_ns = bench_now_ns() - start;
+
+  const uint64_t bytes = buddy_snapshot_get_bytes(ba);
+  void *snapshot = malloc(bytes);
+  start = bench_now_ns();
+  (void)buddy_snapshot(ba, snapshot, bytes);
+  const uint64_t snapshot_ns = bench_now_ns() - start;
+
+  struct buddy_allocator_s *restored = malloc(buddy_get_bytes(n_pages));
+  start = bench_now_ns();
+  const buddy_status_t s = buddy_restore(restored, snapshot, bytes);
+  const uint64_t restore_ns = bench_now_ns() - start;
+
+  printf("%u,%zu,%.3f,%.3f,%.3f,%zu%s\n", log2_pages, n_allocs,
+         (double)rebuild_ns / 1e6, (double)snapshot_ns / 1e6,
+         (double)restore_ns / 1e6, bytes,
+         s == BUDDY_STATUS_SUCCESS ? "" : ",restore failed");
+  free(restored);
+  free(snapshot);
+  free(rebuilt);
+  free(sizes);
+  free(ba);
+}
+
+int bench_snapshot(int argc, char **argv) {
+  uint8_t sizes[] = {16, 20, 24};
+  uint64_t n_sizes = sizeof(sizes) / sizeof(sizes[0]);
+  if (argc > 0) {
+    sizes[0] = (uint8_t)strtoul(argv[0], NULL, 10);
+    n_sizes = 1;
+  }
+
+  printf("log2_pages,allocs,rebuild_ms,snapshot_ms,restore_ms,"
+         "snapshot_bytes\n");
+  for (uint64_t i = 0; i < n_sizes; i++) {
+    snapshot_run(sizes[i]);
+  }
+  return 0;
+}
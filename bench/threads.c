@@ -0,0 +1,105 @@
+#include "bench.h"
+
+#include "buddy_allocator.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <threads.h>
+
+// throughput of buddy_page_alloc/buddy_page_free from 1 to N threads, comparing
+// the default heap behind one global mutex to BUDDY_FLAG_LOCKFREE
+
+#define THREADS_PAGES ((uint64_t)1 << 16)
+#define THREADS_OPS 200000
+#define THREADS_LIVE 64
+
+struct threads_arg_s {
+  struct buddy_allocator_s *ba;
+  mtx_t *lock;
+  uint64_t seed;
+};
+
+static int threads_worker(void *arg) {
+  struct threads_arg_s *a = arg;
+  uint64_t live[THREADS_LIVE];
+  uint64_t n_live = 0;
+  uint64_t rng = a->seed;
+
+  for (uint64_t i = 0; i < THREADS_OPS; i++) {
+    uint64_t r = bench_rand(&rng);
+    if (n_live < THREADS_LIVE && (n_live == 0 || r % 2 == 0)) {
+      // orders 0 to 3
+      uint64_t n_pages = (uint64_t)1 << ((r >> 8) % 4);
+      buddy_status_t s;
+      if (a->lock) {
+        mtx_lock(a->lock);
+      }
+      s = buddy_page_alloc(a->ba, n_pages, &live[n_live]);
+      if (a->lock) {
+        mtx_unlock(a->lock);
+      }
+      if (s == BUDDY_STATUS_SUCCESS) {
+        n_live++;
+      }
+    } else {
+      uint64_t victim = (r >> 8) % n_live;
+      if (a->lock) {
+        mtx_lock(a->lock);
+      }
+      buddy_page_free(a->ba, live[victim]);
+      if (a->lock) {
+        mtx_unlock(a->lock);
+      }
+      live[victim] = live[--n_live];
+    }
+  }
+  return 0;
+}
+
+static double threads_run(uint64_t n_threads, bool lockfree) {
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes(THREADS_PAGES));
+  buddy_init_flags(ba, THREADS_PAGES, 4096, 0,
+                   lockfree ? BUDDY_FLAG_LOCKFREE : 0);
+  buddy_ready(ba);
+
+  mtx_t lock;
+  mtx_init(&lock, mtx_plain);
+
+  thrd_t *threads = malloc(n_threads * sizeof(thrd_t));
+  struct threads_arg_s *args = malloc(n_threads * sizeof(struct threads_arg_s));
+
+  uint64_t start = bench_now_ns();
+  for (uint64_t t = 0; t < n_threads; t++) {
+    args[t] = (struct threads_arg_s){
+        .ba = ba, .lock = lockfree ? NULL : &lock, .seed = t + 1};
+    thrd_create(&threads[t], threads_worker, &args[t]);
+  }
+  for (uint64_t t = 0; t < n_threads; t++) {
+    thrd_join(threads[t], NULL);
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+
+  free(args);
+  free(threads);
+  mtx_destroy(&lock);
+  free(ba);
+
+  // millions of operations per second
+  return (double)(n_threads * THREADS_OPS) * 1e3 / (double)elapsed;
+}
+
+int bench_threads(int argc, char **argv) {
+  uint64_t max_threads = 8;
+  if (argc > 0) {
+    max_threads = strtoull(argv[0], NULL, 10);
+  }
+
+  printf("threads,mutex_mops,lockfree_mops\n");
+  for (uint64_t n = 1; n <= max_threads; n *= 2) {
+    double mutex_mops = threads_run(n, false);
+    double lockfree_mops = threads_run(n, true);
+    printf("%zu,%.2f,%.2f\n", n, mutex_mops, lockfree_mops);
+  }
+  return 0;
+}
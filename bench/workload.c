@@ -0,0 +1,401 @@
+#include "bench.h"
+
+#include "buddy_allocator.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+// allocation patterns on one heap, one CSV row for each placement policy and
+// one for the default policy with BUDDY_FLAG_DEFER:
+// the throughput, the p50, p99 and p99.9 latency of allocs and frees, and the
+// worst fragmentation seen. the throughput comes from a run without per-op
+// timers, the rest from a second run with the same seed. fragmentation is the
+// share of free pages outside the largest free block
+
+#define WORKLOAD_LOG2_PAGES 20
+#define WORKLOAD_OPS ((uint64_t)1 << 20)
+// the most allocations live at once
+#define WORKLOAD_LIVE 4096
+#define WORKLOAD_MAX_PAGES 64
+// ops between fragmentation probes
+#define WORKLOAD_PROBE 1024
+// allocations in flight between the producer and the consumer
+#define WORKLOAD_RING 1024
+
+struct workload_alloc_s {
+  uint64_t page_id;
+  uint64_t n_pages;
+};
+
+// the live allocations in a ring, oldest first
+struct workload_live_s {
+  struct workload_alloc_s allocs[WORKLOAD_LIVE];
+  uint64_t head;
+  uint64_t count;
+};
+
+struct workload_s {
+  char *name;
+  // the number of pages of the next allocation
+  uint64_t (*size)(uint64_t *rng);
+  // which live allocation to free next, counted from the oldest
+  uint64_t (*victim)(struct workload_live_s *live, uint64_t *rng);
+};
+
+struct workload_policy_s {
+  char *name;
+  buddy_flags_t flags;
+};
+
+static struct workload_policy_s policies[] = {
+    {"best", 0},
+    {"lowest", BUDDY_FLAG_LOWEST_FIT},
+    {"next", BUDDY_FLAG_NEXT_FIT},
+    {"defer", BUDDY_FLAG_DEFER},
+};
+
+// per-op latencies of one timed run
+struct workload_result_s {
+  uint32_t *alloc_ns;
+  uint64_t n_allocs;
+  uint32_t *free_ns;
+  uint64_t n_frees;
+  double peak_frag;
+};
+
+static struct workload_alloc_s *workload_at(struct workload_live_s *live,
+                                            uint64_t age) {
+  return &live->allocs[(live->head + age) % WORKLOAD_LIVE];
+}
+
+static struct workload_alloc_s workload_remove(struct workload_live_s *live,
+                                               uint64_t age) {
+  const struct workload_alloc_s a = *workload_at(live, age);
+  if (age == 0) {
+    live->head = (live->head + 1) % WORKLOAD_LIVE;
+  } else {
+    *workload_at(live, age) = *workload_at(live, live->count - 1);
+  }
+  live->count--;
+  return a;
+}
+
+static uint64_t workload_uniform(uint64_t *rng) {
+  return bench_rand(rng) % WORKLOAD_MAX_PAGES + 1;
+}
+
+// P(n) falls off as 1/n^2, so most allocations are a page or two
+static uint64_t workload_power_law(uint64_t *rng) {
+  // uniform in (0, 1]
+  const double u = (double)((bench_rand(rng) >> 11) + 1) / 0x1p53;
+  const double n = 1.0 / u;
+  return n >= WORKLOAD_MAX_PAGES ? WORKLOAD_MAX_PAGES : (uint64_t)n;
+}
+
+// half single pages, half blocks of 2 to 32 pages
+static uint64_t workload_mixed(uint64_t *rng) {
+  const uint64_t r = bench_rand(rng);
+  return r % 2 == 0 ? 1 : (uint64_t)2 << ((r >> 1) % 5);
+}
+
+static uint64_t workload_random(struct workload_live_s *live, uint64_t *rng) {
+  return bench_rand(rng) % live->count;
+}
+
+static uint64_t workload_lifo(struct workload_live_s *live, uint64_t *rng) {
+  (void)rng;
+  return live->count - 1;
+}
+
+static uint64_t workload_fifo(struct workload_live_s *live, uint64_t *rng) {
+  (void)live;
+  (void)rng;
+  return 0;
+}
+
+// single pages are rarely picked, so they pile up all over the heap and keep
+// the blocks around them from merging
+static uint64_t workload_pinning(struct workload_live_s *live, uint64_t *rng) {
+  uint64_t age = bench_rand(rng) % live->count;
+  for (int tries = 0; tries < 16 && workload_at(live, age)->n_pages == 1;
+       tries++) {
+    age = bench_rand(rng) % live->count;
+  }
+  return age;
+}
+
+static const struct workload_s workloads[] = {
+    {"uniform", workload_uniform, workload_random},
+    {"power_law", workload_power_law, workload_random},
+    {"lifo", workload_power_law, workload_lifo},
+    {"fifo", workload_power_law, workload_fifo},
+    {"fragment", workload_mixed, workload_pinning},
+};
+
+// runs ops allocs and frees of w, after filling half the live set. if result
+// is not NULL, times each of them and probes the fragmentation every
+// WORKLOAD_PROBE ops. returns the elapsed time in ns
+static uint64_t workload_run(const struct workload_s *w, buddy_flags_t flags,
+                             uint64_t ops, struct workload_result_s *result) {
+  const uint64_t n_pages = (uint64_t)1 << WORKLOAD_LOG2_PAGES;
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes(n_pages));
+  buddy_init_flags(ba, n_pages, 4096, 0, flags);
+  buddy_ready(ba);
+  struct workload_live_s *live = calloc(1, sizeof(struct workload_live_s));
+  uint64_t rng = 88172645463325252;
+
+  const uint64_t warm = WORKLOAD_LIVE / 2;
+  const uint64_t total = warm + ops;
+  uint64_t start = bench_now_ns();
+  for (uint64_t i = 0; i < total; i++) {
+    if (i == warm) {
+      start = bench_now_ns();
+    }
+    const bool timed = result != NULL && i >= warm;
+    const uint64_t r = bench_rand(&rng);
+    if (live->count < WORKLOAD_LIVE &&
+        (live->count == 0 || i < warm || r % 2 == 0)) {
+      struct workload_alloc_s *a = workload_at(live, live->count);
+      a->n_pages = w->size(&rng);
+      const uint64_t op_start = timed ? bench_now_ns() : 0;
+      const buddy_status_t s = buddy_page_alloc(ba, a->n_pages, &a->page_id);
+      if (timed) {
+        result->alloc_ns[result->n_allocs++] =
+            (uint32_t)(bench_now_ns() - op_start);
+      }
+      if (s == BUDDY_STATUS_SUCCESS) {
+        live->count++;
+      }
+    } else {
+      const struct workload_alloc_s a =
+          workload_remove(live, w->victim(live, &rng));
+      const uint64_t op_start = timed ? bench_now_ns() : 0;
+      buddy_page_free(ba, a.page_id);
+      if (timed) {
+        result->free_ns[result->n_frees++] =
+            (uint32_t)(bench_now_ns() - op_start);
+      }
+    }
+
+    // from the counters, since a probe that allocates the largest free
+    // block would merge what BUDDY_FLAG_DEFER holds back
+    if (timed && i % WORKLOAD_PROBE == 0) {
+      struct buddy_stats_s stats;
+      buddy_get_stats(ba, &stats);
+      if (stats.fragmentation > result->peak_frag) {
+        result->peak_frag = stats.fragmentation;
+      }
+    }
+  }
+  const uint64_t elapsed = bench_now_ns() - start;
+
+  free(live);
+  free(ba);
+  return elapsed;
+}
+
+// allocations handed from one thread to another through a ring
+struct workload_ring_s {
+  struct buddy_allocator_s *ba;
+  // serializes the heap where BUDDY_FLAG_LOCKFREE is not supported
+  mtx_t *lock;
+  uint64_t ops;
+  struct workload_result_s *result;
+  uint64_t page_ids[WORKLOAD_RING];
+  // the next slot to read and to write
+  _Atomic uint64_t head;
+  _Atomic uint64_t tail;
+  _Atomic bool done;
+};
+
+static buddy_status_t workload_ring_alloc(struct workload_ring_s *ring,
+                                          uint64_t n_pages,
+                                          uint64_t *page_id) {
+  if (ring->lock) {
+    mtx_lock(ring->lock);
+  }
+  buddy_status_t s = buddy_page_alloc(ring->ba, n_pages, page_id);
+  if (ring->lock) {
+    mtx_unlock(ring->lock);
+  }
+  return s;
+}
+
+static void workload_ring_free(struct workload_ring_s *ring,
+                               uint64_t page_id) {
+  if (ring->lock) {
+    mtx_lock(ring->lock);
+  }
+  buddy_page_free(ring->ba, page_id);
+  if (ring->lock) {
+    mtx_unlock(ring->lock);
+  }
+}
+
+static int workload_producer(void *arg) {
+  struct workload_ring_s *ring = arg;
+  uint64_t rng = 88172645463325252;
+  for (uint64_t i = 0; i < ring->ops; i++) {
+    const uint64_t n_pages = workload_power_law(&rng);
+    uint64_t page_id;
+    const uint64_t start = ring->result ? bench_now_ns() : 0;
+    const buddy_status_t s = workload_ring_alloc(ring, n_pages, &page_id);
+    if (ring->result) {
+      ring->result->alloc_ns[ring->result->n_allocs++] =
+          (uint32_t)(bench_now_ns() - start);
+    }
+    if (s != BUDDY_STATUS_SUCCESS) {
+      continue;
+    }
+
+    const uint64_t tail = atomic_load_explicit(&ring->tail,
+                                               memory_order_relaxed);
+    while (tail - atomic_load_explicit(&ring->head, memory_order_acquire) ==
+           WORKLOAD_RING) {
+      thrd_yield();
+    }
+    ring->page_ids[tail % WORKLOAD_RING] = page_id;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+  }
+  atomic_store_explicit(&ring->done, true, memory_order_release);
+  return 0;
+}
+
+static int workload_consumer(void *arg) {
+  struct workload_ring_s *ring = arg;
+  uint64_t head = 0;
+  while (true) {
+    // read done first, so that nothing pushed before it is missed
+    const bool done = atomic_load_explicit(&ring->done, memory_order_acquire);
+    if (head == atomic_load_explicit(&ring->tail, memory_order_acquire)) {
+      if (done) {
+        break;
+      }
+      thrd_yield();
+      continue;
+    }
+
+    const uint64_t page_id = ring->page_ids[head % WORKLOAD_RING];
+    atomic_store_explicit(&ring->head, ++head, memory_order_release);
+    const uint64_t start = ring->result ? bench_now_ns() : 0;
+    workload_ring_free(ring, page_id);
+    if (ring->result) {
+      ring->result->free_ns[ring->result->n_frees++] =
+          (uint32_t)(bench_now_ns() - start);
+    }
+  }
+  return 0;
+}
+
+// one thread allocates power law sizes, another frees them. the heap is behind
+// a mutex, so each policy is measured as given, unless flags has
+// BUDDY_FLAG_LOCKFREE and the threads share the heap without it. with
+// BUDDY_FLAG_DEFER, the producer takes back the blocks the consumer's frees
+// hold, so neither thread splits or merges them while the sizes repeat
+static uint64_t workload_prodcons(buddy_flags_t flags, uint64_t ops,
+                                  struct workload_result_s *result) {
+  const uint64_t n_pages = (uint64_t)1 << WORKLOAD_LOG2_PAGES;
+  const bool lockfree = flags & BUDDY_FLAG_LOCKFREE;
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes_flags(n_pages, flags));
+  buddy_init_flags(ba, n_pages, 4096, 0, flags);
+  buddy_ready(ba);
+  mtx_t lock;
+  mtx_init(&lock, mtx_plain);
+
+  struct workload_ring_s *ring = calloc(1, sizeof(struct workload_ring_s));
+  ring->ba = ba;
+  ring->lock = lockfree ? NULL : &lock;
+  // every allocation is freed again, so half the ops are allocations
+  ring->ops = ops / 2;
+  ring->result = result;
+
+  const uint64_t start = bench_now_ns();
+  thrd_t producer;
+  thrd_t consumer;
+  thrd_create(&producer, workload_producer, ring);
+  thrd_create(&consumer, workload_consumer, ring);
+  thrd_join(producer, NULL);
+  thrd_join(consumer, NULL);
+  const uint64_t elapsed = bench_now_ns() - start;
+
+  free(ring);
+  mtx_destroy(&lock);
+  free(ba);
+  return elapsed;
+}
+
+static void workload_print(const char *name, const char *policy, uint64_t ops,
+                           uint64_t elapsed, struct workload_result_s *result,
+                           bool frag) {
+  bench_sort(result->alloc_ns, result->n_allocs);
+  bench_sort(result->free_ns, result->n_frees);
+  printf("%s,%s,%zu,%.2f,%u,%u,%u,%u,%u,%u,", name, policy, ops,
+         (double)ops * 1e3 / (double)elapsed,
+         bench_percentile(result->alloc_ns, result->n_allocs, 0.5),
+         bench_percentile(result->alloc_ns, result->n_allocs, 0.99),
+         bench_percentile(result->alloc_ns, result->n_allocs, 0.999),
+         bench_percentile(result->free_ns, result->n_frees, 0.5),
+         bench_percentile(result->free_ns, result->n_frees, 0.99),
+         bench_percentile(result->free_ns, result->n_frees, 0.999));
+  // not measured while two threads share the heap
+  if (frag) {
+    printf("%.3f", result->peak_frag);
+  }
+  printf("\n");
+}
+
+// runs prodcons once to warm up and once timed, and prints the timed run
+static void workload_prodcons_row(const char *policy, buddy_flags_t flags,
+                                  uint64_t ops,
+                                  struct workload_result_s *result) {
+  const uint64_t elapsed = workload_prodcons(flags, ops, NULL);
+  result->n_allocs = 0;
+  result->n_frees = 0;
+  workload_prodcons(flags, ops, result);
+  workload_print("prodcons", policy, ops, elapsed, result, false);
+}
+
+int bench_workload(int argc, char **argv) {
+  const char *only = argc > 0 ? argv[0] : "all";
+  const uint64_t ops = argc > 1 ? strtoull(argv[1], NULL, 10) : WORKLOAD_OPS;
+
+  struct workload_result_s result;
+  result.alloc_ns = malloc(ops * sizeof(uint32_t));
+  result.free_ns = malloc(ops * sizeof(uint32_t));
+
+  printf("workload,policy,ops,mops,alloc_p50_ns,alloc_p99_ns,alloc_p999_ns,"
+         "free_p50_ns,free_p99_ns,free_p999_ns,peak_frag\n");
+  for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+    if (strcmp(only, "all") != 0 && strcmp(only, workloads[i].name) != 0) {
+      continue;
+    }
+    for (size_t j = 0; j < sizeof(policies) / sizeof(policies[0]); j++) {
+      const uint64_t elapsed =
+          workload_run(&workloads[i], policies[j].flags, ops, NULL);
+      result.n_allocs = 0;
+      result.n_frees = 0;
+      result.peak_frag = 0;
+      workload_run(&workloads[i], policies[j].flags, ops, &result);
+      workload_print(workloads[i].name, policies[j].name, ops, elapsed,
+                     &result, true);
+    }
+  }
+  if (strcmp(only, "all") == 0 || strcmp(only, "prodcons") == 0) {
+    for (size_t j = 0; j < sizeof(policies) / sizeof(policies[0]); j++) {
+      workload_prodcons_row(policies[j].name, policies[j].flags, ops, &result);
+    }
+    // the lock-free heap has no placement policy, so it gets one row. the
+    // compact layout has no lock-free heap at all
+    if (BUDDY_LAYOUT != BUDDY_LAYOUT_COMPACT) {
+      workload_prodcons_row("lockfree", BUDDY_FLAG_LOCKFREE, ops, &result);
+    }
+  }
+
+  free(result.free_ns);
+  free(result.alloc_ns);
+  return 0;
+}
@@ -1,8 +1,16 @@
 #include "buddy_allocator.h"
+#include "buddy_arena.h"
+#include "buddy_journal.h"
+#include "buddy_slab.h"
+#include "buddy_tcache.h"
+#include "buddy_trace.h"
+#include "buddy_zone.h"
 
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <threads.h>
 
 // test if 1 page works
 static void test1() {
@@ -547,6 +555,1235 @@ static void test3() {
   free(ba);
 }
 
+// test allocating and freeing many blocks at once
+static void test_bulk() {
+  printf("TEST BULK\n");
+  uint64_t n_pages = 16;
+  uint64_t page_size = 1;
+  uint64_t offset = 0;
+
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes(n_pages));
+  buddy_init(ba, n_pages, page_size, offset);
+  buddy_ready(ba);
+
+  printf("allocate 5 blocks of 2 pages (should allocate 5)\n");
+  uint64_t v0[8];
+  uint64_t n0 = buddy_page_alloc_bulk(ba, 2, 5, v0);
+  printf("result: %zu:", n0);
+  for (uint64_t i = 0; i < n0; i++) {
+    printf(" %zu", v0[i]);
+  }
+  printf("\n");
+
+  printf("verify\n");
+  buddy_verify(ba);
+
+  printf("allocate 4 blocks of 2 pages (should allocate 3)\n");
+  uint64_t n1 = buddy_page_alloc_bulk(ba, 2, 4, v0 + n0);
+  printf("result: %zu:", n1);
+  for (uint64_t i = n0; i < n0 + n1; i++) {
+    printf(" %zu", v0[i]);
+  }
+  printf("\n");
+
+  printf("verify\n");
+  buddy_verify(ba);
+
+  printf("free all 8 blocks and one unallocated page (should free 8)\n");
+  uint64_t v2[9];
+  for (uint64_t i = 0; i < 8; i++) {
+    v2[i] = v0[i];
+  }
+  v2[8] = 17;
+  uint64_t n2 = buddy_page_free_bulk(ba, v2, 9);
+  printf("result: %zu\n", n2);
+
+  printf("verify\n");
+  buddy_verify(ba);
+
+  printf("allocate everything (should succeed)\n");
+  uint64_t v3 = UINT64_MAX;
+  buddy_status_t s3 = buddy_page_alloc(ba, n_pages, &v3);
+  printf("result: %zu %zu\n", s3, v3);
+
+  free(ba);
+}
+
+static void test_size_of() {
+  printf("TEST SIZE OF\n");
+  uint64_t n_pages = 16;
+  uint64_t page_size = 8;
+  uint64_t offset = 0;
+
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes(n_pages));
+  buddy_init(ba, n_pages, page_size, offset);
+  buddy_ready(ba);
+
+  printf("allocate 3 pages (should succeed)\n");
+  uint64_t v0 = UINT64_MAX;
+  buddy_status_t s0 = buddy_page_alloc(ba, 3, &v0);
+  printf("result: %zu %zu\n", s0, v0);
+
+  printf("size of allocation (should be 4 pages)\n");
+  uint64_t n1 = 0;
+  buddy_status_t s1 = buddy_page_size_of(ba, v0, &n1);
+  printf("result: %zu %zu\n", s1, n1);
+
+  printf("size of page inside allocation (should fail)\n");
+  buddy_status_t s2 = buddy_page_size_of(ba, v0 + 1, &n1);
+  printf("result: %zu\n", s2);
+
+  printf("size of unallocated page (should fail)\n");
+  buddy_status_t s3 = buddy_page_size_of(ba, 8, &n1);
+  printf("result: %zu\n", s3);
+
+  printf("usable bytes of allocation (should be 32)\n");
+  uint64_t n4 = 0;
+  buddy_status_t s4 = buddy_mem_usable_size(ba, (void *)(v0 * page_size), &n4);
+  printf("result: %zu %zu\n", s4, n4);
+
+  printf("free inside allocation (should fail)\n");
+  buddy_status_t s5 = buddy_page_free(ba, v0 + 2);
+  printf("result: %zu\n", s5);
+
+  printf("free allocation (should succeed)\n");
+  buddy_status_t s6 = buddy_page_free(ba, v0);
+  printf("result: %zu\n", s6);
+
+  printf("verify\n");
+  buddy_verify(ba);
+
+  free(ba);
+}
+
+static void test_exact() {
+  printf("TEST EXACT\n");
+  uint64_t n_pages = 16;
+  uint64_t page_size = 1;
+  uint64_t offset = 0;
+
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes(n_pages));
+  buddy_init(ba, n_pages, page_size, offset);
+  buddy_ready(ba);
+
+  printf("allocate exactly 5 pages (should succeed, saving 3)\n");
+  uint64_t v0 = UINT64_MAX;
+  buddy_status_t s0 = buddy_page_alloc_exact(ba, 5, &v0);
+  printf("result: %zu %zu saved: %zu\n", s0, v0, buddy_get_saved_pages(ba));
+
+  printf("allocate exactly 3 pages (should succeed, saving 4)\n");
+  uint64_t v1 = UINT64_MAX;
+  buddy_status_t s1 = buddy_page_alloc_exact(ba, 3, &v1);
+  printf("result: %zu %zu saved: %zu\n", s1, v1, buddy_get_saved_pages(ba));
+
+  printf("allocate 2 pages (should get the tail of the first allocation)\n");
+  uint64_t v2 = UINT64_MAX;
+  buddy_status_t s2 = buddy_page_alloc(ba, 2, &v2);
+  printf("result: %zu %zu\n", s2, v2);
+
+  printf("verify\n");
+  buddy_verify(ba);
+
+  printf("free with the wrong size (should fail)\n");
+  buddy_status_t s3 = buddy_page_free_exact(ba, v0, 6);
+  printf("result: %zu\n", s3);
+
+  printf("free all (should succeed, saving 0)\n");
+  buddy_status_t s4 = buddy_page_free_exact(ba, v0, 5);
+  buddy_status_t s5 = buddy_page_free_exact(ba, v1, 3);
+  buddy_status_t s6 = buddy_page_free(ba, v2);
+  printf("result: %zu %zu %zu saved: %zu\n", s4, s5, s6,
+         buddy_get_saved_pages(ba));
+
+  printf("verify\n");
+  buddy_verify(ba);
+
+  printf("allocate everything (should succeed)\n");
+  uint64_t v7 = UINT64_MAX;
+  buddy_status_t s7 = buddy_page_alloc(ba, n_pages, &v7);
+  printf("result: %zu %zu\n", s7, v7);
+
+  free(ba);
+}
+
+static void test_realloc() {
+  printf("TEST REALLOC\n");
+  uint64_t n_pages = 16;
+  uint64_t page_size = 1;
+  uint64_t offset = 0;
+
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes(n_pages));
+  buddy_init(ba, n_pages, page_size, offset);
+  buddy_ready(ba);
+
+  printf("allocate 2 pages (should succeed)\n");
+  uint64_t v0 = UINT64_MAX;
+  buddy_status_t s0 = buddy_page_alloc(ba, 2, &v0);
+  printf("result: %zu %zu\n", s0, v0);
+
+  printf("grow to 4 pages (should succeed in place)\n");
+  buddy_status_t s1 = buddy_page_realloc(ba, v0, 4);
+  printf("result: %zu\n", s1);
+
+  printf("allocate 4 pages (should succeed)\n");
+  uint64_t v2 = UINT64_MAX;
+  buddy_status_t s2 = buddy_page_alloc(ba, 4, &v2);
+  printf("result: %zu %zu\n", s2, v2);
+
+  printf("grow to 8 pages (should fail)\n");
+  buddy_status_t s3 = buddy_page_realloc(ba, v0, 8);
+  printf("result: %zu\n", s3);
+
+  printf("shrink to 1 page (should succeed in place)\n");
+  buddy_status_t s4 = buddy_page_realloc(ba, v0, 1);
+  uint64_t n4 = 0;
+  buddy_status_t t4 = buddy_page_size_of(ba, v0, &n4);
+  printf("result: %zu %zu %zu\n", s4, t4, n4);
+
+  printf("verify\n");
+  buddy_verify(ba);
+
+  free(ba);
+
+  printf("move a block whose buddy is taken (should keep its contents)\n");
+  static uint64_t arena[16];
+  ba = malloc(buddy_get_bytes(n_pages));
+  buddy_init(ba, n_pages, sizeof(uint64_t), (uint64_t)arena);
+  buddy_ready(ba);
+
+  uint64_t *m0 = NULL;
+  uint64_t *m1 = NULL;
+  buddy_status_t s5 = buddy_mem_alloc(ba, sizeof(uint64_t), (void **)&m0);
+  buddy_status_t s6 = buddy_mem_alloc(ba, sizeof(uint64_t), (void **)&m1);
+  *m0 = 42;
+  uint64_t *m2 = NULL;
+  buddy_status_t s7 =
+      buddy_mem_realloc(ba, m0, 2 * sizeof(uint64_t), (void **)&m2);
+  printf("result: %zu %zu %zu %zu %zu\n", s5, s6, s7, (uint64_t)(m2 - arena),
+         *m2);
+
+  printf("verify\n");
+  buddy_verify(ba);
+
+  free(ba);
+}
+
+static void test_slab() {
+  printf("TEST SLAB\n");
+  uint64_t n_pages = 16;
+  uint64_t page_size = 256;
+  uint8_t *arena = aligned_alloc(page_size, n_pages * page_size);
+
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes(n_pages));
+  buddy_init(ba, n_pages, page_size, (uint64_t)arena);
+  buddy_ready(ba);
+
+  struct buddy_slab_s sa;
+  buddy_slab_init(&sa, ba, NULL, page_size);
+
+  printf("allocate 3 objects of 64 bytes (should share one slab)\n");
+  uint8_t *m0 = NULL;
+  uint8_t *m1 = NULL;
+  uint8_t *m2 = NULL;
+  buddy_status_t s0 = buddy_slab_alloc(&sa, 64, (void **)&m0);
+  buddy_status_t s1 = buddy_slab_alloc(&sa, 50, (void **)&m1);
+  buddy_status_t s2 = buddy_slab_alloc(&sa, 64, (void **)&m2);
+  printf("result: %zu %zu %zu %zu %zu slabs: %zu\n", s0, s1, s2,
+         (uint64_t)(m1 - m0), (uint64_t)(m2 - m0), sa.n_slabs);
+
+  printf("allocate another (should take a second slab)\n");
+  uint8_t *m3 = NULL;
+  buddy_status_t s3 = buddy_slab_alloc(&sa, 64, (void **)&m3);
+  printf("result: %zu slabs: %zu\n", s3, sa.n_slabs);
+
+  printf("free the first and last (should give the second slab back)\n");
+  buddy_status_t s4 = buddy_slab_free(&sa, m0);
+  buddy_status_t s5 = buddy_slab_free(&sa, m3);
+  printf("result: %zu %zu slabs: %zu\n", s4, s5, sa.n_slabs);
+
+  printf("allocate 200 bytes (should bypass the slabs)\n");
+  uint8_t *m6 = NULL;
+  buddy_status_t s6 = buddy_slab_alloc(&sa, 200, (void **)&m6);
+  printf("result: %zu %zu slabs: %zu\n", s6,
+         (uint64_t)(m6 - arena) % page_size, sa.n_slabs);
+  buddy_status_t t6 = buddy_slab_free(&sa, m6);
+  printf("result: %zu\n", t6);
+
+  printf("free a pointer inside an object (should fail)\n");
+  buddy_status_t s7 = buddy_slab_free(&sa, m1 + 1);
+  printf("result: %zu\n", s7);
+
+  printf("free the rest (should keep the empty slab until drained)\n");
+  buddy_status_t s8 = buddy_slab_free(&sa, m1);
+  buddy_status_t t8 = buddy_slab_free(&sa, m2);
+  printf("result: %zu %zu slabs: %zu\n", s8, t8, sa.n_slabs);
+  buddy_slab_drain(&sa);
+  printf("result: slabs: %zu\n", sa.n_slabs);
+
+  printf("allocate everything (should succeed)\n");
+  uint64_t v9 = UINT64_MAX;
+  buddy_status_t s9 = buddy_page_alloc(ba, n_pages, &v9);
+  printf("result: %zu %zu\n", s9, v9);
+
+  free(ba);
+  free(arena);
+}
+
+static void test_bitmap() {
+  printf("TEST BITMAP\n");
+  uint64_t n_pages = 16;
+  uint64_t page_size = 1;
+  uint64_t offset = 0;
+
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes(n_pages));
+  buddy_init_flags(ba, n_pages, page_size, offset, BUDDY_FLAG_BITMAP);
+  buddy_ready(ba);
+
+  printf("allocate 1, 2 and 4 pages (should succeed)\n");
+  uint64_t v0 = UINT64_MAX;
+  uint64_t v1 = UINT64_MAX;
+  uint64_t v2 = UINT64_MAX;
+  buddy_status_t s0 = buddy_page_alloc(ba, 1, &v0);
+  buddy_status_t s1 = buddy_page_alloc(ba, 2, &v1);
+  buddy_status_t s2 = buddy_page_alloc(ba, 4, &v2);
+  printf("result: %zu %zu %zu %zu %zu %zu\n", s0, v0, s1, v1, s2, v2);
+
+  printf("verify\n");
+  buddy_verify(ba);
+
+  printf("size of the 2 page allocation (should be 2 pages)\n");
+  uint64_t n3 = 0;
+  buddy_status_t s3 = buddy_page_size_of(ba, v1, &n3);
+  printf("result: %zu %zu\n", s3, n3);
+
+  printf("grow the 4 page allocation to 8 (should fail)\n");
+  buddy_status_t s4 = buddy_page_realloc(ba, v2, 8);
+  printf("result: %zu\n", s4);
+
+  printf("free inside an allocation (should fail)\n");
+  buddy_status_t s5 = buddy_page_free(ba, v2 + 1);
+  printf("result: %zu\n", s5);
+
+  printf("free all (should succeed)\n");
+  buddy_status_t s6 = buddy_page_free(ba, v0);
+  buddy_status_t t6 = buddy_page_free(ba, v1);
+  buddy_status_t u6 = buddy_page_free(ba, v2);
+  printf("result: %zu %zu %zu\n", s6, t6, u6);
+
+  printf("verify\n");
+  buddy_verify(ba);
+
+  printf("allocate everything (should succeed)\n");
+  uint64_t v7 = UINT64_MAX;
+  buddy_status_t s7 = buddy_page_alloc(ba, n_pages, &v7);
+  printf("result: %zu %zu\n", s7, v7);
+
+  free(ba);
+}
+
+static void test_unusable() {
+  printf("TEST UNUSABLE\n");
+  uint64_t n_pages = 16;
+  uint64_t page_size = 1;
+  uint64_t offset = 0;
+
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes(n_pages));
+  buddy_init(ba, n_pages, page_size, offset);
+  buddy_mark_unusable(ba, 1, 6);
+  buddy_mark_unusable(ba, 9, 9);
+  buddy_ready(ba);
+
+  printf("verify\n");
+  buddy_verify(ba);
+
+  printf("allocate 8 pages (should fail)\n");
+  uint64_t v0 = UINT64_MAX;
+  buddy_status_t s0 = buddy_page_alloc(ba, 8, &v0);
+  printf("result: %zu\n", s0);
+
+  printf("allocate 4 pages (should succeed)\n");
+  uint64_t v1 = UINT64_MAX;
+  buddy_status_t s1 = buddy_page_alloc(ba, 4, &v1);
+  printf("result: %zu %zu\n", s1, v1);
+
+  printf("allocate single pages until full (should get 5)\n");
+  uint64_t n2 = 0;
+  uint64_t v2;
+  while (buddy_page_alloc(ba, 1, &v2) == BUDDY_STATUS_SUCCESS) {
+    printf("result: %zu\n", v2);
+    n2++;
+  }
+  printf("result: %zu\n", n2);
+
+  printf("verify\n");
+  buddy_verify(ba);
+
+  free(ba);
+}
+
+static void test_lazy() {
+  printf("TEST LAZY\n");
+  uint64_t n_pages = 12;
+  uint64_t page_size = 1;
+  uint64_t offset = 0;
+
+  // BUDDY_FLAG_LAZY needs zeroed memory
+  struct buddy_allocator_s *ba = calloc(1, buddy_get_bytes(n_pages));
+  buddy_init_flags(ba, n_pages, page_size, offset, BUDDY_FLAG_LAZY);
+  buddy_mark_unusable(ba, 1, 2);
+  buddy_ready(ba);
+
+  printf("verify\n");
+  buddy_verify(ba);
+
+  printf("allocate 4 pages (should succeed)\n");
+  uint64_t v0 = UINT64_MAX;
+  buddy_status_t s0 = buddy_page_alloc(ba, 4, &v0);
+  printf("result: %zu %zu\n", s0, v0);
+
+  printf("free inside the allocation and in an untouched block (should "
+         "fail)\n");
+  buddy_status_t s1 = buddy_page_free(ba, v0 + 1);
+  buddy_status_t t1 = buddy_page_free(ba, 9);
+  printf("result: %zu %zu\n", s1, t1);
+
+  printf("allocate single pages until full (should get 6)\n");
+  uint64_t n2 = 0;
+  uint64_t v2;
+  while (buddy_page_alloc(ba, 1, &v2) == BUDDY_STATUS_SUCCESS) {
+    n2++;
+  }
+  printf("result: %zu\n", n2);
+
+  printf("verify\n");
+  buddy_verify(ba);
+
+#if BUDDY_LAYOUT != BUDDY_LAYOUT_COMPACT
+  printf("lock-free: allocate single pages until full (should get 10)\n");
+  memset(ba, 0, buddy_get_bytes(n_pages));
+  buddy_init_flags(ba, n_pages, page_size, offset,
+                   BUDDY_FLAG_LAZY | BUDDY_FLAG_LOCKFREE);
+  buddy_mark_unusable(ba, 1, 2);
+  buddy_ready(ba);
+  uint64_t n3 = 0;
+  uint64_t v3;
+  while (buddy_page_alloc(ba, 1, &v3) == BUDDY_STATUS_SUCCESS) {
+    n3++;
+  }
+  printf("result: %zu\n", n3);
+#endif
+
+  free(ba);
+}
+
+static void test_arena() {
+  printf("TEST ARENA\n");
+  uint64_t n_pages = 16;
+  uint64_t page_size = 1;
+  uint64_t offset = 0;
+  uint32_t n_shards = 4;
+
+  struct buddy_arena_s *as =
+      aligned_alloc(64, buddy_arena_get_bytes(n_pages, n_shards, 0));
+  buddy_arena_init(as, n_pages, page_size, offset, n_shards, 0);
+  buddy_arena_mark_unusable(as, 8, 11);
+  buddy_arena_ready(as);
+
+  printf("allocate 4 pages (should fill the home shard)\n");
+  uint64_t v0 = UINT64_MAX;
+  buddy_status_t s0 = buddy_arena_page_alloc(as, 4, &v0);
+  printf("result: %zu %zu\n", s0, v0);
+
+  printf("allocate 2 pages (should steal from the next shard)\n");
+  uint64_t v1 = UINT64_MAX;
+  buddy_status_t s1 = buddy_arena_page_alloc(as, 2, &v1);
+  printf("result: %zu %zu\n", s1, v1);
+
+  printf("allocate 8 pages (should be larger than any shard)\n");
+  uint64_t v2 = UINT64_MAX;
+  buddy_status_t s2 = buddy_arena_page_alloc(as, 8, &v2);
+  printf("result: %zu\n", s2);
+
+  printf("free inside an allocation and out of range (should fail)\n");
+  buddy_status_t s3 = buddy_arena_page_free(as, v1 + 1);
+  buddy_status_t t3 = buddy_arena_page_free(as, 100);
+  printf("result: %zu %zu\n", s3, t3);
+
+  printf("free 2 pages (should succeed)\n");
+  buddy_status_t s4 = buddy_arena_page_free(as, v1);
+  printf("result: %zu\n", s4);
+
+  printf("allocate single pages until full (should get 8)\n");
+  uint64_t n5 = 0;
+  uint64_t v5;
+  while (buddy_arena_page_alloc(as, 1, &v5) == BUDDY_STATUS_SUCCESS) {
+    n5++;
+  }
+  printf("result: %zu\n", n5);
+
+  buddy_arena_destroy(as);
+  free(as);
+}
+
+static void test_zones() {
+  printf("TEST ZONES\n");
+  uint64_t page_size = 16;
+  // given in preference order, not address order. the last is not aligned
+  struct buddy_zone_range_s ranges[3] = {
+      {.base = 0x1000, .n_bytes = 0x80},
+      {.base = 0x100, .n_bytes = 0x40},
+      {.base = 0x20008, .n_bytes = 0x38},
+  };
+
+  uint64_t bytes = buddy_zones_get_bytes(ranges, 3, page_size, 0);
+  struct buddy_zones_s *zs = malloc(bytes);
+  buddy_zones_init(zs, ranges, 3, page_size, 0);
+  buddy_zones_ready(zs);
+
+  printf("metadata vs one heap over the gaps (should be smaller)\n");
+  printf("result: %d\n",
+         bytes < buddy_get_bytes_flags((0x20040 - 0x100) / 16, 0));
+
+  printf("allocate 128 bytes (should fill the first zone)\n");
+  void *v0 = NULL;
+  buddy_status_t s0 = buddy_zones_mem_alloc(zs, 128, &v0);
+  printf("result: %zu %p\n", s0, v0);
+
+  printf("allocate 16 bytes (should fall back to the second zone)\n");
+  void *v1 = NULL;
+  buddy_status_t s1 = buddy_zones_mem_alloc(zs, 16, &v1);
+  printf("result: %zu %p\n", s1, v1);
+
+  printf("allocate 32 bytes from the third zone (should start at 0x20010)\n");
+  void *v2 = NULL;
+  buddy_status_t s2 = buddy_zones_mem_alloc_from(zs, 2, 32, &v2);
+  printf("result: %zu %p\n", s2, v2);
+
+  printf("allocate 256 bytes (should be larger than any zone)\n");
+  void *v3 = NULL;
+  buddy_status_t s3 = buddy_zones_mem_alloc(zs, 256, &v3);
+  printf("result: %zu\n", s3);
+
+  printf("find the zone of 0x20030 and 0x800 (should be 2, then fail)\n");
+  uint32_t z4 = UINT32_MAX;
+  buddy_status_t s4 = buddy_zones_find(zs, (void *)0x20030, &z4);
+  buddy_status_t t4 = buddy_zones_find(zs, (void *)0x800, &z4);
+  printf("result: %zu %u %zu\n", s4, z4, t4);
+
+  printf("free in a gap (should fail), then each allocation\n");
+  buddy_status_t s5 = buddy_zones_mem_free(zs, (void *)0x800);
+  buddy_status_t t5 = buddy_zones_mem_free(zs, v0);
+  buddy_status_t u5 = buddy_zones_mem_free(zs, v1);
+  buddy_status_t w5 = buddy_zones_mem_free(zs, v2);
+  printf("result: %zu %zu %zu %zu\n", s5, t5, u5, w5);
+
+  printf("allocate 128 bytes again (should reuse the first zone)\n");
+  void *v6 = NULL;
+  buddy_status_t s6 = buddy_zones_mem_alloc(zs, 128, &v6);
+  printf("result: %zu %p\n", s6, v6);
+
+  free(zs);
+}
+
+// BUDDY_FLAG_LOCKFREE needs a whole byte per entry
+#if BUDDY_LAYOUT != BUDDY_LAYOUT_COMPACT
+#define STRESS_THREADS 8
+#define STRESS_PAGES 1024
+#define STRESS_ITERATIONS 20000
+#define STRESS_LIVE 16
+
+struct stress_s {
+  struct buddy_allocator_s *ba;
+  // which thread owns each page, 0 if none
+  uint8_t *owner;
+  uint8_t id;
+  uint64_t conflicts;
+};
+
+static int stress_thread(void *arg) {
+  struct stress_s *st = arg;
+  uint64_t live_ids[STRESS_LIVE];
+  uint64_t live_sizes[STRESS_LIVE];
+  uint64_t n_live = 0;
+  uint64_t rng = st->id * 0x9E3779B97F4A7C15 + 1;
+
+  for (uint64_t i = 0; i < STRESS_ITERATIONS; i++) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+
+    if (n_live < STRESS_LIVE && (n_live == 0 || rng % 2 == 0)) {
+      uint64_t n_pages = (uint64_t)1 << (rng >> 8) % 4;
+      uint64_t page_id;
+      if (buddy_page_alloc(st->ba, n_pages, &page_id) != 0) {
+        continue;
+      }
+      // claim every page, any page that is already owned was handed out twice
+      for (uint64_t p = page_id; p < page_id + n_pages; p++) {
+        uint8_t expected = 0;
+        if (!__atomic_compare_exchange_n(&st->owner[p], &expected, st->id,
+                                         false, __ATOMIC_SEQ_CST,
+                                         __ATOMIC_SEQ_CST)) {
+          st->conflicts++;
+        }
+      }
+      live_ids[n_live] = page_id;
+      live_sizes[n_live] = n_pages;
+      n_live++;
+    } else {
+      uint64_t victim = (rng >> 8) % n_live;
+      uint64_t page_id = live_ids[victim];
+      for (uint64_t p = page_id; p < page_id + live_sizes[victim]; p++) {
+        __atomic_store_n(&st->owner[p], 0, __ATOMIC_SEQ_CST);
+      }
+      if (buddy_page_free(st->ba, page_id) != 0) {
+        st->conflicts++;
+      }
+      n_live--;
+      live_ids[victim] = live_ids[n_live];
+      live_sizes[victim] = live_sizes[n_live];
+    }
+  }
+
+  for (uint64_t i = 0; i < n_live; i++) {
+    for (uint64_t p = live_ids[i]; p < live_ids[i] + live_sizes[i]; p++) {
+      __atomic_store_n(&st->owner[p], 0, __ATOMIC_SEQ_CST);
+    }
+    if (buddy_page_free(st->ba, live_ids[i]) != 0) {
+      st->conflicts++;
+    }
+  }
+  return 0;
+}
+
+// test many threads allocating and freeing from a lock-free allocator
+static void test_lockfree_stress() {
+  printf("TEST LOCKFREE STRESS\n");
+  uint64_t n_pages = STRESS_PAGES;
+  uint64_t page_size = 1;
+  uint64_t offset = 0;
+
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes(n_pages));
+  buddy_init_flags(ba, n_pages, page_size, offset, BUDDY_FLAG_LOCKFREE);
+  buddy_ready(ba);
+
+  uint8_t *owner = calloc(n_pages, 1);
+  struct stress_s stress[STRESS_THREADS];
+  thrd_t threads[STRESS_THREADS];
+  for (uint8_t t = 0; t < STRESS_THREADS; t++) {
+    stress[t] = (struct stress_s){
+        .ba = ba, .owner = owner, .id = t + 1, .conflicts = 0};
+    thrd_create(&threads[t], stress_thread, &stress[t]);
+  }
+
+  uint64_t conflicts = 0;
+  for (uint8_t t = 0; t < STRESS_THREADS; t++) {
+    thrd_join(threads[t], NULL);
+    conflicts += stress[t].conflicts;
+  }
+  printf("conflicts (should be 0): %zu\n", conflicts);
+
+  printf("allocate everything (should succeed)\n");
+  uint64_t v0 = UINT64_MAX;
+  buddy_status_t s0 = buddy_page_alloc(ba, n_pages, &v0);
+  printf("result: %zu %zu\n", s0, v0);
+
+  printf("free (should succeed)\n");
+  buddy_status_t s1 = buddy_page_free(ba, v0);
+  printf("result: %zu\n", s1);
+
+  free(owner);
+  free(ba);
+}
+#endif
+
+// test a thread cache in front of a heap
+static void test_tcache() {
+  printf("TEST TCACHE\n");
+  uint64_t n_pages = 64;
+  uint64_t page_size = 1;
+  uint64_t offset = 0;
+
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes(n_pages));
+  buddy_init(ba, n_pages, page_size, offset);
+  buddy_ready(ba);
+
+  struct buddy_tcache_s tc;
+  buddy_tcache_init(&tc, ba, NULL, 4, 8);
+
+  printf("allocate v0 (should succeed, refills order 0)\n");
+  uint64_t v0 = UINT64_MAX;
+  buddy_status_t s0 = buddy_tcache_page_alloc(&tc, 1, &v0);
+  printf("result: %zu %zu cached: %u\n", s0, v0, tc.count[0]);
+
+  printf("allocate v1 (should succeed, refills order 2)\n");
+  uint64_t v1 = UINT64_MAX;
+  buddy_status_t s1 = buddy_tcache_page_alloc(&tc, 3, &v1);
+  printf("result: %zu %zu cached: %u\n", s1, v1, tc.count[2]);
+
+  printf("allocate v2 (should succeed, bypasses the cache)\n");
+  uint64_t v2 = UINT64_MAX;
+  buddy_status_t s2 = buddy_tcache_page_alloc(&tc, 16, &v2);
+  printf("result: %zu %zu\n", s2, v2);
+
+  printf("allocate v3 (should fail, heap is exhausted)\n");
+  uint64_t v3 = UINT64_MAX;
+  buddy_status_t s3 = buddy_tcache_page_alloc(&tc, 32, &v3);
+  printf("result: %zu %zu\n", s3, v3);
+
+  printf("free v0, v1, v2 (should succeed)\n");
+  buddy_tcache_page_free(&tc, v0, 1);
+  buddy_tcache_page_free(&tc, v1, 3);
+  buddy_tcache_page_free(&tc, v2, 16);
+  printf("cached: %u %u\n", tc.count[0], tc.count[2]);
+
+  printf("free v0 again (should be 3, cached: 4)\n");
+  buddy_status_t t0 = buddy_tcache_page_free(&tc, v0, 1);
+  printf("result: %zu cached: %u\n", t0, tc.count[0]);
+#ifdef BUDDY_DEBUG
+  printf("free v1 as 1 page and a page inside v1 (should be 3 3, cached: 4)\n");
+  buddy_status_t t1 = buddy_tcache_page_free(&tc, v1, 1);
+  buddy_status_t t2 = buddy_tcache_page_free(&tc, v1 + 1, 1);
+  printf("result: %zu %zu cached: %u\n", t1, t2, tc.count[0]);
+#endif
+
+  printf("allocate and free 16 order 0 blocks (should flush)\n");
+  uint64_t v4[16];
+  for (uint64_t i = 0; i < 16; i++) {
+    buddy_status_t s4 = buddy_tcache_page_alloc(&tc, 1, &v4[i]);
+    if (s4 != BUDDY_STATUS_SUCCESS) {
+      printf("allocation %zu failed: %zu\n", i, s4);
+    }
+  }
+  for (uint64_t i = 0; i < 16; i++) {
+    buddy_tcache_page_free(&tc, v4[i], 1);
+  }
+  printf("cached: %u\n", tc.count[0]);
+
+  printf("drain\n");
+  buddy_tcache_drain(&tc);
+
+  printf("verify\n");
+  buddy_verify(ba);
+
+  printf("allocate everything (should succeed)\n");
+  uint64_t v5 = UINT64_MAX;
+  buddy_status_t s5 = buddy_page_alloc(ba, n_pages, &v5);
+  printf("result: %zu %zu\n", s5, v5);
+
+  free(ba);
+}
+
+static void test_trimmed() {
+  printf("TEST TRIMMED\n");
+  uint64_t n_pages = 17;
+  uint64_t page_size = 1;
+  uint64_t offset = 0;
+
+  // enough pages for several 64 byte blocks with BUDDY_LAYOUT_BLOCKED
+  printf("heap bytes for 129 pages is less than for 256 (should be 1)\n");
+  printf("result: %d\n",
+         buddy_get_bytes_flags(129, 0) < buddy_get_bytes_flags(256, 0));
+
+  // only as much memory as the tree engine needs for 17 pages
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes_flags(n_pages, 0));
+  buddy_init(ba, n_pages, page_size, offset);
+  buddy_ready(ba);
+
+  printf("verify\n");
+  buddy_verify(ba);
+
+  printf("allocate 16 pages then 1 page (should succeed)\n");
+  uint64_t v0 = UINT64_MAX;
+  uint64_t v1 = UINT64_MAX;
+  buddy_status_t s0 = buddy_page_alloc(ba, 16, &v0);
+  buddy_status_t s1 = buddy_page_alloc(ba, 1, &v1);
+  printf("result: %zu %zu %zu %zu\n", s0, v0, s1, v1);
+
+  printf("allocate 1 page and free past the end (should fail)\n");
+  uint64_t v2;
+  buddy_status_t s2 = buddy_page_alloc(ba, 1, &v2);
+  buddy_status_t t2 = buddy_page_free(ba, 20);
+  printf("result: %zu %zu\n", s2, t2);
+
+  printf("free everything and allocate 16 pages again (should succeed)\n");
+  buddy_page_free(ba, v0);
+  buddy_page_free(ba, v1);
+  buddy_status_t s3 = buddy_page_alloc(ba, 16, &v0);
+  printf("result: %zu %zu\n", s3, v0);
+
+  printf("verify\n");
+  buddy_verify(ba);
+  free(ba);
+
+#if BUDDY_LAYOUT != BUDDY_LAYOUT_COMPACT
+  printf("lock-free: allocate single pages until full (should get 17)\n");
+  ba = malloc(buddy_get_bytes_flags(n_pages, BUDDY_FLAG_LOCKFREE));
+  buddy_init_flags(ba, n_pages, page_size, offset, BUDDY_FLAG_LOCKFREE);
+  buddy_ready(ba);
+  uint64_t n4 = 0;
+  uint64_t v4;
+  while (buddy_page_alloc(ba, 1, &v4) == BUDDY_STATUS_SUCCESS) {
+    n4++;
+  }
+  printf("result: %zu\n", n4);
+  free(ba);
+#endif
+}
+
+static void test_placement() {
+  printf("TEST PLACEMENT\n");
+  uint64_t n_pages = 16;
+  uint64_t page_size = 1;
+  uint64_t offset = 0;
+
+  buddy_flags_t policies[] = {0, BUDDY_FLAG_LOWEST_FIT, BUDDY_FLAG_NEXT_FIT};
+  // what the last two allocations get with each policy
+  const char *expected[] = {"13 12", "0 1", "13 14"};
+  for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+    struct buddy_allocator_s *ba = malloc(buddy_get_bytes(n_pages));
+    buddy_init_flags(ba, n_pages, page_size, offset, policies[i]);
+    buddy_ready(ba);
+
+    printf("allocate 8, 4 and 1 pages, free the 8 and allocate 1, free the "
+           "first 1 and allocate 1 (should be %s)\n",
+           expected[i]);
+    uint64_t v0;
+    uint64_t v1;
+    uint64_t v2;
+    uint64_t v3;
+    uint64_t v4;
+    (void)buddy_page_alloc(ba, 8, &v0);
+    (void)buddy_page_alloc(ba, 4, &v1);
+    (void)buddy_page_alloc(ba, 1, &v2);
+    buddy_page_free(ba, v0);
+    (void)buddy_page_alloc(ba, 1, &v3);
+    buddy_page_free(ba, v2);
+    (void)buddy_page_alloc(ba, 1, &v4);
+    printf("result: %zu %zu\n", v3, v4);
+
+    printf("verify\n");
+    buddy_verify(ba);
+    buddy_dump(ba);
+    free(ba);
+  }
+}
+
+static void test_defrag() {
+  printf("TEST DEFRAG\n");
+  uint64_t n_pages = 16;
+  uint64_t page_size = 1;
+  uint64_t offset = 0;
+
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes(n_pages));
+  buddy_init(ba, n_pages, page_size, offset);
+  buddy_ready(ba);
+
+  printf("allocate every page, free the odd ones, then allocate 2 pages "
+         "(should be 8 2)\n");
+  uint64_t pages[16];
+  for (uint64_t i = 0; i < n_pages; i++) {
+    (void)buddy_page_alloc(ba, 1, &pages[i]);
+  }
+  for (uint64_t i = 1; i < n_pages; i += 2) {
+    buddy_page_free(ba, pages[i]);
+  }
+  struct buddy_stats_s stats;
+  buddy_get_stats(ba, &stats);
+  uint64_t v0;
+  buddy_status_t s0 = buddy_page_alloc(ba, 2, &v0);
+  printf("result: %zu %zu\n", stats.free_pages, s0);
+
+  printf("plan to free 2 pages (should be 0 1, 0 1 3)\n");
+  struct buddy_move_s moves[4];
+  uint64_t n_moves;
+  uint64_t page_id;
+  buddy_status_t s1 = buddy_defrag_plan(ba, 1, moves, 4, &n_moves, &page_id);
+  printf("result: %zu %zu, %zu %zu %zu\n", s1, n_moves, page_id,
+         moves[0].n_pages, moves[0].dest_page_id);
+
+  printf("migrate onto a busy page and from a free one (should be 2 3)\n");
+  buddy_status_t s2 = buddy_page_migrate(ba, 0, 2);
+  buddy_status_t s3 = buddy_page_migrate(ba, 1, 3);
+  printf("result: %zu %zu\n", s2, s3);
+
+  printf("carry out the plan and allocate 2 pages (should be 0 0 0 10)\n");
+  buddy_status_t s4 = buddy_page_migrate(ba, moves[0].page_id,
+                                         moves[0].dest_page_id);
+  buddy_status_t s5 = buddy_page_alloc(ba, 2, &v0);
+  buddy_get_stats(ba, &stats);
+  printf("result: %zu %zu %zu %zu\n", s4, s5, v0, stats.allocated_pages);
+
+  printf("migrate the 2 pages to an odd page (should be 1)\n");
+  printf("result: %zu\n", buddy_page_migrate(ba, v0, 5));
+
+  printf("verify\n");
+  buddy_verify(ba);
+  buddy_dump(ba);
+  free(ba);
+}
+
+static void test_ranges() {
+  printf("TEST RANGES\n");
+  uint64_t n_pages = 16;
+  uint64_t page_size = 1;
+  uint64_t offset = 0;
+
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes(n_pages));
+  buddy_init(ba, n_pages, page_size, offset);
+  buddy_ready(ba);
+
+  printf("allocate 4 pages at 4, 2 pages within them, and 2 pages at 3 "
+         "(should be 0 2 1)\n");
+  buddy_status_t s0 = buddy_page_alloc_at(ba, 4, 4);
+  buddy_status_t s1 = buddy_page_alloc_at(ba, 6, 2);
+  buddy_status_t s2 = buddy_page_alloc_at(ba, 3, 2);
+  printf("result: %zu %zu %zu\n", s0, s1, s2);
+
+  printf("take pages 8 to 11 offline, then 4 to 5, then allocate 8 pages "
+         "(should be 0 2 2 12)\n");
+  buddy_status_t s3 = buddy_page_offline(ba, 8, 11);
+  buddy_status_t s4 = buddy_page_offline(ba, 4, 5);
+  uint64_t v0;
+  buddy_status_t s5 = buddy_page_alloc(ba, 8, &v0);
+  struct buddy_stats_s stats;
+  buddy_get_stats(ba, &stats);
+  printf("result: %zu %zu %zu %zu\n", s3, s4, s5, stats.usable_pages);
+
+  printf("put pages 8 to 11 back online, then page 8 again, then allocate 8 "
+         "pages (should be 0 1 0 8 16)\n");
+  buddy_status_t s6 = buddy_page_online(ba, 8, 11);
+  buddy_status_t s7 = buddy_page_online(ba, 8, 8);
+  buddy_status_t s8 = buddy_page_alloc(ba, 8, &v0);
+  buddy_get_stats(ba, &stats);
+  printf("result: %zu %zu %zu %zu %zu\n", s6, s7, s8, v0, stats.usable_pages);
+
+  printf("verify\n");
+  buddy_verify(ba);
+  buddy_dump(ba);
+  free(ba);
+}
+
+static void test_defer() {
+  printf("TEST DEFER\n");
+  uint64_t n_pages = 16;
+  uint64_t page_size = 1;
+  uint64_t offset = 0;
+
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes(n_pages));
+  buddy_init_flags(ba, n_pages, page_size, offset, BUDDY_FLAG_DEFER);
+  buddy_ready(ba);
+
+  printf("allocate 2 pages, free them twice (should be 0 0 0 3)\n");
+  uint64_t v0 = UINT64_MAX;
+  buddy_status_t s0 = buddy_page_alloc(ba, 2, &v0);
+  buddy_status_t s1 = buddy_page_free(ba, v0);
+  buddy_status_t s2 = buddy_page_free(ba, v0);
+  printf("result: %zu %zu %zu %zu\n", s0, v0, s1, s2);
+
+  // the held block and its free buddy, which weren't merged
+  printf("free blocks of 2 and 16 pages (should be 2 0)\n");
+  struct buddy_stats_s stats;
+  buddy_get_stats(ba, &stats);
+  printf("result: %zu %zu\n", stats.free_blocks[1], stats.free_blocks[4]);
+
+  printf("verify\n");
+  buddy_verify(ba);
+
+  printf("allocate 2 pages again, and 16 pages after freeing them "
+         "(should be 0 0 0 0)\n");
+  uint64_t v1 = UINT64_MAX;
+  buddy_status_t s3 = buddy_page_alloc(ba, 2, &v0);
+  (void)buddy_page_free(ba, v0);
+  buddy_status_t s4 = buddy_page_alloc(ba, 16, &v1);
+  printf("result: %zu %zu %zu %zu\n", s3, v0, s4, v1);
+
+  printf("free the 16 pages, then flush (should be 1 1)\n");
+  (void)buddy_page_free(ba, v1);
+  buddy_get_stats(ba, &stats);
+  const uint64_t held = stats.free_blocks[4];
+  buddy_defer_flush(ba);
+  buddy_get_stats(ba, &stats);
+  printf("result: %zu %zu\n", held, stats.free_blocks[4]);
+
+  // page 2 is held back, so its pages are free but still allocated in the tree
+  printf("allocate 2 pages at 0 and at 2, free page 2, then migrate page 0 "
+         "to 2 (should be 0 0 0 0)\n");
+  buddy_status_t s5 = buddy_page_alloc_at(ba, 0, 2);
+  buddy_status_t s6 = buddy_page_alloc_at(ba, 2, 2);
+  buddy_status_t s7 = buddy_page_free(ba, 2);
+  buddy_status_t s8 = buddy_page_migrate(ba, 0, 2);
+  printf("result: %zu %zu %zu %zu\n", s5, s6, s7, s8);
+
+  printf("same again, then grow page 0 to 4 pages in place "
+         "(should be 0 0 0 0 4)\n");
+  (void)buddy_page_free(ba, 2);
+  buddy_defer_flush(ba);
+  s5 = buddy_page_alloc_at(ba, 0, 2);
+  s6 = buddy_page_alloc_at(ba, 2, 2);
+  s7 = buddy_page_free(ba, 2);
+  s8 = buddy_page_realloc(ba, 0, 4);
+  uint64_t size = 0;
+  (void)buddy_page_size_of(ba, 0, &size);
+  printf("result: %zu %zu %zu %zu %zu\n", s5, s6, s7, s8, size);
+
+  printf("verify\n");
+  buddy_verify(ba);
+  buddy_dump(ba);
+  free(ba);
+}
+
+static void test_snapshot() {
+  printf("TEST SNAPSHOT\n");
+  uint64_t n_pages = 100;
+  uint64_t page_size = 1;
+  uint64_t offset = 0;
+
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes(n_pages));
+  buddy_init(ba, n_pages, page_size, offset);
+  buddy_mark_unusable(ba, 10, 12);
+  buddy_ready(ba);
+  uint64_t v0 = UINT64_MAX;
+  uint64_t v1 = UINT64_MAX;
+  uint64_t v2 = UINT64_MAX;
+  buddy_status_t s0 = buddy_page_alloc(ba, 8, &v0);
+  buddy_status_t s1 = buddy_page_alloc_exact(ba, 5, &v1);
+  buddy_status_t s2 = buddy_page_alloc(ba, 1, &v2);
+  printf("allocate 8, exactly 5 and 1 pages\n");
+  printf("result: %zu %zu %zu %zu %zu %zu\n", s0, v0, s1, v1, s2, v2);
+
+  printf("snapshot then restore (should be 0 0 0)\n");
+  uint64_t bytes = buddy_snapshot_get_bytes(ba);
+  uint8_t *snapshot = malloc(bytes);
+  buddy_status_t t0 = buddy_snapshot(ba, snapshot, bytes);
+  uint64_t restored_bytes = 0;
+  buddy_status_t t1 = buddy_restore_get_bytes(snapshot, bytes, &restored_bytes);
+  // at another alignment than ba, which the blocked layout has to undo
+  uint8_t *memory = malloc(restored_bytes + 16);
+  struct buddy_allocator_s *restored = (void *)(memory + 16);
+  buddy_status_t t2 = buddy_restore(restored, snapshot, bytes);
+  printf("result: %zu %zu %zu\n", t0, t1, t2);
+
+  printf("verify\n");
+  buddy_verify(restored);
+
+  // the exact allocation is a block of 4 and a block of 1
+  printf("sizes of the restored allocations (should be 8 4 1)\n");
+  uint64_t n0 = 0;
+  uint64_t n1 = 0;
+  uint64_t n2 = 0;
+  buddy_page_size_of(restored, v0, &n0);
+  buddy_page_size_of(restored, v1, &n1);
+  buddy_page_size_of(restored, v2, &n2);
+  printf("result: %zu %zu %zu\n", n0, n1, n2);
+
+  printf("free them, then take the same pages again (should match)\n");
+  buddy_page_free(restored, v0);
+  buddy_page_free_exact(restored, v1, 5);
+  buddy_page_free(restored, v2);
+  uint64_t w0 = UINT64_MAX;
+  uint64_t w1 = UINT64_MAX;
+  uint64_t w2 = UINT64_MAX;
+  (void)buddy_page_alloc(restored, 8, &w0);
+  (void)buddy_page_alloc_exact(restored, 5, &w1);
+  (void)buddy_page_alloc(restored, 1, &w2);
+  printf("result: %zu %zu %zu\n", w0, w1, w2);
+
+  printf("verify\n");
+  buddy_verify(restored);
+
+  printf("restore a corrupted or truncated snapshot (should be 1 1)\n");
+  snapshot[bytes - 1] ^= 1;
+  buddy_status_t t3 = buddy_restore(restored, snapshot, bytes);
+  snapshot[bytes - 1] ^= 1;
+  buddy_status_t t4 = buddy_restore(restored, snapshot, bytes - 1);
+  printf("result: %zu %zu\n", t3, t4);
+
+  free(memory);
+  free(snapshot);
+  free(ba);
+}
+
+static void test_journal() {
+  printf("TEST JOURNAL\n");
+  uint64_t n_pages = 64;
+  uint64_t page_size = 1;
+  uint64_t offset = 0;
+  const char *snapshot_path = "ba-example-journal.snapshot";
+  const char *log_path = "ba-example-journal.log";
+
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes(n_pages));
+  buddy_init(ba, n_pages, page_size, offset);
+  buddy_ready(ba);
+
+  printf("open a journal (should be 0)\n");
+  struct buddy_journal_s *journal = NULL;
+  buddy_status_t s0 =
+      buddy_journal_open(ba, snapshot_path, log_path, &journal);
+  printf("result: %zu\n", s0);
+
+  printf("allocate 4 and 8 pages, commit, allocate 1 page and commit, then "
+         "allocate 2 pages without committing\n");
+  uint64_t v0 = UINT64_MAX;
+  uint64_t v1 = UINT64_MAX;
+  uint64_t v2 = UINT64_MAX;
+  uint64_t v3 = UINT64_MAX;
+  (void)buddy_page_alloc(ba, 4, &v0);
+  (void)buddy_page_alloc(ba, 8, &v1);
+  buddy_status_t s1 = buddy_journal_commit(journal);
+  (void)buddy_page_alloc(ba, 1, &v2);
+  buddy_status_t s2 = buddy_journal_commit(journal);
+  (void)buddy_page_alloc(ba, 2, &v3);
+  printf("result: %zu %zu %zu %zu %zu %zu\n", v0, v1, v2, v3, s1, s2);
+
+  // the 2 pages were never committed, so they are not allocated
+  printf("recover, as if the process had stopped (should be 0 0 13 4 3)\n");
+  uint64_t bytes = 0;
+  buddy_status_t s3 = buddy_journal_recover_get_bytes(snapshot_path, &bytes);
+  struct buddy_allocator_s *recovered = malloc(bytes);
+  buddy_status_t s4 = buddy_journal_recover(recovered, snapshot_path, log_path);
+  struct buddy_stats_s stats;
+  buddy_get_stats(recovered, &stats);
+  uint64_t n0 = 0;
+  uint64_t n3 = 0;
+  buddy_page_size_of(recovered, v0, &n0);
+  buddy_status_t t3 = buddy_page_size_of(recovered, v3, &n3);
+  printf("result: %zu %zu %zu %zu %zu\n", s3, s4, stats.allocated_pages, n0,
+         t3);
+
+  printf("verify\n");
+  buddy_verify(recovered);
+
+  // closing commits the 2 pages as a batch of their own
+  printf("close, corrupt the last batch and recover (should be 0 0 13)\n");
+  buddy_status_t s5 = buddy_journal_close(journal);
+  FILE *f = fopen(log_path, "r+b");
+  fseek(f, -1, SEEK_END);
+  int last = fgetc(f);
+  fseek(f, -1, SEEK_END);
+  fputc(last ^ 1, f);
+  fclose(f);
+  buddy_status_t s6 = buddy_journal_recover(recovered, snapshot_path, log_path);
+  buddy_get_stats(recovered, &stats);
+  printf("result: %zu %zu %zu\n", s5, s6, stats.allocated_pages);
+
+  printf("verify\n");
+  buddy_verify(recovered);
+
+  remove(snapshot_path);
+  remove(log_path);
+  free(recovered);
+  free(ba);
+}
+
+static void print_stats(struct buddy_allocator_s *ba) {
+  struct buddy_stats_s stats;
+  buddy_get_stats(ba, &stats);
+  printf("result: %zu %zu %zu %zu %zu\n", stats.usable_pages,
+         stats.allocated_pages, stats.free_pages, stats.saved_pages,
+         stats.largest_free_pages);
+  printf("free blocks: %zu %zu %zu %zu\n", stats.free_blocks[0],
+         stats.free_blocks[1], stats.free_blocks[2], stats.free_blocks[3]);
+  printf("allocs: %zu %zu %zu fragmentation: %.3f\n", stats.n_allocs,
+         stats.n_frees, stats.n_failed, stats.fragmentation);
+}
+
+static void test_stats() {
+  printf("TEST STATS\n");
+  uint64_t n_pages = 16;
+  uint64_t page_size = 1;
+  uint64_t offset = 0;
+
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes(n_pages));
+  buddy_init(ba, n_pages, page_size, offset);
+  buddy_mark_unusable(ba, 12, 15);
+  buddy_ready(ba);
+
+  printf("fresh heap (should be 12 0 12 0 8, 0 0 1 1, 0 0 0 0.333)\n");
+  print_stats(ba);
+
+  printf("allocate 1 page and exactly 3 pages, then 8 pages (should be "
+         "12 4 8 1 4, 2 1 1 0, 2 0 1 0.500)\n");
+  uint64_t v0;
+  uint64_t v1;
+  uint64_t v2;
+  buddy_status_t s0 = buddy_page_alloc(ba, 1, &v0);
+  buddy_status_t s1 = buddy_page_alloc_exact(ba, 3, &v1);
+  buddy_status_t s2 = buddy_page_alloc(ba, 8, &v2);
+  printf("status: %zu %zu %zu\n", s0, s1, s2);
+  print_stats(ba);
+
+  printf("verify\n");
+  buddy_verify(ba);
+
+  printf("free both (should be 12 0 12 0 8, 0 0 1 1, 2 2 1 0.333)\n");
+  buddy_page_free(ba, v0);
+  buddy_page_free_exact(ba, v1, 3);
+  print_stats(ba);
+  free(ba);
+
+#if BUDDY_LAYOUT != BUDDY_LAYOUT_COMPACT
+  printf("lock-free: allocate 3 pages (should be 16 4 12 0 0)\n");
+  ba = malloc(buddy_get_bytes(n_pages));
+  buddy_init_flags(ba, n_pages, page_size, offset, BUDDY_FLAG_LOCKFREE);
+  buddy_ready(ba);
+  buddy_status_t s3 = buddy_page_alloc(ba, 3, &v0);
+  printf("status: %zu\n", s3);
+  print_stats(ba);
+  free(ba);
+#endif
+}
+
+#ifdef BUDDY_TRACE
+static void test_trace() {
+  printf("TEST TRACE\n");
+  uint64_t n_pages = 16;
+  uint64_t page_size = 1;
+  uint64_t offset = 0;
+  const char *path = "ba-trace.bin";
+
+  // drop what the earlier tests traced
+  uint64_t lost;
+  buddy_trace_dump(path, &lost);
+  remove(path);
+
+  struct buddy_allocator_s *ba = malloc(buddy_get_bytes(n_pages));
+  buddy_init(ba, n_pages, page_size, offset);
+  buddy_ready(ba);
+
+  uint64_t v0;
+  uint64_t v1;
+  buddy_status_t s0 = buddy_page_alloc(ba, 2, &v0);
+  buddy_status_t s1 = buddy_page_alloc_exact(ba, 3, &v1);
+  buddy_status_t s2 = buddy_page_realloc(ba, v0, 4);
+  buddy_page_free(ba, v0);
+  buddy_page_free_exact(ba, v1, 3);
+  buddy_page_free(ba, 5);
+  printf("status: %zu %zu %zu\n", s0, s1, s2);
+
+  printf("dump (should be 0 0)\n");
+  buddy_status_t s3 = buddy_trace_dump(path, &lost);
+  printf("result: %zu %zu\n", s3, lost);
+
+  printf("read back op:status (should be 0:0 2:0 4:0 1:0 3:0 1:3)\n");
+  FILE *f = fopen(path, "rb");
+  struct buddy_trace_header_s header;
+  struct buddy_trace_record_s record;
+  if (f != NULL && fread(&header, sizeof(header), 1, f) == 1 &&
+      header.magic == BUDDY_TRACE_MAGIC) {
+    while (fread(&record, sizeof(record), 1, f) == 1) {
+      printf("%u:%u ", record.op, record.status);
+    }
+  }
+  printf("\n");
+  if (f != NULL) {
+    fclose(f);
+  }
+  remove(path);
+  free(ba);
+}
+#endif
+
 int main() {
   test1();
   test2();
@@ -554,4 +1791,36 @@ int main() {
   test8();
   // now we test some of the features of marking blocks as unusable
   test3();
+  test_bulk();
+  test_size_of();
+  test_exact();
+  test_realloc();
+  test_slab();
+  test_bitmap();
+  test_unusable();
+  test_lazy();
+  test_trimmed();
+  test_placement();
+  test_defrag();
+  test_ranges();
+  test_defer();
+  test_stats();
+  test_snapshot();
+  test_journal();
+#ifdef BUDDY_TRACE
+  test_trace();
+#endif
+  test_arena();
+  test_zones();
+  // concurrent allocation
+#if BUDDY_LAYOUT != BUDDY_LAYOUT_COMPACT
+  test_lockfree_stress();
+#endif
+  test_tcache();
+#ifdef BUDDY_TRACE
+  // what the tests after test_trace did, for `ba-bench replay`
+  uint64_t lost;
+  remove("ba-example.trace");
+  buddy_trace_dump("ba-example.trace", &lost);
+#endif
 }
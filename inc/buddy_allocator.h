@@ -10,10 +10,110 @@
 
 typedef uint64_t buddy_status_t;
 
+// buddy_page_alloc and buddy_page_free may be called concurrently from any
+// number of threads without external locking. Allocation scans the requested
+// level instead of following free levels, so it trades some single threaded
+// speed for scalability.
+#define BUDDY_FLAG_LOCKFREE 1
+// keeps a bitmap of free blocks per order with a 64-ary summary above each,
+// instead of the tree. finding a free block takes a few ctz instructions
+// instead of a descent from the root. can't be combined with
+// BUDDY_FLAG_LOCKFREE, and exact allocations are rounded up
+#define BUDDY_FLAG_BITMAP 2
+// the memory given to buddy_init_flags is already zero, like a fresh anonymous
+// mmap. only the root and the paths to unusable pages are written by init, the
+// rest of the tree is implicitly free and first touched when an allocation
+// splits into it, so metadata for untouched regions is never paged in. has no
+// effect with BUDDY_FLAG_BITMAP
+#define BUDDY_FLAG_LAZY 4
+// by default an allocation descends into the child whose largest free block
+// is smaller, as long as it fits, so that large blocks are kept whole.
+// BUDDY_FLAG_LOWEST_FIT takes the lowest addressed block that fits instead,
+// packing allocations at the start of the heap so that the end stays free for
+// large requests
+#define BUDDY_FLAG_LOWEST_FIT 8
+// takes the lowest addressed block that fits at or after the end of the
+// previous allocation, wrapping around to the start of the heap. can't be
+// combined with BUDDY_FLAG_LOWEST_FIT. like it, only changes the tree, and is
+// ignored with BUDDY_FLAG_LOCKFREE and BUDDY_FLAG_BITMAP
+#define BUDDY_FLAG_NEXT_FIT 16
+// buddy_page_free holds up to 8 freed blocks of each size up to 128 pages
+// back instead of merging them with their buddies, and buddy_page_alloc of the
+// same size takes the most recent one again, so that workloads that keep
+// freeing and allocating the same sizes stop splitting and merging the same
+// blocks. the held blocks are merged when an allocation, a migration or a
+// resize in place would fail without them, by buddy_defrag_plan and
+// buddy_page_offline, when a journal is attached, and by buddy_defer_flush.
+// blocks are never held under a journal. can't be combined with
+// BUDDY_FLAG_LOCKFREE or BUDDY_FLAG_BITMAP
+#define BUDDY_FLAG_DEFER 32
+
+typedef uint64_t buddy_flags_t;
+
+// how the heap is stored in memory, chosen when building with -DBUDDY_LAYOUT=
+// BUDDY_LAYOUT_BFS: the classic implicit binary heap
+// BUDDY_LAYOUT_BLOCKED: subtrees of 6 levels share one cache line, so walks
+// between the root and a leaf touch far fewer cache lines on large heaps
+// BUDDY_LAYOUT_COMPACT: each level is packed into as few bits per entry as its
+// values need, 2 bits for the leaves and 4 for the 12 levels above them, for
+// about 0.75 bytes per page instead of 2. can't be used with
+// BUDDY_FLAG_LOCKFREE, which needs a whole byte per entry
+#define BUDDY_LAYOUT_BFS 0
+#define BUDDY_LAYOUT_BLOCKED 1
+#define BUDDY_LAYOUT_COMPACT 2
+
+#ifndef BUDDY_LAYOUT
+#define BUDDY_LAYOUT BUDDY_LAYOUT_BFS
+#endif
+
+// building with -DBUDDY_TRACE records every allocation, free and resize in
+// per-thread rings that can be dumped to a file, see buddy_trace.h
+
+// building with -DBUDDY_DEBUG checks the tree after every allocation, free and
+// resize that succeeded, but only the blocks on the paths from the root to its
+// first and last page and their buddies, which is all that it can change. each
+// check takes O(log n). the lock-free and bitmap engines are only checked by
+// buddy_verify
+
 struct buddy_allocator_s;
 
+// the orders that buddy_stats_s has a free block count for
+#define BUDDY_STATS_ORDERS 64
+
+// counters that every alloc and free keeps up to date, see buddy_get_stats
+struct buddy_stats_s {
+  // n_pages less the pages marked unusable before buddy_ready or taken
+  // offline since
+  uint64_t usable_pages;
+  // pages reserved by live allocations, as rounded up by the allocation
+  uint64_t allocated_pages;
+  uint64_t free_pages;
+  // same as buddy_get_saved_pages
+  uint64_t saved_pages;
+  // the number of pages in the largest free block
+  uint64_t largest_free_pages;
+  // free_blocks[k] is the number of free blocks of 2^k pages, counting the
+  // ones BUDDY_FLAG_DEFER holds back unmerged
+  uint64_t free_blocks[BUDDY_STATS_ORDERS];
+  // successful allocations and frees since buddy_ready, however many blocks
+  // each one took. resizes in place and migrations are counted as neither
+  uint64_t n_allocs;
+  uint64_t n_frees;
+  // allocations that returned BUDDY_STATUS_NOMEM, and bulk allocations that
+  // got fewer blocks than asked for
+  uint64_t n_failed;
+  // 1 - largest_free_pages / free_pages. 0 when the free pages form one block,
+  // close to 1 when they are scattered in small blocks
+  double fragmentation;
+};
+
+// gets the necessary number of bytes to construct the buddy allocator with any
+// combination of flags
 uint64_t buddy_get_bytes(uint64_t n_pages);
 
+// same as buddy_get_bytes, but only enough for the given BUDDY_FLAG_* values
+uint64_t buddy_get_bytes_flags(uint64_t n_pages, buddy_flags_t flags);
+
 // initializes a buddy allocator from uninitialized memory
 // ba: a pointer to memory at least buddy_get_bytes(n_pages) long
 // n_pages: the number of pages to create an allocator for.
@@ -21,15 +121,45 @@ uint64_t buddy_get_bytes(uint64_t n_pages);
 // offset: the offset of the range of memory controlled by the buddy allocator
 void buddy_init(struct buddy_allocator_s *ba, uint64_t n_pages, uint64_t page_size, uint64_t offset);
 
-// marks a range of pages as unusable
+// same as buddy_init, but accepts a combination of BUDDY_FLAG_* values
+void buddy_init_flags(struct buddy_allocator_s *ba, uint64_t n_pages, uint64_t page_size, uint64_t offset, buddy_flags_t flags);
+
+// marks a range of pages as unusable. see buddy_page_offline for after
+// buddy_ready
 void buddy_mark_unusable(struct buddy_allocator_s *ba, uint64_t min_page_id, uint64_t max_page_id);
 
 // marks the buddy allocator as ready to use budy allocator must be initialized before this
 void buddy_ready(struct buddy_allocator_s *ba);
 
-// validate all the invariants of the buddy allocator heap. used for debugging
+// validate all the invariants of the buddy allocator heap, calling fatal on the
+// first that doesn't hold. prints nothing, so it can be left on in testing
+// builds. takes O(n), see BUDDY_DEBUG for a cheaper check
 void buddy_verify(struct buddy_allocator_s *ba);
 
+// prints every entry of the heap on one line. used for debugging
+void buddy_dump(struct buddy_allocator_s *ba);
+
+// the number of bytes that buddy_snapshot writes for ba
+uint64_t buddy_snapshot_get_bytes(struct buddy_allocator_s *ba);
+
+// copies the state of a ready allocator to buf, in a versioned and checksummed
+// format that buddy_restore reads back, so that a restart doesn't have to redo
+// every allocation. only another build with the same BUDDY_LAYOUT can restore
+// it. no other thread may use the allocator meanwhile
+// returns BUDDY_STATUS_INVAL if buf is shorter than buddy_snapshot_get_bytes
+buddy_status_t buddy_snapshot(struct buddy_allocator_s *ba, void *buf, uint64_t bytes);
+
+// sets ba_bytes to how much memory buddy_restore needs for the snapshot in buf
+// returns BUDDY_STATUS_INVAL if buf doesn't hold a snapshot this build reads
+buddy_status_t buddy_restore_get_bytes(const void *buf, uint64_t bytes, uint64_t *ba_bytes);
+
+// makes ba a ready allocator in the state that the snapshot in buf was taken
+// in. takes one copy of the snapshot, whatever the number of allocations.
+// ba: a pointer to at least buddy_restore_get_bytes bytes, at any address
+// returns BUDDY_STATUS_INVAL, and leaves ba unusable, if buf doesn't hold a
+// snapshot this build reads or its checksum doesn't match
+buddy_status_t buddy_restore(struct buddy_allocator_s *ba, const void *buf, uint64_t bytes);
+
 // returns the status of the allocation. sets page_id
 [[nodiscard("allocations may fail")]]
 buddy_status_t buddy_page_alloc(struct buddy_allocator_s *ba, uint64_t n_pages, uint64_t* page_id);
@@ -37,6 +167,101 @@ buddy_status_t buddy_page_alloc(struct buddy_allocator_s *ba, uint64_t n_pages,
 // accepts the page_id of the start of the allocation
 buddy_status_t buddy_page_free(struct buddy_allocator_s *ba, uint64_t page_id);
 
+// allocates the block of n_pages, rounded up to a power of 2, that starts at
+// page_id, splitting the free block that holds it. in O(log n)
+// returns BUDDY_STATUS_INVAL if page_id is not a multiple of the rounded up
+// n_pages, or with BUDDY_FLAG_LOCKFREE or BUDDY_FLAG_BITMAP, or
+// BUDDY_STATUS_NOMEM if any of its pages is not free
+[[nodiscard("allocations may fail")]]
+buddy_status_t buddy_page_alloc_at(struct buddy_allocator_s *ba, uint64_t page_id, uint64_t n_pages);
+
+// takes the free pages from min_page_id to max_page_id out of a ready heap, as
+// buddy_mark_unusable does before buddy_ready. they leave usable_pages, and
+// buddy_page_online puts them back. in O(log n)
+// returns BUDDY_STATUS_NOMEM, changing nothing, if any of them is not free, or
+// BUDDY_STATUS_INVAL with BUDDY_FLAG_LOCKFREE or BUDDY_FLAG_BITMAP
+buddy_status_t buddy_page_offline(struct buddy_allocator_s *ba, uint64_t min_page_id, uint64_t max_page_id);
+
+// makes the unusable pages from min_page_id to max_page_id free again, and
+// merges them with their free buddies. works for pages marked by
+// buddy_mark_unusable too, but not past n_pages. in O(log n)
+// returns BUDDY_STATUS_INVAL, changing nothing, if any of them is usable, or
+// with BUDDY_FLAG_LOCKFREE or BUDDY_FLAG_BITMAP
+buddy_status_t buddy_page_online(struct buddy_allocator_s *ba, uint64_t min_page_id, uint64_t max_page_id);
+
+// sets n_pages to the number of pages actually reserved for the allocation
+// starting at page_id, which may be more than were requested
+buddy_status_t buddy_page_size_of(struct buddy_allocator_s *ba, uint64_t page_id, uint64_t *n_pages);
+
+// same as buddy_page_alloc, but only reserves n_pages pages. the rest of the
+// power of 2 block is given back to the heap. must be freed with
+// buddy_page_free_exact and the same n_pages
+[[nodiscard("allocations may fail")]]
+buddy_status_t buddy_page_alloc_exact(struct buddy_allocator_s *ba, uint64_t n_pages, uint64_t* page_id);
+
+// frees an allocation made by buddy_page_alloc_exact
+buddy_status_t buddy_page_free_exact(struct buddy_allocator_s *ba, uint64_t page_id, uint64_t n_pages);
+
+// returns how many pages the live exact allocations left free that rounding
+// up to a power of 2 would have reserved
+uint64_t buddy_get_saved_pages(struct buddy_allocator_s *ba);
+
+// fills in stats in O(BUDDY_STATS_ORDERS), without walking the heap. with
+// BUDDY_FLAG_LOCKFREE only the page and allocation counts are kept, and the
+// free blocks, largest_free_pages and fragmentation read 0. the counts are
+// separate atomics there, so a snapshot taken during concurrent calls may be
+// off by the calls in flight
+void buddy_get_stats(struct buddy_allocator_s *ba, struct buddy_stats_s *stats);
+
+// merges the blocks that BUDDY_FLAG_DEFER holds back with their free buddies,
+// for when large blocks are about to be needed
+void buddy_defer_flush(struct buddy_allocator_s *ba);
+
+// resizes the allocation starting at page_id to n_pages without moving it.
+// grows by taking over free buddies and shrinks by freeing the upper halves.
+// returns BUDDY_STATUS_NOMEM and leaves the allocation as it was if it can't
+// be resized in place
+buddy_status_t buddy_page_realloc(struct buddy_allocator_s *ba, uint64_t page_id, uint64_t n_pages);
+
+// allocates up to count blocks of n_pages each in one pass over the heap.
+// sets the first count entries of page_ids. returns how many were allocated
+[[nodiscard("allocations may fail")]]
+uint64_t buddy_page_alloc_bulk(struct buddy_allocator_s *ba, uint64_t n_pages, uint64_t count, uint64_t* page_ids);
+
+// frees count allocations in one pass over the heap. page_ids is sorted in
+// place. returns how many were freed
+uint64_t buddy_page_free_bulk(struct buddy_allocator_s *ba, uint64_t* page_ids, uint64_t count);
+
+// one step of a buddy_defrag_plan: the allocated block of n_pages pages at
+// page_id is to be moved to the free pages at dest_page_id
+struct buddy_move_s {
+  uint64_t page_id;
+  uint64_t n_pages;
+  uint64_t dest_page_id;
+};
+
+// for when an allocation of 2^order pages fails although enough pages are
+// free. finds the block of 2^order pages that is cheapest to empty: the fewest
+// allocated pages in it, then the fewest allocations, and room for all of them
+// outside of it. sets page_id to its first page and the first n_moves entries
+// of moves to where each allocation in it can go. doing the moves in that
+// order with buddy_page_migrate frees the block, as long as nothing else is
+// allocated in between. n_moves is 0 if such a block is free already.
+// only blocks holding at most max_moves allocations are looked at, which
+// bounds the work of the moves. the pieces of a buddy_page_alloc_exact
+// allocation are separate allocations here, so moving one splits it up
+// returns BUDDY_STATUS_NOMEM if no block can be emptied in max_moves, or
+// BUDDY_STATUS_INVAL with BUDDY_FLAG_LOCKFREE or BUDDY_FLAG_BITMAP
+buddy_status_t buddy_defrag_plan(struct buddy_allocator_s *ba, uint8_t order, struct buddy_move_s *moves, uint64_t max_moves, uint64_t *n_moves, uint64_t *page_id);
+
+// moves the allocation starting at page_id to dest_page_id in one step: the
+// pages there are allocated and the old ones freed, or neither if it fails.
+// the caller copies the contents over
+// returns BUDDY_STATUS_NOMEM if any page of the destination isn't free, or
+// BUDDY_STATUS_INVAL if dest_page_id is not a multiple of the allocation's
+// size, or with BUDDY_FLAG_LOCKFREE or BUDDY_FLAG_BITMAP
+buddy_status_t buddy_page_migrate(struct buddy_allocator_s *ba, uint64_t page_id, uint64_t dest_page_id);
+
 // returns the status of the allocation. sets mem
 [[nodiscard("allocations may fail")]]
 buddy_status_t buddy_mem_alloc(struct buddy_allocator_s *ba, uint64_t n_bytes, void** mem);
@@ -44,4 +269,21 @@ buddy_status_t buddy_mem_alloc(struct buddy_allocator_s *ba, uint64_t n_bytes, v
 // accepts the pointer to the start of the allocation
 buddy_status_t buddy_mem_free(struct buddy_allocator_s *ba, void* mem);
 
+// same as buddy_mem_alloc, but only reserves the pages that n_bytes covers
+[[nodiscard("allocations may fail")]]
+buddy_status_t buddy_mem_alloc_exact(struct buddy_allocator_s *ba, uint64_t n_bytes, void** mem);
+
+// frees an allocation made by buddy_mem_alloc_exact with the same n_bytes
+buddy_status_t buddy_mem_free_exact(struct buddy_allocator_s *ba, void* mem, uint64_t n_bytes);
+
+// resizes the allocation at mem to n_bytes and sets new_mem. resizes in place
+// when it can, otherwise moves the contents to a new allocation and frees mem.
+// if mem is NULL, this is the same as buddy_mem_alloc
+[[nodiscard("allocations may fail")]]
+buddy_status_t buddy_mem_realloc(struct buddy_allocator_s *ba, void* mem, uint64_t n_bytes, void** new_mem);
+
+// sets n_bytes to the number of bytes that may be used in the allocation
+// starting at mem, which may be more than were requested
+buddy_status_t buddy_mem_usable_size(struct buddy_allocator_s *ba, void* mem, uint64_t *n_bytes);
+
 #endif // BUDDY_ALLOCATOR_H
@@ -0,0 +1,66 @@
+#ifndef BUDDY_ARENA_H
+#define BUDDY_ARENA_H
+
+#include <stdalign.h>
+#include <stdint.h>
+
+#include "buddy_allocator.h"
+
+// one managed range split into independent heaps (shards), each with its own
+// lock, or lock-free if BUDDY_FLAG_LOCKFREE is given. each thread allocates
+// from its home shard and steals from the others once it runs out. page ids
+// and addresses are global, a free goes to the shard that owns the page.
+struct buddy_arena_s {
+  // the number of shards actually in use
+  uint32_t n_shards;
+  // the pages in each shard, the last one may have fewer
+  uint64_t shard_pages;
+  // the distance in bytes from one shard to the next in shards
+  uint64_t shard_stride;
+  // the offset and page size the arena was created with
+  uint64_t offset;
+  uint8_t page_size_log2;
+  // the BUDDY_FLAG_* values given to every shard
+  buddy_flags_t flags;
+  // each shard is a lock followed by its heap, on its own cache lines as long
+  // as the arena itself is 64 byte aligned
+  alignas(64) uint8_t shards[];
+};
+
+// gets the necessary number of bytes to construct an arena whose shards use
+// flags, see buddy_get_bytes_flags. always a multiple of 64
+uint64_t buddy_arena_get_bytes(uint64_t n_pages, uint32_t n_shards, buddy_flags_t flags);
+
+// initializes an arena from uninitialized memory
+// as: a pointer to 64 byte aligned memory at least
+// buddy_arena_get_bytes(n_pages, n_shards, flags) long
+// n_shards: at most n_pages. fewer shards are used if the pages don't divide
+// evenly enough to give every shard at least one page
+// flags: a combination of BUDDY_FLAG_* values passed to every shard, the same
+// as given to buddy_arena_get_bytes
+void buddy_arena_init(struct buddy_arena_s *as, uint64_t n_pages, uint64_t page_size, uint64_t offset, uint32_t n_shards, buddy_flags_t flags);
+
+// marks a range of pages as unusable in whichever shards hold them
+void buddy_arena_mark_unusable(struct buddy_arena_s *as, uint64_t min_page_id, uint64_t max_page_id);
+
+// marks every shard as ready to use
+void buddy_arena_ready(struct buddy_arena_s *as);
+
+// releases the locks of the shards. the memory may be freed afterwards
+void buddy_arena_destroy(struct buddy_arena_s *as);
+
+// returns the status of the allocation. sets page_id
+[[nodiscard("allocations may fail")]]
+buddy_status_t buddy_arena_page_alloc(struct buddy_arena_s *as, uint64_t n_pages, uint64_t *page_id);
+
+// accepts the page_id of the start of the allocation
+buddy_status_t buddy_arena_page_free(struct buddy_arena_s *as, uint64_t page_id);
+
+// returns the status of the allocation. sets mem
+[[nodiscard("allocations may fail")]]
+buddy_status_t buddy_arena_mem_alloc(struct buddy_arena_s *as, uint64_t n_bytes, void **mem);
+
+// accepts the pointer to the start of the allocation
+buddy_status_t buddy_arena_mem_free(struct buddy_arena_s *as, void *mem);
+
+#endif // BUDDY_ARENA_H
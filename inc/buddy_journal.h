@@ -0,0 +1,86 @@
+#ifndef BUDDY_JOURNAL_H
+#define BUDDY_JOURNAL_H
+
+#include <stdint.h>
+
+#include "buddy_allocator.h"
+
+// keeps an allocator recoverable from disk without rewriting all of its
+// metadata on every change. while a journal is open, every byte of the tree
+// that an operation changes is noted in memory, which is O(log n) bytes per
+// operation. buddy_journal_commit appends the notes since the last commit to
+// the log as one batch with one fsync, and every BUDDY_JOURNAL_CHECKPOINT_BYTES
+// of log the allocator is written out as a snapshot (see buddy_snapshot) and
+// the log starts over. buddy_journal_recover restores the last snapshot and
+// replays the batches committed after it.
+// only the tree is journaled, so the allocator can't have BUDDY_FLAG_LOCKFREE
+// or BUDDY_FLAG_BITMAP. operations and journal calls must not overlap
+
+// the bytes of log after which a commit writes a checkpoint
+#ifndef BUDDY_JOURNAL_CHECKPOINT_BYTES
+#define BUDDY_JOURNAL_CHECKPOINT_BYTES ((uint64_t)64 << 20)
+#endif
+
+struct buddy_journal_s;
+
+// the fields of the allocator that change without a write to the tree. every
+// batch ends with them
+struct buddy_journal_counters_s {
+  uint64_t allocated_pages;
+  uint64_t saved_pages;
+  uint64_t n_allocs;
+  uint64_t n_frees;
+  uint64_t n_failed;
+  uint64_t next_fit_page;
+};
+
+// starts journaling a ready allocator. writes a checkpoint of it first, so
+// that the files at snapshot_path and log_path are replaced
+// returns BUDDY_STATUS_INVAL if ba can't be journaled or the files can't be
+// written, or BUDDY_STATUS_NOMEM
+buddy_status_t buddy_journal_open(struct buddy_allocator_s *ba, const char *snapshot_path, const char *log_path, struct buddy_journal_s **journal);
+
+// makes every operation since the last commit durable, with one write and one
+// fsync of the log, then checkpoints if the log has grown past
+// BUDDY_JOURNAL_CHECKPOINT_BYTES
+// returns BUDDY_STATUS_INVAL if the log can't be written. the operations stay
+// pending, and the next commit tries again
+buddy_status_t buddy_journal_commit(struct buddy_journal_s *journal);
+
+// writes the allocator as it is now to the snapshot and empties the log, which
+// commits too. a crash at any point leaves either the old checkpoint and log,
+// or the new ones
+buddy_status_t buddy_journal_checkpoint(struct buddy_journal_s *journal);
+
+// commits, stops journaling and frees the journal
+buddy_status_t buddy_journal_close(struct buddy_journal_s *journal);
+
+// sets ba_bytes to how much memory buddy_journal_recover needs
+buddy_status_t buddy_journal_recover_get_bytes(const char *snapshot_path, uint64_t *ba_bytes);
+
+// rebuilds ba as of the last commit. a batch that was cut short by a crash is
+// ignored, along with everything after it. journaling does not resume until
+// buddy_journal_open is called on ba
+// returns BUDDY_STATUS_INVAL if the snapshot is missing or can't be restored,
+// or BUDDY_STATUS_NOMEM
+buddy_status_t buddy_journal_recover(struct buddy_allocator_s *ba, const char *snapshot_path, const char *log_path);
+
+// the following connect the journal to the allocator
+
+// makes ba note its changes to journal, or stops it if journal is NULL
+// returns BUDDY_STATUS_INVAL if ba is not ready or is not using the tree
+buddy_status_t buddy_journal_attach(struct buddy_allocator_s *ba, struct buddy_journal_s *journal);
+
+// called by the allocator for each byte of the tree it changes. offset is
+// counted from the start of the tree, wherever the allocator is in memory
+void buddy_journal_note(struct buddy_journal_s *journal, uint64_t offset, uint8_t value);
+
+void buddy_journal_get_counters(struct buddy_allocator_s *ba, struct buddy_journal_counters_s *counters);
+
+// writes the noted bytes, each one (offset << 8) | value, in order, then sets
+// the counters and recounts the free blocks and usable pages
+// returns BUDDY_STATUS_INVAL, with ba left as it was, if an offset is past the
+// end of the tree
+buddy_status_t buddy_journal_replay(struct buddy_allocator_s *ba, const uint64_t *notes, uint64_t n_notes, const struct buddy_journal_counters_s *counters);
+
+#endif // BUDDY_JOURNAL_H
@@ -0,0 +1,33 @@
+#ifndef buddy_math_h_INCLUDED
+#define buddy_math_h_INCLUDED
+
+#include <stdint.h>
+
+static inline bool uint64_is_power_of_2(uint64_t x) {
+  return __builtin_popcountll(x) == 1;
+}
+
+static inline uint8_t uint64_log2(uint64_t v) {
+  return 8 * (uint8_t)sizeof(uint64_t) - (uint8_t)__builtin_clzll(v) - 1;
+}
+
+static inline uint8_t uint64_ceil_log2(uint64_t v) {
+  return uint64_log2(v) + !uint64_is_power_of_2(v);
+}
+
+// the index of the lowest set bit, v must not be 0
+static inline uint8_t uint64_ctz(uint64_t v) {
+  return (uint8_t)__builtin_ctzll(v);
+}
+
+static inline uint64_t uint64_pow2(uint8_t i) { return (uint64_t)1 << i; }
+
+static inline uint8_t uint8_min(uint8_t a, uint8_t b) {
+  if (a < b) {
+    return a;
+  } else {
+    return b;
+  }
+}
+
+#endif // buddy_math_h_INCLUDED
@@ -0,0 +1,51 @@
+#ifndef BUDDY_SLAB_H
+#define BUDDY_SLAB_H
+
+#include <stdint.h>
+#include <threads.h>
+
+#include "buddy_allocator.h"
+
+// the smallest object is 2^BUDDY_SLAB_MIN_ORDER bytes
+#define BUDDY_SLAB_MIN_ORDER 4
+// size classes are the powers of 2 from the smallest object up. requests for
+// more than fits twice in a slab go straight to the heap
+#define BUDDY_SLAB_CLASSES 8
+
+// sits at the start of every slab, defined in buddy_slab.c
+struct buddy_slab_header_s;
+
+// carves objects smaller than a page out of slabs taken from the heap with
+// buddy_mem_alloc. slabs are aligned to their size, so a free finds the slab
+// header by masking the pointer. not thread safe, each thread must own its
+// own slab allocator.
+struct buddy_slab_s {
+  struct buddy_allocator_s *ba;
+  // held around every call into the heap, NULL if the heap is lock-free
+  mtx_t *lock;
+  // the size of every slab, a power of 2
+  uint64_t slab_bytes;
+  // the number of slabs currently taken from the heap
+  uint64_t n_slabs;
+  // for each size class, the slabs that have at least one free object
+  struct buddy_slab_header_s *partial[BUDDY_SLAB_CLASSES];
+};
+
+// initializes an empty slab allocator in front of ba
+// lock: the mutex guarding ba, or NULL if ba was created with BUDDY_FLAG_LOCKFREE
+// slab_bytes: must be a power of 2 at least the page size of ba. the offset of
+// ba must be a multiple of slab_bytes
+void buddy_slab_init(struct buddy_slab_s *sa, struct buddy_allocator_s *ba, mtx_t *lock, uint64_t slab_bytes);
+
+// returns the status of the allocation. sets mem
+[[nodiscard("allocations may fail")]]
+buddy_status_t buddy_slab_alloc(struct buddy_slab_s *sa, uint64_t n_bytes, void **mem);
+
+// accepts a pointer returned by buddy_slab_alloc
+buddy_status_t buddy_slab_free(struct buddy_slab_s *sa, void *mem);
+
+// returns every empty slab to the heap. one empty slab per size class is kept
+// otherwise, so that alternating allocs and frees don't go to the heap
+void buddy_slab_drain(struct buddy_slab_s *sa);
+
+#endif // BUDDY_SLAB_H
@@ -0,0 +1,53 @@
+#ifndef BUDDY_TCACHE_H
+#define BUDDY_TCACHE_H
+
+#include <stdint.h>
+#include <threads.h>
+
+#include "buddy_allocator.h"
+
+// the largest order kept in a thread cache, larger requests go to the heap
+#define BUDDY_TCACHE_MAX_ORDER 3
+// the most blocks a thread cache can hold per order
+#define BUDDY_TCACHE_CAPACITY 64
+
+// a per-thread stack of already split blocks for each small order.
+// blocks in the cache are allocated as far as the heap is concerned, so the
+// common path never touches the heap. each thread must own its own cache.
+struct buddy_tcache_s {
+  struct buddy_allocator_s *ba;
+  // held around every call into the heap, NULL if the heap is lock-free
+  mtx_t *lock;
+  // a refill fills an order up to this many blocks, a flush empties it down to
+  // this many blocks
+  uint32_t low_watermark;
+  // an order is flushed once it holds this many blocks
+  uint32_t high_watermark;
+  uint32_t count[BUDDY_TCACHE_MAX_ORDER + 1];
+  uint64_t page_ids[BUDDY_TCACHE_MAX_ORDER + 1][BUDDY_TCACHE_CAPACITY];
+};
+
+// initializes an empty thread cache in front of ba
+// lock: the mutex guarding ba, or NULL if ba was created with BUDDY_FLAG_LOCKFREE
+// low_watermark: must be at least 1 and less than high_watermark
+// high_watermark: must be at most BUDDY_TCACHE_CAPACITY
+void buddy_tcache_init(struct buddy_tcache_s *tc, struct buddy_allocator_s *ba, mtx_t *lock, uint32_t low_watermark, uint32_t high_watermark);
+
+// returns the status of the allocation. sets page_id
+[[nodiscard("allocations may fail")]]
+buddy_status_t buddy_tcache_page_alloc(struct buddy_tcache_s *tc, uint64_t n_pages, uint64_t *page_id);
+
+// accepts the page_id of the start of the allocation and the n_pages it was
+// allocated with. returns BUDDY_STATUS_NO_SUCH_ALLOCATION, caching nothing, if
+// page_id is already in this cache. the heap is not looked at, so a page that
+// doesn't start an allocation of that size calls fatal when it is flushed
+// back to the heap, and so does one that another cache flushed first, unless
+// the heap handed it out again in between. with BUDDY_DEBUG the heap is
+// asked at the free, under the lock, and such a page is refused right away
+buddy_status_t buddy_tcache_page_free(struct buddy_tcache_s *tc, uint64_t page_id, uint64_t n_pages);
+
+// returns every cached block to the heap. must be called before the owning
+// thread exits
+void buddy_tcache_drain(struct buddy_tcache_s *tc);
+
+#endif // BUDDY_TCACHE_H
@@ -0,0 +1,69 @@
+#ifndef BUDDY_TRACE_H
+#define BUDDY_TRACE_H
+
+#include <stdint.h>
+
+#include "buddy_allocator.h"
+
+// when the allocator is built with -DBUDDY_TRACE, every buddy_page_* call that
+// allocates, frees or resizes appends a record to a ring owned by the calling
+// thread, so tracing takes no locks and threads never share a cache line.
+// buddy_trace_dump moves the records out to a file, where they can be fed
+// back into any configuration with `ba-bench replay`. without BUDDY_TRACE
+// nothing is recorded and a dump only writes the header
+
+// the records each thread keeps until they are dumped, must be a power of 2
+#ifndef BUDDY_TRACE_RING
+#define BUDDY_TRACE_RING 65536
+#endif
+
+#define BUDDY_TRACE_ALLOC 0
+#define BUDDY_TRACE_FREE 1
+#define BUDDY_TRACE_ALLOC_EXACT 2
+#define BUDDY_TRACE_FREE_EXACT 3
+#define BUDDY_TRACE_REALLOC 4
+
+// "BTRC" at the start of every trace file
+#define BUDDY_TRACE_MAGIC 0x43525442
+#define BUDDY_TRACE_VERSION 1
+
+// the first bytes of a trace file, followed by the records. both are written
+// in the byte order of the machine that traced them
+struct buddy_trace_header_s {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t record_bytes;
+};
+
+struct buddy_trace_record_s {
+  // from timespec_get, so that the records of all threads share one clock
+  uint64_t ns;
+  // the page_id passed in, or set by a successful allocation
+  uint64_t page_id;
+  // the pages asked for, saturated at UINT32_MAX. 0 for buddy_page_free
+  uint32_t n_pages;
+  // one of the BUDDY_TRACE_* ops
+  uint8_t op;
+  // the buddy_status_t that was returned
+  uint8_t status;
+  // which heap, numbered in the order they were initialized
+  uint16_t heap;
+};
+
+// gets a number for a new heap. called by buddy_init_flags
+uint16_t buddy_trace_heap_id(void);
+
+// appends a record to the ring of the calling thread, overwriting its oldest
+// record if the ring is full
+void buddy_trace_record(uint16_t heap, uint8_t op, uint64_t n_pages, uint64_t page_id, buddy_status_t status);
+
+// appends the records of every thread that were traced since the last dump to
+// the file at path, in time order. writes the header first if the file is
+// empty. must not be called by two threads at once.
+// lost: set to the number of records that were overwritten before this dump
+// returns BUDDY_STATUS_NOMEM if the records don't fit in memory, or
+// BUDDY_STATUS_INVAL if the file can't be written. either way they are kept
+// for the next dump, as far as the rings hold them
+buddy_status_t buddy_trace_dump(const char *path, uint64_t *lost);
+
+#endif // BUDDY_TRACE_H
@@ -0,0 +1,72 @@
+#ifndef BUDDY_ZONE_H
+#define BUDDY_ZONE_H
+
+#include <stdint.h>
+
+#include "buddy_allocator.h"
+
+#define BUDDY_ZONES_MAX 16
+
+// one contiguous window of memory given to a zone set
+struct buddy_zone_range_s {
+  uint64_t base;
+  uint64_t n_bytes;
+};
+
+struct buddy_zone_s {
+  // the first and one past the last managed address
+  uint64_t base;
+  uint64_t end;
+  // where the heap of this zone starts in heaps
+  uint64_t heap_offset;
+};
+
+// several disjoint memory ranges, each backed by its own heap sized for just
+// that range. zones are numbered in the order they were given, which is also
+// the default preference order for allocations. like a single heap, a zone
+// set is not thread safe unless BUDDY_FLAG_LOCKFREE is given.
+struct buddy_zones_s {
+  uint32_t n_zones;
+  uint8_t page_size_log2;
+  struct buddy_zone_s zones[BUDDY_ZONES_MAX];
+  // zone numbers sorted by base address, to find the zone of a pointer
+  uint8_t by_base[BUDDY_ZONES_MAX];
+  // the heaps of the zones, each on its own cache lines
+  uint8_t heaps[];
+};
+
+// gets the necessary number of bytes to construct a zone set whose heaps use
+// flags, see buddy_get_bytes_flags
+uint64_t buddy_zones_get_bytes(const struct buddy_zone_range_s *ranges, uint32_t n_ranges, uint64_t page_size, buddy_flags_t flags);
+
+// initializes a zone set from uninitialized memory
+// zs: a pointer to memory at least buddy_zones_get_bytes(ranges, n_ranges, page_size, flags) long
+// ranges: at most BUDDY_ZONES_MAX non-overlapping ranges in preference order.
+// a range is shrunk to whole pages and must keep at least one
+// flags: a combination of BUDDY_FLAG_* values passed to every zone, the same
+// as given to buddy_zones_get_bytes
+void buddy_zones_init(struct buddy_zones_s *zs, const struct buddy_zone_range_s *ranges, uint32_t n_ranges, uint64_t page_size, buddy_flags_t flags);
+
+// marks every zone as ready to use
+void buddy_zones_ready(struct buddy_zones_s *zs);
+
+// gets the heap of a zone, for marking pages unusable or other per-zone calls
+struct buddy_allocator_s *buddy_zones_heap(struct buddy_zones_s *zs, uint32_t zone);
+
+// returns BUDDY_STATUS_NO_SUCH_ALLOCATION if mem is outside every zone. sets zone
+buddy_status_t buddy_zones_find(struct buddy_zones_s *zs, void *mem, uint32_t *zone);
+
+// returns the status of the allocation. sets mem
+// tries the zones in the order they were given
+[[nodiscard("allocations may fail")]]
+buddy_status_t buddy_zones_mem_alloc(struct buddy_zones_s *zs, uint64_t n_bytes, void **mem);
+
+// returns the status of the allocation. sets mem
+// tries zone first, then falls back to the others in the order they were given
+[[nodiscard("allocations may fail")]]
+buddy_status_t buddy_zones_mem_alloc_from(struct buddy_zones_s *zs, uint32_t zone, uint64_t n_bytes, void **mem);
+
+// accepts the pointer to the start of the allocation from any zone
+buddy_status_t buddy_zones_mem_free(struct buddy_zones_s *zs, void *mem);
+
+#endif // BUDDY_ZONE_H
@@ -1,21 +1,57 @@
 #include "buddy_allocator.h"
 
-// TODO: implement https://arxiv.org/pdf/1804.03436
-
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
 
+#include "buddy_journal.h"
+#include "buddy_math.h"
+#include "buddy_trace.h"
 #include "debug.h"
 
 #define BUDDY_LEVEL_FILLED 255
 #define BUDDY_LEVEL_ALLOCATED 254
 #define BUDDY_LEVEL_UNUSABLE 253
 #define BUDDY_LEVEL_MAX_VALID 252
+// the first leaf of an allocated block above the bottom level holds
+// BUDDY_LEVEL_HEAD + the level of the block, so that a free can find the block
+// without walking down from the root. leaves below an allocated block are not
+// otherwise used, so this costs no extra memory
+#define BUDDY_LEVEL_HEAD 128
 
 #define BUDDY_STATE_UNREADY 0
 #define BUDDY_STATE_READY 1
 
+// node states used by BUDDY_FLAG_LOCKFREE, see the LOCK-FREE FUNCTIONS section
+#define NB_OCC_RIGHT 0x01
+#define NB_OCC_LEFT 0x02
+#define NB_COAL_RIGHT 0x04
+#define NB_COAL_LEFT 0x08
+#define NB_OCC 0x10
+#define NB_UNUSABLE 0x20
+#define NB_BUSY (NB_OCC | NB_OCC_LEFT | NB_OCC_RIGHT)
+
+// page states used by BUDDY_FLAG_BITMAP, see the BITMAP FUNCTIONS section
+#define BM_PAGE_NONE 255
+#define BM_MAX_ORDERS 64
+
+// with BUDDY_LAYOUT_BLOCKED, the heap is stored in 64 byte blocks, each holding
+// a subtree of BLOCKED_LEVELS levels
+#define BLOCKED_LEVELS 6
+#define BLOCKED_BYTES 64
+#define BLOCKED_MAX_LEVELS 64
+
+// BUDDY_LAYOUT_COMPACT
+#define COMPACT_MAX_LEVELS 64
+
+// BUDDY_FLAG_DEFER holds up to DEFER_BLOCKS freed blocks of each order below
+// DEFER_ORDERS, see the DEFER FUNCTIONS section
+#define DEFER_ORDERS 8
+#define DEFER_BLOCKS 8
+
 // DEFINITIONS:
 // level: the root of a heap has level 0, it's children have level 1, etc
 
@@ -27,13 +63,60 @@ struct buddy_allocator_s {
   // the offset applied to the buddy_mem_* class of functions when converting
   // from an address to a page_id
   uint64_t offset;
+  // the BUDDY_FLAG_* values passed to buddy_init_flags
+  buddy_flags_t flags;
   // the log_2(page_size). Used for the buddy_mem_* class of functions
   uint8_t page_size_log2;
   // buddy allocator state
   uint8_t state;
   // the maximum level in the heap
   uint8_t max_level;
-  // has (n_levels+1)^2 -1 entries forming a binary heap
+  // the number of pages managed, the rest of the 2^max_level are unusable
+  uint64_t n_pages;
+  // with BUDDY_FLAG_NEXT_FIT, the page after the previous allocation
+  uint64_t next_fit_page;
+  // kept up to date by every alloc and free, buddy_get_stats fills in the
+  // fields derived from them
+  struct buddy_stats_s stats;
+#ifdef BUDDY_TRACE
+  // the number of this heap in the trace records
+  uint16_t trace_heap;
+#endif
+  // notes every change to the tree when not NULL, see buddy_journal.h
+  struct buddy_journal_s *journal;
+  // with BUDDY_FLAG_DEFER, the freed blocks of each order that are still
+  // allocated in the tree, the most recent last
+  uint8_t defer_count[DEFER_ORDERS];
+  uint64_t defer_blocks[DEFER_ORDERS][DEFER_BLOCKS];
+  // with BUDDY_FLAG_BITMAP, bit k is set when order k has a free block
+  uint64_t bm_orders;
+  // with BUDDY_FLAG_BITMAP, the word at which the bitmap of each order starts
+  uint64_t bm_offset[BM_MAX_ORDERS + 1];
+#if BUDDY_LAYOUT == BUDDY_LAYOUT_BLOCKED
+  // the number of padding bytes before the first block of heap, so that every
+  // block starts on a cache line
+  uint8_t heap_align;
+  // the offset of the first node on the bottom level of the top block
+  uint8_t top_bottom;
+  // for each level, how far (index + 1) is shifted to get the block number
+  // within its row of blocks
+  uint8_t layout_shift[BLOCKED_MAX_LEVELS];
+  // for each level, what is added to the shifted index to get the block number
+  uint64_t layout_base[BLOCKED_MAX_LEVELS];
+#elif BUDDY_LAYOUT == BUDDY_LAYOUT_COMPACT
+  // for each level, log_2 of the bits per entry, and the mask of an entry
+  uint8_t level_width[COMPACT_MAX_LEVELS];
+  uint8_t level_mask[COMPACT_MAX_LEVELS];
+  // for each level, the bit at which entry 0 would be if it were on that
+  // level, so that entry i is at level_base + (i << level_width)
+  uint64_t level_base[COMPACT_MAX_LEVELS];
+  // for each level, the bit after its last stored entry
+  uint64_t level_end[COMPACT_MAX_LEVELS];
+#endif
+  // has (n_levels+1)^2 -1 entries forming a binary heap, though the layouts
+  // may leave out the ones past n_pages (see LAYOUT FUNCTIONS)
+  // entries are always addressed by their index in this layout, heap_node maps
+  // an index to where the entry is actually stored (see LAYOUT FUNCTIONS)
   // Key properties:
   // for the n'th node, it's parent may be found at (n-1)/2
   // for the n'th node, it's left child may be found at 2*n + 1
@@ -43,35 +126,88 @@ struct buddy_allocator_s {
   // if BUDDY_LEVEL_ALLOCATED, this is allocated to some process
   // if BUDDY_LEVEL_UNUSABLE, this block should never be used or assigned
   // if BUDDY_LEVEL_FILLED, both children are greater than ba_max_valid_level
+  // when BUDDY_FLAG_LOCKFREE is set, each entry instead holds NB_* bits
+  // when BUDDY_FLAG_BITMAP is set, this holds pages and bitmaps instead
   uint8_t heap[];
 };
 
 ////////////////////////////////
-/// MATH FUNCTIONS
+/// STATS FUNCTIONS
 ////////////////////////////////
 
-static inline bool uint64_is_power_of_2(uint64_t x) {
-  return __builtin_popcountll(x) == 1;
+// from buddy_ready on, free_blocks follows every wholly free block of the tree
+// that appears or goes away. with BUDDY_FLAG_LOCKFREE, only the page and
+// allocation counts are kept, with atomics
+
+static inline void stats_add_free(struct buddy_allocator_s *ba,
+                                  uint8_t level) {
+  ba->stats.free_blocks[ba->max_level - level]++;
+}
+
+static inline void stats_remove_free(struct buddy_allocator_s *ba,
+                                     uint8_t level) {
+  ba->stats.free_blocks[ba->max_level - level]--;
+}
+
+// a free block at level was split into its two children
+static inline void stats_split(struct buddy_allocator_s *ba, uint8_t level) {
+  stats_remove_free(ba, level);
+  stats_add_free(ba, level + 1);
+  stats_add_free(ba, level + 1);
 }
 
-static inline uint8_t uint64_log2(uint64_t v) {
-  return 8 * (uint8_t)sizeof(uint64_t) - (uint8_t)__builtin_clzll(v) - 1;
+// two free children were merged into their parent at level
+static inline void stats_merge(struct buddy_allocator_s *ba, uint8_t level) {
+  stats_remove_free(ba, level + 1);
+  stats_remove_free(ba, level + 1);
+  stats_add_free(ba, level);
 }
 
-static inline uint8_t uint64_ceil_log2(uint64_t v) {
-  return uint64_log2(v) + !uint64_is_power_of_2(v);
+static inline void stats_alloc(struct buddy_allocator_s *ba,
+                               uint64_t n_pages) {
+  if (ba->flags & BUDDY_FLAG_LOCKFREE) {
+    __atomic_fetch_add(&ba->stats.allocated_pages, n_pages, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&ba->stats.n_allocs, 1, __ATOMIC_RELAXED);
+  } else {
+    ba->stats.allocated_pages += n_pages;
+    ba->stats.n_allocs++;
+  }
 }
 
-static inline uint64_t uint64_pow2(uint8_t i) { return (uint64_t)1 << i; }
+static inline void stats_free(struct buddy_allocator_s *ba, uint64_t n_pages) {
+  if (ba->flags & BUDDY_FLAG_LOCKFREE) {
+    __atomic_fetch_sub(&ba->stats.allocated_pages, n_pages, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&ba->stats.n_frees, 1, __ATOMIC_RELAXED);
+  } else {
+    ba->stats.allocated_pages -= n_pages;
+    ba->stats.n_frees++;
+  }
+}
 
-static inline uint8_t uint8_min(uint8_t a, uint8_t b) {
-  if (a < b) {
-    return a;
+static inline void stats_failed(struct buddy_allocator_s *ba) {
+  if (ba->flags & BUDDY_FLAG_LOCKFREE) {
+    __atomic_fetch_add(&ba->stats.n_failed, 1, __ATOMIC_RELAXED);
   } else {
-    return b;
+    ba->stats.n_failed++;
   }
 }
 
+// records a call in the trace of the calling thread, when built with
+// BUDDY_TRACE. otherwise this compiles to nothing
+static inline void trace(struct buddy_allocator_s *ba, uint8_t op,
+                         uint64_t n_pages, uint64_t page_id,
+                         buddy_status_t status) {
+#ifdef BUDDY_TRACE
+  buddy_trace_record(ba->trace_heap, op, n_pages, page_id, status);
+#else
+  (void)ba;
+  (void)op;
+  (void)n_pages;
+  (void)page_id;
+  (void)status;
+#endif
+}
+
 ////////////////////////////////
 /// HEAP FUNCTIONS
 ////////////////////////////////
@@ -84,6 +220,13 @@ static inline uint64_t heap_size(uint8_t max_level) {
   return uint64_pow2(max_level + 1) - 1;
 }
 
+// the number of entries on a level that cover at least one of n_pages pages.
+// the ones to their right are wholly past n_pages
+static inline uint64_t heap_level_count(uint64_t n_pages, uint8_t max_level,
+                                        uint8_t level) {
+  return ((n_pages - 1) >> (max_level - level)) + 1;
+}
+
 // the parent index of the given index
 static inline uint64_t heap_parent(uint64_t i) { return (i - 1) / 2; }
 
@@ -106,6 +249,397 @@ static inline uint64_t heap_sibling(uint64_t i) {
   }
 }
 
+////////////////////////////////
+/// LAYOUT FUNCTIONS
+////////////////////////////////
+
+// BUDDY_LAYOUT_BFS stores entry i at heap[i]. Once the tree is deeper than a
+// few levels, every step of a walk between the root and a leaf touches a
+// different cache line.
+//
+// BUDDY_LAYOUT_BLOCKED cuts the tree into rows of BLOCKED_LEVELS levels. Every
+// subtree within a row is stored in BFS order in its own 64 byte block, so a
+// root to leaf walk touches one cache line per BLOCKED_LEVELS levels. The
+// blocks of a row are stored left to right, and rows are stored top to
+// bottom. The top row is the one that may have fewer levels, so that no
+// space is wasted in the (much more numerous) bottom blocks.
+//
+// BUDDY_LAYOUT_COMPACT keeps the BFS order, but an entry at level l only ever
+// holds one of the free levels l to max_level or one of 3 special values, so
+// each level is packed into 2, 4 or 8 bits per entry, whichever is the least
+// that fits max_level - l + 4 codes. A free level is stored as its distance
+// from l, and the special values take the top 3 codes. Entries are referred
+// to by index, since most of them don't have a byte of their own. On the
+// leaves, the code of BUDDY_LEVEL_FILLED is used for the BUDDY_LEVEL_HEAD mark
+// instead, which loses the level of the block (see head_block).
+//
+// When n_pages is not a power of 2, the blocks wholly past n_pages are marked
+// unusable at their roots and nothing below those roots is ever read (see
+// heap_init_tail). BUDDY_LAYOUT_COMPACT leaves out every entry past n_pages:
+// those read as BUDDY_LEVEL_UNUSABLE and writes to them are dropped, so a
+// region of 2^k + 1 pages takes about half the entries of a 2^(k+1) page tree.
+// The other layouts keep their index arithmetic, which a check on every step
+// of a walk would slow down by half, and only leave out the tail of the array:
+// the leaves past n_pages for BUDDY_LAYOUT_BFS, and the blocks of the bottom
+// row past the one after the last page for BUDDY_LAYOUT_BLOCKED.
+
+#if BUDDY_LAYOUT == BUDDY_LAYOUT_COMPACT
+typedef uint64_t heap_ref_t;
+#else
+typedef uint8_t *heap_ref_t;
+#endif
+
+// the first byte of the tree. the blocked layout pads the heap up to a cache
+// line, so the tree moves with the allocator's address
+static inline uint8_t *heap_base(struct buddy_allocator_s *ba) {
+#if BUDDY_LAYOUT == BUDDY_LAYOUT_BLOCKED
+  return &ba->heap[ba->heap_align];
+#else
+  return ba->heap;
+#endif
+}
+
+// writes a byte of the tree, noting it in the journal if there is one
+static inline void heap_write(struct buddy_allocator_s *ba, uint8_t *byte,
+                              uint8_t value) {
+  if (ba->journal != NULL && *byte != value) {
+    *byte = value;
+    buddy_journal_note(ba->journal, (uint64_t)(byte - heap_base(ba)), value);
+    return;
+  }
+  *byte = value;
+}
+
+#if BUDDY_LAYOUT == BUDDY_LAYOUT_BLOCKED
+// the number of levels in the top row
+static uint8_t blocked_top_levels(uint8_t max_level) {
+  const uint8_t top_levels = (uint8_t)((max_level + 1) % BLOCKED_LEVELS);
+  if (top_levels == 0) {
+    return BLOCKED_LEVELS;
+  }
+  return top_levels;
+}
+
+// fills in layout_shift and layout_base if they are not NULL.
+// returns the number of blocks needed for a tree over n_pages
+static uint64_t blocked_layout(uint64_t n_pages, uint8_t *layout_shift,
+                               uint64_t *layout_base) {
+  const uint8_t max_level = uint64_ceil_log2(n_pages);
+  const uint8_t top_levels = blocked_top_levels(max_level);
+
+  // the first block of the current row
+  uint64_t row_base = 0;
+  // the number of blocks in the current row
+  uint64_t row_blocks = 1;
+  // the first level of the current row
+  uint8_t row_level = 0;
+  for (uint8_t level = 0; level <= max_level; level++) {
+    if (level >= top_levels && (level - top_levels) % BLOCKED_LEVELS == 0) {
+      // start a new row. it has one block per node at this level
+      row_base += row_blocks;
+      row_blocks = uint64_pow2(level);
+      row_level = level;
+    }
+    if (layout_shift != NULL) {
+      // within the row, (index + 1) >> shift is 2^row_level + the block number
+      layout_shift[level] = level - row_level;
+      layout_base[level] = row_base - uint64_pow2(row_level);
+    }
+  }
+  // the bottom row needs the block of the last page, and the one after it
+  // whose root may be unusable. the others are never read
+  const uint64_t needed =
+      heap_level_count(n_pages, max_level, row_level) + 1;
+  return row_base + (needed < row_blocks ? needed : row_blocks);
+}
+#endif
+
+#if BUDDY_LAYOUT == BUDDY_LAYOUT_COMPACT
+// fills in the level_* arrays of ba if it is not NULL.
+// returns the number of bits needed for a tree over n_pages
+static uint64_t compact_layout(uint64_t n_pages, struct buddy_allocator_s *ba) {
+  const uint8_t max_level = uint64_ceil_log2(n_pages);
+  uint64_t bit = 0;
+  for (uint8_t level = 0; level <= max_level; level++) {
+    const uint8_t codes = (uint8_t)(max_level - level + 4);
+    const uint8_t width = codes <= 4 ? 1 : codes <= 16 ? 2 : 3;
+    const uint64_t count = heap_level_count(n_pages, max_level, level);
+    if (ba != NULL) {
+      ba->level_width[level] = width;
+      ba->level_mask[level] = (uint8_t)((1u << (1u << width)) - 1);
+      // may wrap around, entry i is still at the right bit
+      ba->level_base[level] = bit - ((uint64_pow2(level) - 1) << width);
+      ba->level_end[level] = bit + (count << width);
+    }
+    // widths only shrink going down, and a level of 4 bit entries always
+    // takes whole nibbles, so no entry straddles a byte
+    bit += count << width;
+  }
+  return bit;
+}
+
+static inline uint8_t compact_get(struct buddy_allocator_s *ba, uint64_t i) {
+  const uint8_t level = heap_level(i);
+  const uint8_t mask = ba->level_mask[level];
+  const uint64_t bit = ba->level_base[level] + (i << ba->level_width[level]);
+  if (bit >= ba->level_end[level]) {
+    return BUDDY_LEVEL_UNUSABLE;
+  }
+  const uint8_t code = (uint8_t)(ba->heap[bit / 8] >> (bit % 8)) & mask;
+  if (code < mask - 2) {
+    return code + level;
+  } else if (code == mask - 2) {
+    return BUDDY_LEVEL_UNUSABLE;
+  } else if (code == mask - 1) {
+    return BUDDY_LEVEL_ALLOCATED;
+  }
+  return level == ba->max_level ? BUDDY_LEVEL_HEAD : BUDDY_LEVEL_FILLED;
+}
+
+static inline void compact_set(struct buddy_allocator_s *ba, uint64_t i,
+                               uint8_t v) {
+  const uint8_t level = heap_level(i);
+  const uint8_t mask = ba->level_mask[level];
+  const uint64_t bit = ba->level_base[level] + (i << ba->level_width[level]);
+  if (bit >= ba->level_end[level]) {
+    return;
+  }
+  uint8_t code;
+  if (v < BUDDY_LEVEL_HEAD) {
+    code = v - level;
+  } else if (v == BUDDY_LEVEL_UNUSABLE) {
+    code = mask - 2;
+  } else if (v == BUDDY_LEVEL_ALLOCATED) {
+    code = mask - 1;
+  } else {
+    // BUDDY_LEVEL_FILLED, or a BUDDY_LEVEL_HEAD mark on a leaf
+    code = mask;
+  }
+  uint8_t *byte = &ba->heap[bit / 8];
+  heap_write(ba, byte,
+             (uint8_t)((*byte & ~(mask << (bit % 8))) | (code << (bit % 8))));
+}
+#endif
+
+// returns where entry i of the heap is stored
+static inline heap_ref_t heap_node(struct buddy_allocator_s *ba, uint64_t i) {
+#if BUDDY_LAYOUT == BUDDY_LAYOUT_BLOCKED
+  const uint8_t level = heap_level(i);
+  const uint8_t shift = ba->layout_shift[level];
+  const uint64_t block = ba->layout_base[level] + ((i + 1) >> shift);
+  // index of the entry within the block's own BFS order
+  const uint64_t local =
+      (((i + 1) & (uint64_pow2(shift) - 1)) | uint64_pow2(shift)) - 1;
+  return &ba->heap[ba->heap_align + block * BLOCKED_BYTES + local];
+#elif BUDDY_LAYOUT == BUDDY_LAYOUT_COMPACT
+  (void)ba;
+  return i;
+#else
+  return &ba->heap[i];
+#endif
+}
+
+// the value of the entry stored at node
+static inline uint8_t node_get(struct buddy_allocator_s *ba, heap_ref_t node) {
+#if BUDDY_LAYOUT == BUDDY_LAYOUT_COMPACT
+  return compact_get(ba, node);
+#else
+  (void)ba;
+  return *node;
+#endif
+}
+
+static inline void node_set(struct buddy_allocator_s *ba, heap_ref_t node,
+                            uint8_t v) {
+#if BUDDY_LAYOUT == BUDDY_LAYOUT_COMPACT
+  compact_set(ba, node, v);
+#else
+  heap_write(ba, node, v);
+#endif
+}
+
+static inline uint8_t heap_get(struct buddy_allocator_s *ba, uint64_t i) {
+  return node_get(ba, heap_node(ba, i));
+}
+
+static inline void heap_set(struct buddy_allocator_s *ba, uint64_t i,
+                            uint8_t v) {
+  node_set(ba, heap_node(ba, i), v);
+}
+
+#if BUDDY_LAYOUT == BUDDY_LAYOUT_BLOCKED
+// whether the node at the given offset within its block is on the bottom level
+// of the block. only the top block may have fewer than BLOCKED_LEVELS levels
+static inline bool blocked_is_bottom(struct buddy_allocator_s *ba,
+                                     uint8_t *node, uint64_t local) {
+  if (node < &ba->heap[ba->heap_align + BLOCKED_BYTES]) {
+    return local >= ba->top_bottom;
+  }
+  return local >= uint64_pow2(BLOCKED_LEVELS - 1) - 1;
+}
+#endif
+
+// the following return where a relative of entry i is stored, given the node
+// where i is stored. walks use them to avoid a full heap_node lookup while
+// they stay within one block
+
+static inline heap_ref_t heap_left_node(struct buddy_allocator_s *ba,
+                                        uint64_t i, heap_ref_t node) {
+#if BUDDY_LAYOUT == BUDDY_LAYOUT_BLOCKED
+  const uint64_t local = (uintptr_t)node % BLOCKED_BYTES;
+  if (blocked_is_bottom(ba, node, local)) {
+    // the children start a new row of blocks
+    return heap_node(ba, heap_left(i));
+  }
+  return node + local + 1;
+#else
+  (void)ba;
+  return node + i + 1;
+#endif
+}
+
+static inline heap_ref_t heap_right_node(struct buddy_allocator_s *ba,
+                                         uint64_t i, heap_ref_t node) {
+#if BUDDY_LAYOUT == BUDDY_LAYOUT_BLOCKED
+  const uint64_t local = (uintptr_t)node % BLOCKED_BYTES;
+  if (blocked_is_bottom(ba, node, local)) {
+    return heap_node(ba, heap_right(i));
+  }
+  return node + local + 2;
+#else
+  (void)ba;
+  return node + i + 2;
+#endif
+}
+
+static inline heap_ref_t heap_parent_node(struct buddy_allocator_s *ba,
+                                          uint64_t i, heap_ref_t node) {
+#if BUDDY_LAYOUT == BUDDY_LAYOUT_BLOCKED
+  const uint64_t local = (uintptr_t)node % BLOCKED_BYTES;
+  if (local == 0) {
+    // i is the root of its block
+    return heap_node(ba, heap_parent(i));
+  }
+  return node - local + (local - 1) / 2;
+#else
+  (void)ba;
+  return node - i + heap_parent(i);
+#endif
+}
+
+static inline heap_ref_t heap_sibling_node(struct buddy_allocator_s *ba,
+                                           uint64_t i, heap_ref_t node) {
+  (void)ba;
+#if BUDDY_LAYOUT == BUDDY_LAYOUT_BLOCKED
+  const uint64_t local = (uintptr_t)node % BLOCKED_BYTES;
+  if (local == 0) {
+    // the roots of sibling blocks are in neighboring blocks
+    return i % 2 == 1 ? node + BLOCKED_BYTES : node - BLOCKED_BYTES;
+  }
+  return local % 2 == 1 ? node + 1 : node - 1;
+#else
+  return i % 2 == 1 ? node + 1 : node - 1;
+#endif
+}
+
+// the number of bytes needed to store a heap over n_pages
+static uint64_t heap_bytes(uint64_t n_pages) {
+#if BUDDY_LAYOUT == BUDDY_LAYOUT_BLOCKED
+  // leave room to align the first block
+  return BLOCKED_BYTES - 1 +
+         blocked_layout(n_pages, NULL, NULL) * BLOCKED_BYTES;
+#elif BUDDY_LAYOUT == BUDDY_LAYOUT_COMPACT
+  return (compact_layout(n_pages, NULL) + 7) / 8;
+#else
+  // the leaf after the last page may be an unusable root, the ones after it
+  // are never read
+  const uint8_t max_level = uint64_ceil_log2(n_pages);
+  const uint64_t bytes = uint64_pow2(max_level) + n_pages;
+  return bytes < heap_size(max_level) ? bytes : heap_size(max_level);
+#endif
+}
+
+// the bytes of the tree from heap_base, without the blocked layout's padding
+static uint64_t heap_tree_bytes(uint64_t n_pages) {
+#if BUDDY_LAYOUT == BUDDY_LAYOUT_BLOCKED
+  return heap_bytes(n_pages) - (BLOCKED_BYTES - 1);
+#else
+  return heap_bytes(n_pages);
+#endif
+}
+
+// sets up whatever heap_node needs to map indices
+static void heap_layout_init(struct buddy_allocator_s *ba) {
+#if BUDDY_LAYOUT == BUDDY_LAYOUT_BLOCKED
+  const uintptr_t misalignment = (uintptr_t)ba->heap % BLOCKED_BYTES;
+  ba->heap_align = (uint8_t)((BLOCKED_BYTES - misalignment) % BLOCKED_BYTES);
+  ba->top_bottom =
+      (uint8_t)(uint64_pow2(blocked_top_levels(ba->max_level) - 1) - 1);
+  blocked_layout(ba->n_pages, ba->layout_shift, ba->layout_base);
+#elif BUDDY_LAYOUT == BUDDY_LAYOUT_COMPACT
+  compact_layout(ba->n_pages, ba);
+#else
+  (void)ba;
+#endif
+}
+
+// moves a heap that was copied from an allocator at another address to where
+// heap_node looks for it. only the blocked layout depends on the address
+static void heap_layout_rebase(struct buddy_allocator_s *ba) {
+#if BUDDY_LAYOUT == BUDDY_LAYOUT_BLOCKED
+  const uint8_t old_align = ba->heap_align;
+  const uintptr_t misalignment = (uintptr_t)ba->heap % BLOCKED_BYTES;
+  ba->heap_align = (uint8_t)((BLOCKED_BYTES - misalignment) % BLOCKED_BYTES);
+  if (ba->heap_align != old_align) {
+    memmove(&ba->heap[ba->heap_align], &ba->heap[old_align],
+            heap_tree_bytes(ba->n_pages));
+  }
+#else
+  (void)ba;
+#endif
+}
+
+// sets every stored entry on the given level to value
+static void heap_fill_level(struct buddy_allocator_s *ba, uint8_t level,
+                            uint8_t value) {
+  const uint64_t count = heap_level_count(ba->n_pages, ba->max_level, level);
+#if BUDDY_LAYOUT == BUDDY_LAYOUT_BLOCKED
+  const uint64_t first = uint64_pow2(level) - 1;
+  for (uint64_t i = first; i < first + count; i++) {
+    heap_set(ba, i, value);
+  }
+#elif BUDDY_LAYOUT == BUDDY_LAYOUT_COMPACT
+  const uint8_t width = ba->level_width[level];
+  const uint64_t end = uint64_pow2(level) - 1 + count;
+  uint64_t i = uint64_pow2(level) - 1;
+  // the level may share its first and last bytes with its neighbors
+  while (i < end && (ba->level_base[level] + (i << width)) % 8 != 0) {
+    heap_set(ba, i, value);
+    i++;
+  }
+  const uint64_t bytes = ((end - i) << width) / 8;
+  if (bytes > 0) {
+    // set one entry, then copy its code to the whole bytes
+    const uint64_t start = (ba->level_base[level] + (i << width)) / 8;
+    ba->heap[start] = 0;
+    heap_set(ba, i, value);
+    uint8_t byte = ba->heap[start];
+    for (uint8_t shift = (uint8_t)uint64_pow2(width); shift < 8; shift *= 2) {
+      byte = (uint8_t)(byte | (byte << shift));
+    }
+    memset(&ba->heap[start], byte, bytes);
+    i += (bytes * 8) >> width;
+  }
+  while (i < end) {
+    heap_set(ba, i, value);
+    i++;
+  }
+#else
+  // each level is contiguous
+  memset(heap_node(ba, uint64_pow2(level) - 1), value, count);
+#endif
+}
+
 // given two children , returns what the parent's
 // should be
 static uint8_t parent_free_level(const struct buddy_allocator_s *ba,
@@ -120,34 +654,50 @@ static uint8_t parent_free_level(const struct buddy_allocator_s *ba,
   }
 }
 
-static void propagate(struct buddy_allocator_s *ba, uint64_t block_index) {
+// recomputes the ancestors of block_index down from top_level
+static void propagate_to(struct buddy_allocator_s *ba, uint64_t block_index,
+                         uint8_t top_level) {
+  heap_ref_t node = heap_node(ba, block_index);
+  uint8_t level = heap_level(block_index);
   // then update the on parent blocks
-  while (block_index != 0) {
+  while (level > top_level) {
     uint64_t parent = heap_parent(block_index);
+    heap_ref_t parent_node = heap_parent_node(ba, block_index, node);
     uint8_t updated_parent_level = parent_free_level(
-        ba, ba->heap[block_index], ba->heap[heap_sibling(block_index)]);
+        ba, node_get(ba, node),
+        node_get(ba, heap_sibling_node(ba, block_index, node)));
 
     // set the parent's level
-    ba->heap[parent] = updated_parent_level;
+    node_set(ba, parent_node, updated_parent_level);
     // start processing the upper one
     block_index = parent;
+    node = parent_node;
+    level--;
   }
 }
 
+static void propagate(struct buddy_allocator_s *ba, uint64_t block_index) {
+  propagate_to(ba, block_index, 0);
+}
+
 // merges together free blocks starting at block index.
 // returns the bock at which coalescing is not possible anymore
 static uint64_t coalesce(struct buddy_allocator_s *ba, uint64_t block_index) {
-  if (ba->heap[block_index] != heap_level(block_index)) {
+  heap_ref_t node = heap_node(ba, block_index);
+  if (node_get(ba, node) != heap_level(block_index)) {
     return block_index;
   }
 
   // try to merge blocks as much as we can
   while (block_index != 0) {
-    uint8_t sibling_level = ba->heap[heap_sibling(block_index)];
+    uint8_t sibling_level =
+        node_get(ba, heap_sibling_node(ba, block_index, node));
 
     if (sibling_level == heap_level(block_index)) {
       uint64_t parent = heap_parent(block_index);
-      ba->heap[parent] = heap_level(parent);
+      node = heap_parent_node(ba, block_index, node);
+      node_set(ba, node, heap_level(parent));
+      stats_merge(ba, heap_level(parent));
       block_index = parent;
     } else {
       break;
@@ -156,6 +706,66 @@ static uint64_t coalesce(struct buddy_allocator_s *ba, uint64_t block_index) {
   return block_index;
 }
 
+// given an index into the heap, returns the index of the first page
+static uint64_t
+get_first_page_index_from_block_index(struct buddy_allocator_s *ba,
+                                      uint64_t block_index) {
+  return (block_index - heap_size(heap_level(block_index) - 1))
+         << (ba->max_level - heap_level(block_index));
+}
+
+// given an index into the heap, returns the index of the last page
+static uint64_t
+get_last_page_index_from_block_index(struct buddy_allocator_s *ba,
+                                     uint64_t block_index) {
+  return ((block_index - heap_size(heap_level(block_index) - 1) + 1)
+          << (ba->max_level - heap_level(block_index))) -
+         1;
+}
+
+// where BUDDY_FLAG_NEXT_FIT starts looking: the block holding next_fit_page
+// if it is wholly free, else the nearest subtree after it that has a block at
+// allocation_level, else the root. every block above it is split, so the
+// descent from there splits nothing above it. sets cursor to the page to look
+// from, 0 when wrapping around
+static uint64_t next_fit_start(struct buddy_allocator_s *ba,
+                               const uint8_t allocation_level,
+                               uint8_t *start_level, uint64_t *cursor) {
+  uint64_t index = 0;
+  heap_ref_t node = heap_node(ba, 0);
+  uint8_t level = 0;
+  uint64_t after = 0;
+  uint8_t after_level = 0;
+  // walk down the split blocks holding the page
+  while (level < allocation_level && node_get(ba, node) > level &&
+         node_get(ba, node) <= ba->max_level) {
+    const uint64_t right = heap_right(index);
+    heap_ref_t right_node = heap_right_node(ba, index, node);
+    if (ba->next_fit_page < get_first_page_index_from_block_index(ba, right)) {
+      if (node_get(ba, right_node) <= allocation_level) {
+        // deeper is nearer
+        after = right;
+        after_level = level + 1;
+      }
+      node = heap_left_node(ba, index, node);
+      index = heap_left(index);
+    } else {
+      node = right_node;
+      index = right;
+    }
+    level++;
+  }
+
+  if (node_get(ba, node) == level) {
+    *start_level = level;
+    *cursor = ba->next_fit_page;
+    return index;
+  }
+  *start_level = after_level;
+  *cursor = 0;
+  return after;
+}
+
 // splits blocks to find an empty slot.
 // Must ensure that space exists first, or will fail
 static uint64_t acquire_empty_slot(struct buddy_allocator_s *ba,
@@ -166,87 +776,115 @@ static uint64_t acquire_empty_slot(struct buddy_allocator_s *ba,
 
   uint64_t index = 0;
   uint8_t level = 0;
+  // with either policy, take the lowest block that fits at or after cursor
+  const bool ordered =
+      ba->flags & (BUDDY_FLAG_LOWEST_FIT | BUDDY_FLAG_NEXT_FIT);
+  uint64_t cursor = 0;
+  if (ba->flags & BUDDY_FLAG_NEXT_FIT) {
+    index = next_fit_start(ba, allocation_level, &level, &cursor);
+  }
+  heap_ref_t node = heap_node(ba, index);
   while (true) {
-    assert(allocation_level >= ba->heap[index],
+    assert(allocation_level >= node_get(ba, node),
            "must ensure that space exists before calling this function");
 
     // this entire block is free
-    if (ba->heap[index] == level) {
-      if (ba->heap[index] == allocation_level) {
-        // we found a free block that has the allocation level we desire and is
-        // wholly unallocated!
-        return index;
-      } else {
-        // split block (the smallest level is now one of the children)
-        ba->heap[index] = level + 1;
-        ba->heap[heap_left(index)] = level + 1;
-        ba->heap[heap_right(index)] = level + 1;
+    if (node_get(ba, node) == level && level == allocation_level) {
+      // we found a free block that has the allocation level we desire and is
+      // wholly unallocated! the caller takes it
+      stats_remove_free(ba, level);
+      if (ba->flags & BUDDY_FLAG_NEXT_FIT) {
+        ba->next_fit_page = get_first_page_index_from_block_index(ba, index) +
+                            uint64_pow2(ba->max_level - level);
+        if (ba->next_fit_page >= ba->n_pages) {
+          ba->next_fit_page = 0;
+        }
       }
+      return index;
     }
 
     const uint64_t left_index = heap_left(index);
     const uint64_t right_index = heap_right(index);
-    const uint8_t left_level = ba->heap[left_index];
-    const uint8_t right_level = ba->heap[right_index];
+    heap_ref_t left_node = heap_left_node(ba, index, node);
+    heap_ref_t right_node = heap_right_node(ba, index, node);
+
+    if (node_get(ba, node) == level) {
+      // split block (the smallest level is now one of the children)
+      node_set(ba, node, level + 1);
+      node_set(ba, left_node, level + 1);
+      node_set(ba, right_node, level + 1);
+      stats_split(ba, level);
+    }
+
+    const uint8_t left_level = node_get(ba, left_node);
+    const uint8_t right_level = node_get(ba, right_node);
 
-    // pick the one with the larger level (smaller free block) so that we
-    // preserve larger blocks for potential larger allocations
-    if (left_level < right_level) {
+    if (ordered) {
+      if (allocation_level >= right_level &&
+          (allocation_level < left_level ||
+           cursor >= get_first_page_index_from_block_index(ba, right_index))) {
+        index = right_index;
+        node = right_node;
+      } else {
+        index = left_index;
+        node = left_node;
+      }
+    } else if (left_level < right_level) {
+      // pick the one with the larger level (smaller free block) so that we
+      // preserve larger blocks for potential larger allocations
       // if fits in the right level select that one
       if (allocation_level >= right_level) {
         index = right_index;
+        node = right_node;
       } else {
         index = left_index;
+        node = left_node;
       }
     } else {
       // if fits in the left level select that one
       if (allocation_level >= left_level) {
         index = left_index;
+        node = left_node;
       } else {
         index = right_index;
+        node = right_node;
       }
     }
     level++;
   }
 }
 
-// given an index into the heap, returns the index of the first page
-static uint64_t
-get_first_page_index_from_block_index(struct buddy_allocator_s *ba,
-                                      uint64_t block_index) {
-  return (block_index - heap_size(heap_level(block_index) - 1))
-         << (ba->max_level - heap_level(block_index));
-}
-
-// given an index into the heap, returns the index of the last page
-static uint64_t
-get_last_page_index_from_block_index(struct buddy_allocator_s *ba,
-                                     uint64_t block_index) {
-  return ((block_index - heap_size(heap_level(block_index) - 1) + 1)
-          << (ba->max_level - heap_level(block_index))) -
-         1;
-}
-
-// given the index of a page, gets the allocation it belongs to
+// given the index of a page, gets the allocation it belongs to.
+// on failure, block_index is set to the free or unusable block the page is in
 static buddy_status_t
 get_block_index_from_page_index(struct buddy_allocator_s *ba,
                                 const uint64_t page_id, uint64_t *block_index) {
+  if (page_id >= uint64_pow2(ba->max_level)) {
+    *block_index = 0;
+    return BUDDY_STATUS_NO_SUCH_ALLOCATION;
+  }
+
   uint64_t bi = 0;
+  heap_ref_t node = heap_node(ba, 0);
   for (uint8_t level = 0; level <= ba->max_level; level++) {
     // check if this current block is the one
-    if (ba->heap[bi] == BUDDY_LEVEL_ALLOCATED) {
+    if (node_get(ba, node) == BUDDY_LEVEL_ALLOCATED) {
       // if this block is allocated, we found it, so exit loop
       break;
-    } else if (ba->heap[bi] == level) {
+    } else if (node_get(ba, node) == level) {
       // we hit a completely free block (error)
+      *block_index = bi;
       return BUDDY_STATUS_NO_SUCH_ALLOCATION;
-    } else if (ba->heap[bi] == BUDDY_LEVEL_UNUSABLE) {
+    } else if (node_get(ba, node) == BUDDY_LEVEL_UNUSABLE) {
       // we hit an unusable block (error)
+      *block_index = bi;
       return BUDDY_STATUS_NO_SUCH_ALLOCATION;
     }
     if (page_id >= get_first_page_index_from_block_index(ba, heap_right(bi))) {
+      node = heap_right_node(ba, bi, node);
       bi = heap_right(bi);
     } else {
+      node = heap_left_node(ba, bi, node);
       bi = heap_left(bi);
     }
   }
@@ -255,224 +893,2453 @@ get_block_index_from_page_index(struct buddy_allocator_s *ba,
   return BUDDY_STATUS_SUCCESS;
 }
 
-// gets the necessary number of bytes to construct the buddy allocator heap
-uint64_t buddy_get_bytes(uint64_t n_pages) {
-  assert(n_pages != 0, "n_pages must not be 0");
-
-  uint8_t max_level = uint64_ceil_log2(n_pages);
-  return sizeof(struct buddy_allocator_s) + heap_size(max_level);
+// the leaf of the given page
+static inline uint64_t heap_leaf(struct buddy_allocator_s *ba,
+                                 uint64_t page_id) {
+  return uint64_pow2(ba->max_level) - 1 + page_id;
 }
 
-void buddy_init(struct buddy_allocator_s *ba, uint64_t n_pages,
-                uint64_t page_size, uint64_t offset) {
-  assert(n_pages != 0, "n_pages must not be 0");
-  assert(uint64_is_power_of_2(page_size), "page size must be a power of 2");
-
-  ba->state = BUDDY_STATE_UNREADY;
-  ba->max_level = uint64_ceil_log2(n_pages);
-  ba->offset = offset;
-  ba->page_size_log2 = uint64_log2(page_size);
+// the leaf of the first page of the given block
+static inline uint64_t heap_first_leaf(struct buddy_allocator_s *ba,
+                                       uint64_t block_index) {
+  return heap_leaf(ba, get_first_page_index_from_block_index(ba, block_index));
+}
 
-  uint64_t bottom_level_offset = 0;
-  if (ba->max_level > 0) {
-    bottom_level_offset = heap_size(ba->max_level - 1);
+// leaves the BUDDY_LEVEL_HEAD mark for a newly allocated block
+static void mark_head(struct buddy_allocator_s *ba, uint64_t block_index) {
+  const uint8_t level = heap_level(block_index);
+  if (level != ba->max_level) {
+    heap_set(ba, heap_first_leaf(ba, block_index), BUDDY_LEVEL_HEAD + level);
   }
+}
 
-  // init the bottom level of the heap
-  for (uint64_t i = bottom_level_offset; i < bottom_level_offset + n_pages;
-       i++) {
-    ba->heap[i] = ba->max_level;
-  }
-  for (uint64_t i = n_pages + bottom_level_offset; i < heap_size(ba->max_level);
-       i++) {
-    ba->heap[i] = BUDDY_LEVEL_UNUSABLE;
+// removes the BUDDY_LEVEL_HEAD mark of a block that is being freed, so that
+// every leaf below it is free again
+static void clear_head(struct buddy_allocator_s *ba, uint64_t block_index) {
+  if (heap_level(block_index) != ba->max_level) {
+    heap_set(ba, heap_first_leaf(ba, block_index), ba->max_level);
   }
 }
 
-void buddy_mark_unusable(struct buddy_allocator_s *ba, uint64_t min_page_id,
-                         uint64_t max_page_id) {
-  assert(ba->state == BUDDY_STATE_UNREADY,
-         "allocator state is ready (should be unready)\n");
-  for (uint64_t i = min_page_id; i <= max_page_id; i++) {
-    ba->heap[i + uint64_pow2(ba->max_level - 1)] = BUDDY_LEVEL_UNUSABLE;
+// the value mark_head leaves on the first leaf of a block at level, as read
+// back by heap_get
+static inline uint8_t head_value(uint8_t level) {
+#if BUDDY_LAYOUT == BUDDY_LAYOUT_COMPACT
+  (void)level;
+  return BUDDY_LEVEL_HEAD;
+#else
+  return BUDDY_LEVEL_HEAD + level;
+#endif
+}
+
+// the block whose BUDDY_LEVEL_HEAD mark v is on leaf
+static uint64_t head_block(struct buddy_allocator_s *ba, uint64_t leaf,
+                           uint8_t v) {
+#if BUDDY_LAYOUT == BUDDY_LAYOUT_COMPACT
+  // the mark has no room for the level. every block above the allocation is
+  // split, so walk down from the largest block starting at this leaf to the
+  // first allocated one. this is O(1) on average over the page ids
+  (void)v;
+  const uint64_t page_id = leaf + 1 - uint64_pow2(ba->max_level);
+  const uint8_t shift =
+      page_id == 0 ? ba->max_level : (uint8_t)uint64_ctz(page_id);
+  uint64_t bi = ((leaf + 1) >> shift) - 1;
+  while (bi != leaf && heap_get(ba, bi) != BUDDY_LEVEL_ALLOCATED) {
+    bi = heap_left(bi);
   }
+  return bi;
+#else
+  const uint8_t level = v - BUDDY_LEVEL_HEAD;
+  return ((leaf + 1) >> (ba->max_level - level)) - 1;
+#endif
 }
 
-void buddy_ready(struct buddy_allocator_s *ba) {
-  if (ba->max_level > 0) {
-    // walk backwards in the heap
-    // start from the last block of the penultimate layer
-    // compute the correct free level of the block
-    // due to the way the heap is laid out, we are sure always to initialize
-    // children before parents
-    for (int64_t block_index = (int64_t)heap_size(ba->max_level - 1) - 1;
-         block_index >= 0; block_index--) {
-      uint64_t bi = (uint64_t)block_index;
-      uint8_t level = heap_level(bi);
-      uint8_t lv = ba->heap[heap_left(bi)];
-      uint8_t rv = ba->heap[heap_right(bi)];
-
-      if (lv == BUDDY_LEVEL_UNUSABLE && rv == BUDDY_LEVEL_UNUSABLE) {
-        ba->heap[bi] = BUDDY_LEVEL_UNUSABLE;
-      } else if (lv == level + 1 && rv == level + 1) {
-        ba->heap[bi] = heap_level(bi);
-      } else {
-        ba->heap[bi] = uint8_min(lv, rv);
-      }
+// whether the allocated block at block_index is one that BUDDY_FLAG_DEFER
+// holds back, which was already freed
+static bool defer_holds(struct buddy_allocator_s *ba, uint64_t block_index) {
+  const uint8_t order = ba->max_level - heap_level(block_index);
+  if (order >= DEFER_ORDERS) {
+    return false;
+  }
+  for (uint8_t i = 0; i < ba->defer_count[order]; i++) {
+    if (ba->defer_blocks[order][i] == block_index) {
+      return true;
     }
   }
-  ba->state = BUDDY_STATE_READY;
+  return false;
 }
 
-static void buddy_verify_recursive(struct buddy_allocator_s *ba, uint64_t i) {
-  assert(ba->state == BUDDY_STATE_READY, "must be ready to be verified");
+// given the first page of an allocation, finds its block in O(1) from the
+// mark on the page's leaf
+static buddy_status_t get_block_index_from_head(struct buddy_allocator_s *ba,
+                                                const uint64_t page_id,
+                                                uint64_t *block_index) {
+  // the leaves past n_pages may not be stored
+  if (page_id >= ba->n_pages) {
+    return BUDDY_STATUS_NO_SUCH_ALLOCATION;
+  }
 
-  uint8_t level = heap_level(i);
-  if (level == ba->max_level) {
-    // the only valid values at this level are ba->max_level,
-    // BUDDY_LEVEL_UNUSABLE, or BUDDY_LEVEL_ALLOCATED
-    if (ba->heap[i] == BUDDY_LEVEL_UNUSABLE) {
-      // unusable
-    } else if (ba->heap[i] == BUDDY_LEVEL_ALLOCATED) {
-      // allocated
-    } else if (ba->heap[i] == ba->max_level) {
-      // free
-    } else {
-      fatal_s_u64_s("block ", i,
-                    " has an invalid value for a bottom level block\n");
+  const uint64_t leaf = heap_leaf(ba, page_id);
+  const uint8_t v = heap_get(ba, leaf);
+  uint64_t bi;
+  if (v == BUDDY_LEVEL_ALLOCATED) {
+    // a single page allocation
+    bi = leaf;
+  } else if (v >= BUDDY_LEVEL_HEAD && v < BUDDY_LEVEL_HEAD + ba->max_level) {
+    bi = head_block(ba, leaf, v);
+    if (heap_get(ba, bi) != BUDDY_LEVEL_ALLOCATED) {
+      return BUDDY_STATUS_NO_SUCH_ALLOCATION;
     }
   } else {
-    const uint64_t left = heap_left(i);
-    const uint64_t right = heap_right(i);
-    if (ba->heap[i] == BUDDY_LEVEL_UNUSABLE) {
-      // unsable
-    } else if (ba->heap[i] == BUDDY_LEVEL_ALLOCATED) {
-      // allocated
-    } else if (ba->heap[i] == BUDDY_LEVEL_FILLED) {
-      // filled
-
-      // check children (they must be both be invalid)
-      if (ba->heap[left] > BUDDY_LEVEL_MAX_VALID &&
-          ba->heap[right] > BUDDY_LEVEL_MAX_VALID) {
-        // ok
-      } else {
-        fatal_s_u64_s(
-            "block ", i,
-            "claims to be filled, but at least one child has free space\n");
-      }
-
-      // verify children
-      buddy_verify_recursive(ba, left);
-      buddy_verify_recursive(ba, right);
-    } else if (ba->heap[i] < level) {
-      // wrong!
-      fatal_s_u64_s("block ", i,
-                    " has a smaller level than should be possible at "
-                    "it's level\n");
-    } else if (ba->heap[i] == level) {
-      // fully free block
-    } else if (ba->heap[i] > level && ba->heap[i] <= ba->max_level) {
-      // split, at least one descendant is busy
-      if (ba->heap[i] == uint8_min(ba->heap[left], ba->heap[right])) {
-        // ok
-      } else {
+    // either free, unusable, or not the first page of an allocation
+    return BUDDY_STATUS_NO_SUCH_ALLOCATION;
+  }
 
-        fatal_s_u64_s("block ", i,
-                      " does not satisfy invariant that its smallest free "
-                      "level is the min of its children\n");
-      }
+  if ((ba->flags & BUDDY_FLAG_DEFER) && defer_holds(ba, bi)) {
+    return BUDDY_STATUS_NO_SUCH_ALLOCATION;
+  }
+  *block_index = bi;
+  return BUDDY_STATUS_SUCCESS;
+}
 
-      // if both of it's children are split and free, then that's an error
-      if (ba->heap[left] == level + 1 && ba->heap[right] == level + 1) {
-        fatal_s_u64_s("block ", i, " two children should be merged\n");
-      }
+// marks the pages from min_page_id to max_page_id within the subtree at index
+// as unusable. every subtree that lies wholly inside the range is marked at its
+// root, so only the two paths along the ends of the range are walked. keeps
+// free_blocks up to date, which before buddy_ready is recounted anyway
+static void mark_range(struct buddy_allocator_s *ba, uint64_t index,
+                       heap_ref_t node, uint8_t level, uint64_t min_page_id,
+                       uint64_t max_page_id) {
+  const uint64_t first = get_first_page_index_from_block_index(ba, index);
+  const uint64_t last = first + uint64_pow2(ba->max_level - level) - 1;
+  if (last < min_page_id || first > max_page_id ||
+      node_get(ba, node) == BUDDY_LEVEL_UNUSABLE) {
+    return;
+  }
 
-      // verify children
-      buddy_verify_recursive(ba, left);
-      buddy_verify_recursive(ba, right);
-    } else {
-      fatal_s_u64_s("block ", i,
-                    " has a greater level than is permissible in this tree\n");
+  if (min_page_id <= first && last <= max_page_id) {
+    if (node_get(ba, node) == level) {
+      stats_remove_free(ba, level);
     }
+    node_set(ba, node, BUDDY_LEVEL_UNUSABLE);
+    return;
   }
-}
 
-void buddy_verify(struct buddy_allocator_s *ba) {
-  for (uint64_t z = 0; z < heap_size(ba->max_level); z++) {
-    printf("%u ", ba->heap[z]);
+  heap_ref_t left_node = heap_left_node(ba, index, node);
+  heap_ref_t right_node = heap_right_node(ba, index, node);
+  if (node_get(ba, node) == level) {
+    // split block (the smallest level is now one of the children)
+    node_set(ba, left_node, level + 1);
+    node_set(ba, right_node, level + 1);
+    stats_split(ba, level);
   }
-  printf("\n");
-  buddy_verify_recursive(ba, 0);
-}
 
-[[nodiscard("allocations may fail")]]
-buddy_status_t buddy_page_alloc(struct buddy_allocator_s *ba, uint64_t n_pages,
-                                uint64_t *page_id) {
-  assert(ba->state == BUDDY_STATE_READY, "allocator state is not ready\n");
+  mark_range(ba, heap_left(index), left_node, level + 1, min_page_id,
+             max_page_id);
+  mark_range(ba, heap_right(index), right_node, level + 1, min_page_id,
+             max_page_id);
 
-  // can't allocate 0 pages, round up to 1
-  if (n_pages == 0) {
-    n_pages = 1;
+  if (node_get(ba, left_node) == BUDDY_LEVEL_UNUSABLE &&
+      node_get(ba, right_node) == BUDDY_LEVEL_UNUSABLE) {
+    node_set(ba, node, BUDDY_LEVEL_UNUSABLE);
+  } else {
+    node_set(ba, node,
+             parent_free_level(ba, node_get(ba, left_node),
+                               node_get(ba, right_node)));
   }
+}
 
-  // could never allocate
-  if (n_pages > uint64_pow2(ba->max_level)) {
-    return BUDDY_STATUS_INVAL;
+// the opposite of mark_range: frees the unusable pages from min_page_id to
+// max_page_id within the subtree at index, merging them with their free
+// buddies on the way back up. the range must be wholly unusable
+static void unmark_range(struct buddy_allocator_s *ba, uint64_t index,
+                         heap_ref_t node, uint8_t level, uint64_t min_page_id,
+                         uint64_t max_page_id) {
+  const uint64_t first = get_first_page_index_from_block_index(ba, index);
+  const uint64_t last = first + uint64_pow2(ba->max_level - level) - 1;
+  if (last < min_page_id || first > max_page_id) {
+    return;
   }
 
-  const uint8_t allocation_level = ba->max_level - uint64_ceil_log2(n_pages);
-
-  // we could theoretically allocate, but the structure is full
-  if (allocation_level < ba->heap[0]) {
-    return BUDDY_STATUS_NOMEM;
+  if (min_page_id <= first && last <= max_page_id) {
+    node_set(ba, node, level);
+    stats_add_free(ba, level);
+    return;
   }
 
-  // split blocks to get a slot of the correct size
-  const uint64_t block_index = acquire_empty_slot(ba, allocation_level);
+  heap_ref_t left_node = heap_left_node(ba, index, node);
+  heap_ref_t right_node = heap_right_node(ba, index, node);
+  if (node_get(ba, node) == BUDDY_LEVEL_UNUSABLE) {
+    // split the unusable block, only part of it is freed
+    node_set(ba, left_node, BUDDY_LEVEL_UNUSABLE);
+    node_set(ba, right_node, BUDDY_LEVEL_UNUSABLE);
+  }
 
-  // mark this block as allocated and update parent blocks
-  ba->heap[block_index] = BUDDY_LEVEL_ALLOCATED;
-  // update parent blocks
-  propagate(ba, block_index);
+  unmark_range(ba, heap_left(index), left_node, level + 1, min_page_id,
+               max_page_id);
+  unmark_range(ba, heap_right(index), right_node, level + 1, min_page_id,
+               max_page_id);
 
-  // success
-  *page_id = get_first_page_index_from_block_index(ba, block_index);
-  return BUDDY_STATUS_SUCCESS;
+  if (node_get(ba, left_node) == level + 1 &&
+      node_get(ba, right_node) == level + 1) {
+    node_set(ba, node, level);
+    stats_merge(ba, level);
+  } else {
+    node_set(ba, node,
+             parent_free_level(ba, node_get(ba, left_node),
+                               node_get(ba, right_node)));
+  }
 }
 
-buddy_status_t buddy_page_free(struct buddy_allocator_s *ba, uint64_t page_id) {
-  assert(ba->state == BUDDY_STATE_READY, "allocator state is not ready\n");
-
-  uint64_t block_index;
-  buddy_status_t get_status =
-      get_block_index_from_page_index(ba, page_id, &block_index);
-  if (get_status != BUDDY_STATUS_SUCCESS) {
-    return get_status;
+// whether every page from min_page_id to max_page_id within the subtree at
+// index is free, or with unusable set, unusable. walks the same paths as
+// mark_range
+static bool range_is(struct buddy_allocator_s *ba, uint64_t index,
+                     uint8_t level, uint64_t min_page_id, uint64_t max_page_id,
+                     bool unusable) {
+  const uint64_t first = get_first_page_index_from_block_index(ba, index);
+  const uint64_t last = first + uint64_pow2(ba->max_level - level) - 1;
+  if (last < min_page_id || first > max_page_id) {
+    return true;
   }
 
-  // mark block as free
-  ba->heap[block_index] = heap_level(block_index);
-  // coalesce blocks starting from that point
-  const uint64_t coalesced_block_index = coalesce(ba, block_index);
-  // then update free space on the parent blocks
-  propagate(ba, coalesced_block_index);
+  const uint8_t v = heap_get(ba, index);
+  if (v == (unusable ? BUDDY_LEVEL_UNUSABLE : level)) {
+    return true;
+  }
+  // a block that is split or filled holds pages of more than one kind, so it
+  // can't lie wholly inside the range
+  if (v == BUDDY_LEVEL_ALLOCATED || v == BUDDY_LEVEL_UNUSABLE || v == level ||
+      (min_page_id <= first && last <= max_page_id)) {
+    return false;
+  }
+  return range_is(ba, heap_left(index), level + 1, min_page_id, max_page_id,
+                  unusable) &&
+         range_is(ba, heap_right(index), level + 1, min_page_id, max_page_id,
+                  unusable);
+}
 
-  return BUDDY_STATUS_SUCCESS;
+// marks an allocated block as free and merges it with its free buddies.
+// returns the block at which coalescing stopped, whose ancestors still need
+// to be recomputed
+static uint64_t release_block(struct buddy_allocator_s *ba,
+                              uint64_t block_index) {
+  heap_set(ba, block_index, heap_level(block_index));
+  clear_head(ba, block_index);
+  stats_add_free(ba, heap_level(block_index));
+  return coalesce(ba, block_index);
 }
 
-static void *page_to_ptr(const struct buddy_allocator_s *ba, uint64_t page_id) {
-  return (void *)(ba->offset + (page_id << ba->page_size_log2));
+// when freeing page_id and then next_page_id in one batch, returns the level
+// down to which the ancestors of page_id must be recomputed. the ancestors at
+// and above the lowest one the two share are recomputed by the second free
+static uint8_t shared_top_level(struct buddy_allocator_s *ba, uint64_t page_id,
+                                uint64_t next_page_id) {
+  const uint64_t diff = page_id ^ next_page_id;
+  if (diff == 0) {
+    return ba->max_level + 1;
+  } else if (uint64_log2(diff) < ba->max_level) {
+    return ba->max_level - uint64_log2(diff);
+  } else {
+    return 0;
+  }
 }
 
-static uint64_t ptr_to_page(const struct buddy_allocator_s *ba, void *ptr) {
-  return ((uint64_t)ptr - ba->offset) >> ba->page_size_log2;
+// the ancestor of block_index at level, or block_index itself
+static inline uint64_t heap_ancestor(uint64_t block_index, uint8_t level) {
+  return ((block_index + 1) >> (heap_level(block_index) - level)) - 1;
 }
 
-// returns the status of the allocation. sets mem
-[[nodiscard("allocations may fail")]]
-buddy_status_t buddy_mem_alloc(struct buddy_allocator_s *ba, uint64_t n_bytes,
-                               void **mem) {
+// whether every page of the block at block_index is free, that is the block
+// or one of its ancestors is a wholly free block
+static bool block_is_free(struct buddy_allocator_s *ba, uint64_t block_index) {
+  const uint8_t level = heap_level(block_index);
+  for (uint8_t l = 0; l <= level; l++) {
+    const uint8_t v = heap_get(ba, heap_ancestor(block_index, l));
+    if (v == l) {
+      return true;
+    } else if (v > ba->max_level) {
+      // allocated, unusable or filled
+      return false;
+    }
+  }
+  return false;
+}
 
+// allocates the block at block_index, which must be free. the wholly free
+// block holding it is split down to it, leaving the buddies along the way free
+static void claim_block(struct buddy_allocator_s *ba, uint64_t block_index) {
+  const uint8_t level = heap_level(block_index);
+  uint64_t index = 0;
+  heap_ref_t node = heap_node(ba, 0);
+  for (uint8_t l = 0; l < level; l++) {
+    heap_ref_t left_node = heap_left_node(ba, index, node);
+    heap_ref_t right_node = heap_right_node(ba, index, node);
+    if (node_get(ba, node) == l) {
+      // split block, propagate sets the parents right afterwards
+      node_set(ba, left_node, l + 1);
+      node_set(ba, right_node, l + 1);
+      stats_split(ba, l);
+    }
+    const uint64_t child = heap_ancestor(block_index, l + 1);
+    node = child == heap_left(index) ? left_node : right_node;
+    index = child;
+  }
+
+  stats_remove_free(ba, level);
+  node_set(ba, node, BUDDY_LEVEL_ALLOCATED);
+  mark_head(ba, block_index);
+  propagate(ba, block_index);
+}
+
+/// DEFER FUNCTIONS
+// with BUDDY_FLAG_DEFER, page_free holds a small freed block back instead of
+// merging it with its buddies, and page_alloc of the same order hands it out
+// again, so that a loop that frees and allocates one size stops splitting and
+// merging the same path of the tree, as in Barkley and Lee's lazy buddy
+// system. a held block stays allocated in the tree, head mark and all, while
+// the stats count it as freed. the held blocks are merged when the tree
+// can't serve a request without them
+
+// holds the block at block_index back instead of freeing it, if its order has
+// room. never under a journal, which only sees the tree
+static bool defer_push(struct buddy_allocator_s *ba, uint64_t block_index) {
+  if (!(ba->flags & BUDDY_FLAG_DEFER) || ba->journal != NULL) {
+    return false;
+  }
+  const uint8_t order = ba->max_level - heap_level(block_index);
+  if (order >= DEFER_ORDERS || ba->defer_count[order] == DEFER_BLOCKS) {
+    return false;
+  }
+  ba->defer_blocks[order][ba->defer_count[order]++] = block_index;
+  return true;
+}
+
+// takes the most recently held block of order, if there is one
+static bool defer_pop(struct buddy_allocator_s *ba, uint8_t order,
+                      uint64_t *block_index) {
+  if (order >= DEFER_ORDERS || ba->defer_count[order] == 0) {
+    return false;
+  }
+  *block_index = ba->defer_blocks[order][--ba->defer_count[order]];
+  return true;
+}
+
+// frees every held block, merging it with its free buddies. returns whether
+// there were any
+static bool defer_flush(struct buddy_allocator_s *ba) {
+  bool flushed = false;
+  for (uint8_t order = 0; order < DEFER_ORDERS; order++) {
+    while (ba->defer_count[order] > 0) {
+      const uint64_t block_index =
+          ba->defer_blocks[order][--ba->defer_count[order]];
+      propagate(ba, release_block(ba, block_index));
+      flushed = true;
+    }
+  }
+  return flushed;
+}
+
+void buddy_defer_flush(struct buddy_allocator_s *ba) {
+  assert(ba->state == BUDDY_STATE_READY, "allocator state is not ready\n");
+  (void)defer_flush(ba);
+}
+
+////////////////////////////////
+/// LOCK-FREE FUNCTIONS
+////////////////////////////////
+
+// When BUDDY_FLAG_LOCKFREE is set the heap is managed with the non-blocking
+// buddy system from https://arxiv.org/pdf/1804.03436 instead of free levels.
+// Each node holds a set of NB_* bits:
+// NB_OCC: the block itself is allocated
+// NB_OCC_LEFT / NB_OCC_RIGHT: some block in that subtree is allocated
+// NB_COAL_LEFT / NB_COAL_RIGHT: a free is in progress in that subtree
+// NB_UNUSABLE: the block was marked unusable before buddy_ready
+// A node is free to allocate only when it is 0. Every update is a single
+// atomic operation on one node, so operations in disjoint subtrees never
+// contend on the same byte.
+
+// where entry i is stored. the NB_* bits need a whole byte per entry, so
+// buddy_init_flags rejects BUDDY_FLAG_LOCKFREE with BUDDY_LAYOUT_COMPACT
+static inline uint8_t *nb_node(struct buddy_allocator_s *ba, uint64_t i) {
+#if BUDDY_LAYOUT == BUDDY_LAYOUT_COMPACT
+  (void)ba;
+  (void)i;
+  fatal("BUDDY_FLAG_LOCKFREE is not supported by BUDDY_LAYOUT_COMPACT\n");
+  return NULL;
+#else
+  return heap_node(ba, i);
+#endif
+}
+
+static inline uint8_t nb_load(struct buddy_allocator_s *ba, uint64_t i) {
+  return __atomic_load_n(nb_node(ba, i), __ATOMIC_ACQUIRE);
+}
+
+static inline bool nb_cas(struct buddy_allocator_s *ba, uint64_t i,
+                          uint8_t *expected, uint8_t desired) {
+  return __atomic_compare_exchange_n(nb_node(ba, i), expected, desired,
+                                     false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static inline bool nb_is_left(uint64_t child) { return child % 2 == 1; }
+
+static inline uint8_t nb_occ_bit(uint64_t child) {
+  return nb_is_left(child) ? NB_OCC_LEFT : NB_OCC_RIGHT;
+}
+
+static inline uint8_t nb_coal_bit(uint64_t child) {
+  return nb_is_left(child) ? NB_COAL_LEFT : NB_COAL_RIGHT;
+}
+
+static inline uint8_t nb_occ_buddy_bit(uint64_t child) {
+  return nb_is_left(child) ? NB_OCC_RIGHT : NB_OCC_LEFT;
+}
+
+static inline uint8_t nb_coal_buddy_bit(uint64_t child) {
+  return nb_is_left(child) ? NB_COAL_RIGHT : NB_COAL_LEFT;
+}
+
+// clears the occupied bits that a freed block set on the path to upper.
+// stops early if a concurrent allocation re-marked the path, or if a node on
+// the path is still occupied by the other child
+static void nb_unmark(struct buddy_allocator_s *ba, uint64_t block_index,
+                      uint64_t upper) {
+  uint64_t current = block_index;
+  uint64_t child;
+  uint8_t new_val;
+  do {
+    child = current;
+    current = heap_parent(current);
+    uint8_t cur_val = nb_load(ba, current);
+    do {
+      if (!(cur_val & nb_coal_bit(child))) {
+        return;
+      }
+      new_val = cur_val & (uint8_t)~(nb_occ_bit(child) | nb_coal_bit(child));
+    } while (!nb_cas(ba, current, &cur_val, new_val));
+  } while (current != upper && !(new_val & nb_occ_buddy_bit(child)));
+}
+
+// frees an allocated block. upper is the highest ancestor that was marked as
+// occupied on behalf of this block (block_index itself if none were)
+static void nb_free_node(struct buddy_allocator_s *ba, uint64_t block_index,
+                         uint64_t upper) {
+  // announce the free on the path so that concurrent allocations can tell us
+  // apart from a stale occupied bit
+  uint64_t runner = block_index;
+  while (runner != upper) {
+    uint64_t current = heap_parent(runner);
+    uint8_t old_val = __atomic_fetch_or(nb_node(ba, current),
+                                        nb_coal_bit(runner), __ATOMIC_ACQ_REL);
+    if ((old_val & nb_occ_buddy_bit(runner)) &&
+        !(old_val & nb_coal_buddy_bit(runner))) {
+      // the other child keeps this node occupied, no need to go higher
+      break;
+    }
+    runner = current;
+  }
+
+  __atomic_store_n(nb_node(ba, block_index), 0, __ATOMIC_RELEASE);
+
+  if (block_index != upper) {
+    nb_unmark(ba, block_index, upper);
+  }
+}
+
+// tries to claim block_index and mark all of its ancestors as occupied.
+// on failure, sets failed_at to the node that prevented the allocation
+static bool nb_try_alloc(struct buddy_allocator_s *ba, uint64_t block_index,
+                         uint64_t *failed_at) {
+  uint8_t expected = 0;
+  if (!nb_cas(ba, block_index, &expected, NB_BUSY)) {
+    *failed_at = block_index;
+    return false;
+  }
+
+  uint64_t current = block_index;
+  while (current != 0) {
+    uint64_t child = current;
+    current = heap_parent(current);
+    uint8_t cur_val = nb_load(ba, current);
+    uint8_t new_val;
+    do {
+      if (cur_val & NB_OCC) {
+        // an ancestor was allocated as a whole, roll back what we marked
+        nb_free_node(ba, block_index, child);
+        *failed_at = current;
+        return false;
+      }
+      new_val = (cur_val & (uint8_t)~nb_coal_bit(child)) | nb_occ_bit(child);
+    } while (!nb_cas(ba, current, &cur_val, new_val));
+  }
+  return true;
+}
+
+// where each thread starts scanning a level. keeps threads apart from each
+// other so that they mostly work in disjoint subtrees
+static thread_local uint64_t nb_scan_hint;
+
+static buddy_status_t nb_page_alloc(struct buddy_allocator_s *ba,
+                                    uint8_t allocation_level,
+                                    uint64_t *page_id) {
+  const uint64_t first = uint64_pow2(allocation_level) - 1;
+  // the blocks to the right of these are wholly past n_pages
+  const uint64_t count =
+      heap_level_count(ba->n_pages, ba->max_level, allocation_level);
+
+  if (nb_scan_hint == 0) {
+    nb_scan_hint =
+        ((uint64_t)(uintptr_t)&nb_scan_hint * 0x9E3779B97F4A7C15) >> 16;
+  }
+
+  const uint64_t start = nb_scan_hint % count;
+  uint64_t scanned = 0;
+  while (scanned < count) {
+    const uint64_t pos = (start + scanned) % count;
+    uint64_t failed_at;
+    if (nb_try_alloc(ba, first + pos, &failed_at)) {
+      nb_scan_hint = pos + 1;
+      *page_id = get_first_page_index_from_block_index(ba, first + pos);
+      stats_alloc(ba, uint64_pow2(ba->max_level - allocation_level));
+      return BUDDY_STATUS_SUCCESS;
+    }
+
+    // skip every node at this level below the node that blocked us
+    const uint8_t failed_level = heap_level(failed_at);
+    const uint8_t shift = allocation_level - failed_level;
+    const uint64_t failed_pos = failed_at - (uint64_pow2(failed_level) - 1);
+    uint64_t subtree_end = (failed_pos + 1) << shift;
+    if (subtree_end > count) {
+      // don't wrap around into the start of the level
+      subtree_end = count;
+    }
+    uint64_t skip = subtree_end - pos;
+    if (skip > count - scanned) {
+      skip = count - scanned;
+    }
+    scanned += skip;
+  }
+  stats_failed(ba);
+  return BUDDY_STATUS_NOMEM;
+}
+
+// finds the allocated block starting at page_id
+static buddy_status_t nb_get_block_index(struct buddy_allocator_s *ba,
+                                         uint64_t page_id,
+                                         uint64_t *block_index) {
+  if (page_id >= uint64_pow2(ba->max_level)) {
+    return BUDDY_STATUS_NO_SUCH_ALLOCATION;
+  }
+
+  uint64_t bi = 0;
+  for (uint8_t level = 0; level <= ba->max_level; level++) {
+    uint8_t v = nb_load(ba, bi);
+    if (v & NB_OCC) {
+      if ((v & NB_UNUSABLE) ||
+          get_first_page_index_from_block_index(ba, bi) != page_id) {
+        return BUDDY_STATUS_NO_SUCH_ALLOCATION;
+      }
+      *block_index = bi;
+      return BUDDY_STATUS_SUCCESS;
+    }
+    if (level == ba->max_level) {
+      break;
+    }
+
+    uint64_t child;
+    if (page_id >= get_first_page_index_from_block_index(ba, heap_right(bi))) {
+      child = heap_right(bi);
+    } else {
+      child = heap_left(bi);
+    }
+    if (!(v & nb_occ_bit(child))) {
+      // nothing is allocated in the subtree containing this page
+      return BUDDY_STATUS_NO_SUCH_ALLOCATION;
+    }
+    bi = child;
+  }
+  return BUDDY_STATUS_NO_SUCH_ALLOCATION;
+}
+
+static buddy_status_t nb_page_free(struct buddy_allocator_s *ba,
+                                   uint64_t page_id) {
+  uint64_t block_index;
+  buddy_status_t s = nb_get_block_index(ba, page_id, &block_index);
+  if (s != BUDDY_STATUS_SUCCESS) {
+    return s;
+  }
+  nb_free_node(ba, block_index, 0);
+  stats_free(ba, uint64_pow2(ba->max_level - heap_level(block_index)));
+  return BUDDY_STATUS_SUCCESS;
+}
+
+// converts the subtree at index from free levels into NB_* bits. below a
+// wholly free or unusable block the free levels are stale, so read is false
+// there and the nodes are cleared instead. an unusable block is marked as
+// allocated at its root, like any other allocation. below a block wholly past
+// n_pages nothing is touched, the layout may not even store it
+static uint8_t nb_ready_recursive(struct buddy_allocator_s *ba, uint64_t index,
+                                  uint8_t level, bool read) {
+  if (get_first_page_index_from_block_index(ba, index) >= ba->n_pages) {
+    heap_set(ba, index, NB_BUSY | NB_UNUSABLE);
+    return NB_BUSY | NB_UNUSABLE;
+  }
+
+  uint8_t v = 0;
+  bool descend = level != ba->max_level;
+  if (read) {
+    const uint8_t free_level = heap_get(ba, index);
+    if (free_level == BUDDY_LEVEL_UNUSABLE) {
+      v = NB_BUSY | NB_UNUSABLE;
+      read = false;
+    } else if (free_level == level) {
+      read = false;
+      // a lazy heap is still zero below a wholly free block. below an
+      // unusable one, buddy_mark_unusable may have split blocks first
+      descend = descend && !(ba->flags & BUDDY_FLAG_LAZY);
+    }
+  }
+
+  if (descend) {
+    if (nb_ready_recursive(ba, heap_left(index), level + 1, read) != 0) {
+      v |= NB_OCC_LEFT;
+    }
+    if (nb_ready_recursive(ba, heap_right(index), level + 1, read) != 0) {
+      v |= NB_OCC_RIGHT;
+    }
+  }
+  heap_set(ba, index, v);
+  return v;
+}
+
+// converts the free levels written by buddy_init and buddy_mark_unusable into
+// NB_* bits. every node up to n_pages must hold valid bits, since lock-free
+// allocation scans whole levels
+static void nb_ready(struct buddy_allocator_s *ba) {
+  nb_ready_recursive(ba, 0, 0, true);
+}
+
+// checks the lock-free heap while no operations are in flight
+static void nb_verify(struct buddy_allocator_s *ba) {
+  for (uint64_t i = 0; i < heap_size(ba->max_level); i++) {
+    if (get_first_page_index_from_block_index(ba, i) >= ba->n_pages) {
+      // stale, only the root of such a subtree is ever read
+      continue;
+    }
+    uint8_t v = heap_get(ba, i);
+    if (v & (NB_COAL_LEFT | NB_COAL_RIGHT)) {
+      fatal_s_u64_s("block ", i, " has a free in progress while quiescent\n");
+    }
+    if (v & NB_OCC) {
+      if ((v & NB_BUSY) != NB_BUSY) {
+        fatal_s_u64_s("block ", i, " is allocated but not busy\n");
+      }
+    } else if (heap_level(i) == ba->max_level) {
+      if (v != 0) {
+        fatal_s_u64_s("block ", i, " has an invalid value for a leaf\n");
+      }
+    } else {
+      bool left = heap_get(ba, heap_left(i)) != 0;
+      bool right = heap_get(ba, heap_right(i)) != 0;
+      if (left != ((v & NB_OCC_LEFT) != 0) ||
+          right != ((v & NB_OCC_RIGHT) != 0)) {
+        fatal_s_u64_s("block ", i,
+                      " occupied bits do not match its children\n");
+      }
+    }
+  }
+}
+
+////////////////////////////////
+/// BITMAP FUNCTIONS
+////////////////////////////////
+
+// When BUDDY_FLAG_BITMAP is set, the heap holds a byte per page followed by a
+// bitmap per order instead of the tree. Bit i of order k is set when block i
+// of order k is free and its buddy is not, so each bitmap is the free list of
+// its order. Above each bitmap sits a summary hierarchy, where bit i of a word
+// is set when word i of the level below is nonzero, so finding a free block
+// takes one ctz per level instead of a descent from the root.
+// The byte of a page is the order of the allocation it starts, otherwise
+// BM_PAGE_NONE or BUDDY_LEVEL_UNUSABLE.
+
+// the number of words in level j of the bitmap of an order with 2^bits bits
+static inline uint64_t bm_level_words(uint8_t bits, uint8_t j) {
+  const uint8_t shift = (uint8_t)(6 * (j + 1));
+  return bits > shift ? uint64_pow2(bits - shift) : 1;
+}
+
+// the number of levels in the bitmap of an order with 2^bits bits. the top
+// level is always a single word
+static inline uint8_t bm_levels(uint8_t bits) {
+  return bits <= 6 ? 1 : (uint8_t)((bits + 5) / 6);
+}
+
+// fills in offsets if it is not NULL.
+// returns the number of words in all the bitmaps for max_level
+static uint64_t bm_layout(uint8_t max_level, uint64_t *offsets) {
+  uint64_t words = 0;
+  for (uint8_t order = 0; order <= max_level; order++) {
+    if (offsets != NULL) {
+      offsets[order] = words;
+    }
+    const uint8_t bits = max_level - order;
+    for (uint8_t j = 0; j < bm_levels(bits); j++) {
+      words += bm_level_words(bits, j);
+    }
+  }
+  if (offsets != NULL) {
+    offsets[max_level + 1] = words;
+  }
+  return words;
+}
+
+// the number of bytes needed to store the pages and bitmaps for max_level
+static uint64_t bm_bytes(uint8_t max_level) {
+  // the words are aligned after the pages
+  return uint64_pow2(max_level) + sizeof(uint64_t) - 1 +
+         sizeof(uint64_t) * bm_layout(max_level, NULL);
+}
+
+static inline uint64_t *bm_words(struct buddy_allocator_s *ba,
+                                 uint8_t order) {
+  uintptr_t words = (uintptr_t)(ba->heap + uint64_pow2(ba->max_level));
+  words = (words + sizeof(uint64_t) - 1) & ~(uintptr_t)(sizeof(uint64_t) - 1);
+  return (uint64_t *)words + ba->bm_offset[order];
+}
+
+static inline bool bm_test(struct buddy_allocator_s *ba, uint8_t order,
+                           uint64_t index) {
+  return (bm_words(ba, order)[index / 64] >> (index % 64)) & 1;
+}
+
+// marks block index of order as free, along with the summary bits above it
+static void bm_set(struct buddy_allocator_s *ba, uint8_t order,
+                   uint64_t index) {
+  uint64_t *words = bm_words(ba, order);
+  const uint8_t bits = ba->max_level - order;
+  ba->stats.free_blocks[order]++;
+  uint64_t start = 0;
+  for (uint8_t j = 0; j < bm_levels(bits); j++) {
+    uint64_t *word = &words[start + index / 64];
+    const uint64_t was = *word;
+    *word = was | uint64_pow2(index % 64);
+    if (was != 0) {
+      // the levels above already know about this word
+      return;
+    }
+    start += bm_level_words(bits, j);
+    index /= 64;
+  }
+  ba->bm_orders |= uint64_pow2(order);
+}
+
+// marks block index of order as not free, along with the summary bits above it
+static void bm_clear(struct buddy_allocator_s *ba, uint8_t order,
+                     uint64_t index) {
+  uint64_t *words = bm_words(ba, order);
+  const uint8_t bits = ba->max_level - order;
+  ba->stats.free_blocks[order]--;
+  uint64_t start = 0;
+  for (uint8_t j = 0; j < bm_levels(bits); j++) {
+    uint64_t *word = &words[start + index / 64];
+    *word &= ~uint64_pow2(index % 64);
+    if (*word != 0) {
+      // the word is still nonempty for the levels above
+      return;
+    }
+    start += bm_level_words(bits, j);
+    index /= 64;
+  }
+  ba->bm_orders &= ~uint64_pow2(order);
+}
+
+// the first free block of order, which must have one
+static uint64_t bm_first(struct buddy_allocator_s *ba, uint8_t order) {
+  const uint64_t *words = bm_words(ba, order);
+  const uint8_t bits = ba->max_level - order;
+  // the top level is the last word of the order
+  uint64_t start = ba->bm_offset[order + 1] - ba->bm_offset[order] - 1;
+  uint64_t index = 0;
+  for (uint8_t j = bm_levels(bits); j > 0; j--) {
+    index = index * 64 + uint64_ctz(words[start + index]);
+    if (j > 1) {
+      start -= bm_level_words(bits, j - 2);
+    }
+  }
+  return index;
+}
+
+// frees block index of order, merging it with its free buddies
+static void bm_release(struct buddy_allocator_s *ba, uint8_t order,
+                       uint64_t index) {
+  while (order < ba->max_level && bm_test(ba, order, index ^ 1)) {
+    bm_clear(ba, order, index ^ 1);
+    index /= 2;
+    order++;
+  }
+  bm_set(ba, order, index);
+}
+
+static buddy_status_t bm_page_alloc(struct buddy_allocator_s *ba,
+                                    uint8_t order, uint64_t *page_id) {
+  // the smallest order with a free block that is large enough
+  const uint64_t orders = ba->bm_orders >> order;
+  if (orders == 0) {
+    stats_failed(ba);
+    return BUDDY_STATUS_NOMEM;
+  }
+  uint8_t found = order + uint64_ctz(orders);
+
+  uint64_t index = bm_first(ba, found);
+  bm_clear(ba, found, index);
+  // split it down to size, the upper halves are free
+  while (found > order) {
+    found--;
+    index *= 2;
+    bm_set(ba, found, index + 1);
+  }
+
+  *page_id = index << order;
+  ba->heap[*page_id] = order;
+  stats_alloc(ba, uint64_pow2(order));
+  return BUDDY_STATUS_SUCCESS;
+}
+
+// sets order to the order of the allocation starting at page_id
+static buddy_status_t bm_get_order(struct buddy_allocator_s *ba,
+                                   uint64_t page_id, uint8_t *order) {
+  if (page_id >= uint64_pow2(ba->max_level) ||
+      ba->heap[page_id] > ba->max_level) {
+    return BUDDY_STATUS_NO_SUCH_ALLOCATION;
+  }
+  *order = ba->heap[page_id];
+  return BUDDY_STATUS_SUCCESS;
+}
+
+static buddy_status_t bm_page_free(struct buddy_allocator_s *ba,
+                                   uint64_t page_id) {
+  uint8_t order;
+  buddy_status_t s = bm_get_order(ba, page_id, &order);
+  if (s != BUDDY_STATUS_SUCCESS) {
+    return s;
+  }
+  ba->heap[page_id] = BM_PAGE_NONE;
+  bm_release(ba, order, page_id >> order);
+  stats_free(ba, uint64_pow2(order));
+  return BUDDY_STATUS_SUCCESS;
+}
+
+// resizes the allocation of order starting at page_id in place
+static buddy_status_t bm_page_realloc(struct buddy_allocator_s *ba,
+                                      uint64_t page_id, uint8_t order,
+                                      uint8_t new_order) {
+  if (new_order < order) {
+    // shrink: the upper halves are free
+    for (uint8_t o = new_order; o < order; o++) {
+      bm_set(ba, o, (page_id >> o) + 1);
+    }
+  } else {
+    // grow: the block must be the lower half at every order, with a free
+    // upper half
+    for (uint8_t o = order; o < new_order; o++) {
+      if ((page_id >> o) % 2 != 0 || !bm_test(ba, o, (page_id >> o) + 1)) {
+        return BUDDY_STATUS_NOMEM;
+      }
+    }
+    for (uint8_t o = order; o < new_order; o++) {
+      bm_clear(ba, o, (page_id >> o) + 1);
+    }
+  }
+  ba->heap[page_id] = new_order;
+  ba->stats.allocated_pages += uint64_pow2(new_order);
+  ba->stats.allocated_pages -= uint64_pow2(order);
+  return BUDDY_STATUS_SUCCESS;
+}
+
+// frees the largest usable blocks within block index of order. returns true
+// instead if the whole block is usable, so that the caller frees it whole
+static bool bm_build(struct buddy_allocator_s *ba, uint8_t order,
+                     uint64_t index) {
+  if (order == 0) {
+    return ba->heap[index] != BUDDY_LEVEL_UNUSABLE;
+  }
+  const bool left = bm_build(ba, order - 1, 2 * index);
+  const bool right = bm_build(ba, order - 1, 2 * index + 1);
+  if (left && right) {
+    return true;
+  }
+  if (left) {
+    bm_set(ba, order - 1, 2 * index);
+  }
+  if (right) {
+    bm_set(ba, order - 1, 2 * index + 1);
+  }
+  return false;
+}
+
+// builds the bitmaps from the pages written by buddy_init and
+// buddy_mark_unusable
+static void bm_ready(struct buddy_allocator_s *ba) {
+  uint64_t *words = bm_words(ba, 0);
+  for (uint64_t i = 0; i < ba->bm_offset[ba->max_level + 1]; i++) {
+    words[i] = 0;
+  }
+  ba->bm_orders = 0;
+  memset(ba->stats.free_blocks, 0, sizeof(ba->stats.free_blocks));
+  if (bm_build(ba, ba->max_level, 0)) {
+    bm_set(ba, ba->max_level, 0);
+  }
+}
+
+// checks that the free blocks, the summaries and the pages agree
+static void bm_verify(struct buddy_allocator_s *ba) {
+  for (uint8_t order = 0; order <= ba->max_level; order++) {
+    const uint64_t *words = bm_words(ba, order);
+    const uint8_t bits = ba->max_level - order;
+
+    // every summary bit must match the word below it
+    uint64_t start = 0;
+    for (uint8_t j = 0; j + 1 < bm_levels(bits); j++) {
+      const uint64_t n_words = bm_level_words(bits, j);
+      for (uint64_t w = 0; w < n_words; w++) {
+        const bool summary =
+            (words[start + n_words + w / 64] >> (w % 64)) & 1;
+        if (summary != (words[start + w] != 0)) {
+          fatal_s_u64_s("order ", order, " has a stale summary bit\n");
+        }
+      }
+      start += n_words;
+    }
+    if (((ba->bm_orders >> order) & 1) != (words[start] != 0)) {
+      fatal_s_u64_s("order ", order, " has a stale bm_orders bit\n");
+    }
+
+    for (uint64_t index = 0; index < uint64_pow2(bits); index++) {
+      if (!bm_test(ba, order, index)) {
+        continue;
+      }
+      if (order < ba->max_level && bm_test(ba, order, index ^ 1)) {
+        fatal_s_u64_s("block ", index, " should be merged with its buddy\n");
+      }
+      // no page of a free block may be allocated or unusable
+      const uint64_t first = index << order;
+      for (uint64_t page_id = first; page_id < first + uint64_pow2(order);
+           page_id++) {
+        if (ba->heap[page_id] != BM_PAGE_NONE) {
+          fatal_s_u64_s("page ", page_id, " is busy but in a free block\n");
+        }
+      }
+      // nor may it be inside a larger allocation
+      for (uint8_t o = order + 1; o <= ba->max_level; o++) {
+        if (ba->heap[first >> o << o] == o) {
+          fatal_s_u64_s("page ", first, " is free but in an allocation\n");
+        }
+      }
+    }
+  }
+}
+
+// gets the necessary number of bytes to construct the buddy allocator heap
+uint64_t buddy_get_bytes(uint64_t n_pages) {
+  assert(n_pages != 0, "n_pages must not be 0");
+
+  uint8_t max_level = uint64_ceil_log2(n_pages);
+  uint64_t bytes = heap_bytes(n_pages);
+  // the same memory may be used for BUDDY_FLAG_BITMAP instead
+  if (bm_bytes(max_level) > bytes) {
+    bytes = bm_bytes(max_level);
+  }
+  return sizeof(struct buddy_allocator_s) + bytes;
+}
+
+uint64_t buddy_get_bytes_flags(uint64_t n_pages, buddy_flags_t flags) {
+  assert(n_pages != 0, "n_pages must not be 0");
+
+  uint8_t max_level = uint64_ceil_log2(n_pages);
+  if (flags & BUDDY_FLAG_BITMAP) {
+    return sizeof(struct buddy_allocator_s) + bm_bytes(max_level);
+  }
+  return sizeof(struct buddy_allocator_s) + heap_bytes(n_pages);
+}
+
+// marks the blocks wholly past n_pages unusable. they hang off the path of
+// blocks holding both the last page and the one after it, so only that path
+// and the blocks beside it are written
+static void heap_init_tail(struct buddy_allocator_s *ba) {
+  uint64_t index = 0;
+  uint8_t level = 0;
+  while (true) {
+    const uint64_t middle =
+        get_first_page_index_from_block_index(ba, heap_right(index));
+    if (middle < ba->n_pages) {
+      // the left half is wholly real, the path goes on in the right one
+      heap_set(ba, heap_left(index), level + 1);
+      index = heap_right(index);
+    } else {
+      heap_set(ba, heap_right(index), BUDDY_LEVEL_UNUSABLE);
+      if (middle == ba->n_pages) {
+        break;
+      }
+      index = heap_left(index);
+    }
+    level++;
+  }
+  heap_set(ba, heap_left(index), level + 1);
+  propagate(ba, heap_left(index));
+}
+
+void buddy_init(struct buddy_allocator_s *ba, uint64_t n_pages,
+                uint64_t page_size, uint64_t offset) {
+  buddy_init_flags(ba, n_pages, page_size, offset, 0);
+}
+
+void buddy_init_flags(struct buddy_allocator_s *ba, uint64_t n_pages,
+                      uint64_t page_size, uint64_t offset,
+                      buddy_flags_t flags) {
+  assert(n_pages != 0, "n_pages must not be 0");
+  assert(uint64_is_power_of_2(page_size), "page size must be a power of 2");
+
+  ba->state = BUDDY_STATE_UNREADY;
+  ba->flags = flags;
+  ba->max_level = uint64_ceil_log2(n_pages);
+  ba->n_pages = n_pages;
+  ba->next_fit_page = 0;
+  ba->journal = NULL;
+  memset(ba->defer_count, 0, sizeof(ba->defer_count));
+  memset(&ba->stats, 0, sizeof(ba->stats));
+#ifdef BUDDY_TRACE
+  ba->trace_heap = buddy_trace_heap_id();
+#endif
+  ba->offset = offset;
+  ba->page_size_log2 = uint64_log2(page_size);
+
+  if (flags & BUDDY_FLAG_BITMAP) {
+    assert(!(flags & BUDDY_FLAG_LOCKFREE),
+           "BUDDY_FLAG_BITMAP can't be combined with BUDDY_FLAG_LOCKFREE\n");
+    assert(!(flags & BUDDY_FLAG_DEFER),
+           "BUDDY_FLAG_BITMAP can't be combined with BUDDY_FLAG_DEFER\n");
+    bm_layout(ba->max_level, ba->bm_offset);
+    for (uint64_t i = 0; i < uint64_pow2(ba->max_level); i++) {
+      ba->heap[i] = i < n_pages ? BM_PAGE_NONE : BUDDY_LEVEL_UNUSABLE;
+    }
+    return;
+  }
+
+  assert(!(flags & BUDDY_FLAG_LOWEST_FIT) || !(flags & BUDDY_FLAG_NEXT_FIT),
+         "BUDDY_FLAG_LOWEST_FIT can't be combined with BUDDY_FLAG_NEXT_FIT\n");
+  assert(!(flags & BUDDY_FLAG_DEFER) || !(flags & BUDDY_FLAG_LOCKFREE),
+         "BUDDY_FLAG_DEFER can't be combined with BUDDY_FLAG_LOCKFREE\n");
+  assert(!(flags & BUDDY_FLAG_LOCKFREE) ||
+             BUDDY_LAYOUT != BUDDY_LAYOUT_COMPACT,
+         "BUDDY_FLAG_LOCKFREE is not supported by BUDDY_LAYOUT_COMPACT\n");
+  heap_layout_init(ba);
+
+  if (flags & BUDDY_FLAG_LAZY) {
+    // the rest is stale below a wholly free root. a zero leaf is never taken
+    // for the head of an allocation
+    heap_set(ba, 0, 0);
+  } else {
+    // every block starts out wholly free
+    for (uint8_t level = 0; level <= ba->max_level; level++) {
+      heap_fill_level(ba, level, level);
+    }
+  }
+
+  // the pages past n_pages don't exist
+  if (n_pages < uint64_pow2(ba->max_level)) {
+    heap_init_tail(ba);
+  }
+}
+
+void buddy_mark_unusable(struct buddy_allocator_s *ba, uint64_t min_page_id,
+                         uint64_t max_page_id) {
+  assert(ba->state == BUDDY_STATE_UNREADY,
+         "allocator state is ready (should be unready)\n");
+  if (ba->flags & BUDDY_FLAG_BITMAP) {
+    for (uint64_t i = min_page_id;
+         i <= max_page_id && i < uint64_pow2(ba->max_level); i++) {
+      ba->heap[i] = BUDDY_LEVEL_UNUSABLE;
+    }
+    return;
+  }
+  if (min_page_id > max_page_id) {
+    return;
+  }
+  // the tree is kept up to date, so buddy_ready has nothing left to rebuild
+  mark_range(ba, 0, heap_node(ba, 0), 0, min_page_id, max_page_id);
+}
+
+// adds the wholly free blocks in the subtree at index to free_blocks. before
+// buddy_ready only the paths to unusable pages are split, so only those are
+// walked
+static void count_free_blocks(struct buddy_allocator_s *ba, uint64_t index,
+                              heap_ref_t node, uint8_t level,
+                              uint64_t *free_blocks) {
+  const uint8_t v = node_get(ba, node);
+  if (v == level) {
+    free_blocks[ba->max_level - level]++;
+  } else if (v <= ba->max_level) {
+    // split, the free blocks are further down
+    count_free_blocks(ba, heap_left(index), heap_left_node(ba, index, node),
+                      level + 1, free_blocks);
+    count_free_blocks(ba, heap_right(index), heap_right_node(ba, index, node),
+                      level + 1, free_blocks);
+  }
+}
+
+void buddy_ready(struct buddy_allocator_s *ba) {
+  if (ba->flags & BUDDY_FLAG_BITMAP) {
+    bm_ready(ba);
+  } else {
+    memset(ba->stats.free_blocks, 0, sizeof(ba->stats.free_blocks));
+    count_free_blocks(ba, 0, heap_node(ba, 0), 0, ba->stats.free_blocks);
+  }
+  // nothing is allocated yet, every usable page is in a free block
+  ba->stats.usable_pages = 0;
+  for (uint8_t order = 0; order <= ba->max_level; order++) {
+    ba->stats.usable_pages += ba->stats.free_blocks[order] << order;
+  }
+
+  if (ba->flags & BUDDY_FLAG_LOCKFREE) {
+    nb_ready(ba);
+    memset(ba->stats.free_blocks, 0, sizeof(ba->stats.free_blocks));
+  }
+  ba->state = BUDDY_STATE_READY;
+}
+
+// checks block i against its children. returns true if they hold busy pages
+// and must be checked as well
+static bool verify_node(struct buddy_allocator_s *ba, uint64_t i) {
+  const uint8_t level = heap_level(i);
+  const uint8_t v = heap_get(ba, i);
+  if (level == ba->max_level) {
+    // the only valid values at this level are ba->max_level,
+    // BUDDY_LEVEL_UNUSABLE, or BUDDY_LEVEL_ALLOCATED
+    if (v != ba->max_level && v != BUDDY_LEVEL_UNUSABLE &&
+        v != BUDDY_LEVEL_ALLOCATED) {
+      fatal_s_u64_s("block ", i,
+                    " has an invalid value for a bottom level block\n");
+    }
+    return false;
+  }
+
+  // the children of a block that isn't split may not be stored
+  if (v == BUDDY_LEVEL_UNUSABLE) {
+    return false;
+  } else if (v == BUDDY_LEVEL_ALLOCATED) {
+    // allocated, its first leaf must point back to it
+    if (heap_get(ba, heap_first_leaf(ba, i)) != head_value(level)) {
+      fatal_s_u64_s("block ", i,
+                    " is allocated but its first leaf is not marked\n");
+    }
+    return false;
+  } else if (v < level) {
+    fatal_s_u64_s("block ", i,
+                  " has a smaller level than should be possible at "
+                  "it's level\n");
+  } else if (v == level) {
+    // fully free block
+    return false;
+  } else if (v > ba->max_level && v != BUDDY_LEVEL_FILLED) {
+    fatal_s_u64_s("block ", i,
+                  " has a greater level than is permissible in this tree\n");
+  }
+
+  const uint8_t left = heap_get(ba, heap_left(i));
+  const uint8_t right = heap_get(ba, heap_right(i));
+  if (v == BUDDY_LEVEL_FILLED) {
+    // both children must be full too
+    if (left <= BUDDY_LEVEL_MAX_VALID || right <= BUDDY_LEVEL_MAX_VALID) {
+      fatal_s_u64_s(
+          "block ", i,
+          "claims to be filled, but at least one child has free space\n");
+    }
+    return true;
+  }
+
+  // split, at least one descendant is busy
+  if (v != uint8_min(left, right)) {
+    fatal_s_u64_s("block ", i,
+                  " does not satisfy invariant that its smallest free "
+                  "level is the min of its children\n");
+  }
+  if (left == level + 1 && right == level + 1) {
+    fatal_s_u64_s("block ", i, " two children should be merged\n");
+  }
+  return true;
+}
+
+// checks every block of the tree that isn't below a free, allocated or
+// unusable one, in depth first order without a stack. adds the wholly free
+// blocks to free_blocks
+static void verify_tree(struct buddy_allocator_s *ba, uint64_t *free_blocks) {
+  uint64_t i = 0;
+  while (true) {
+    if (verify_node(ba, i)) {
+      i = heap_left(i);
+      continue;
+    }
+    if (heap_get(ba, i) == heap_level(i)) {
+      free_blocks[ba->max_level - heap_level(i)]++;
+    }
+    // climb out of the subtrees that are done, then go to the next one
+    while (i != 0 && i == heap_right(heap_parent(i))) {
+      i = heap_parent(i);
+    }
+    if (i == 0) {
+      return;
+    }
+    i++;
+  }
+}
+
+void buddy_verify(struct buddy_allocator_s *ba) {
+  assert(ba->state == BUDDY_STATE_READY, "must be ready to be verified");
+  if (ba->flags & BUDDY_FLAG_BITMAP) {
+    bm_verify(ba);
+    return;
+  }
+  if (ba->flags & BUDDY_FLAG_LOCKFREE) {
+    nb_verify(ba);
+    return;
+  }
+
+  // the free block counts must match the tree, and add up to the free pages
+  uint64_t free_blocks[BUDDY_STATS_ORDERS] = {0};
+  verify_tree(ba, free_blocks);
+  uint64_t free_pages = 0;
+  for (uint8_t order = 0; order <= ba->max_level; order++) {
+    if (free_blocks[order] != ba->stats.free_blocks[order]) {
+      fatal_s_u64_s("order ", order, " has a stale free block count\n");
+    }
+    free_pages += free_blocks[order] << order;
+  }
+  // the held blocks are allocated in the tree but freed in the stats
+  for (uint8_t order = 0; order < DEFER_ORDERS; order++) {
+    for (uint8_t i = 0; i < ba->defer_count[order]; i++) {
+      const uint64_t block_index = ba->defer_blocks[order][i];
+      if (heap_level(block_index) + order != ba->max_level ||
+          heap_get(ba, block_index) != BUDDY_LEVEL_ALLOCATED) {
+        fatal_s_u64_s("order ", order, " holds a block that isn't allocated\n");
+      }
+      free_pages += uint64_pow2(order);
+    }
+  }
+  if (free_pages != ba->stats.usable_pages - ba->stats.allocated_pages) {
+    fatal("the free and allocated page counts don't add up\n");
+  }
+}
+
+void buddy_dump(struct buddy_allocator_s *ba) {
+  if (ba->flags & BUDDY_FLAG_BITMAP) {
+    for (uint64_t page_id = 0; page_id < uint64_pow2(ba->max_level);
+         page_id++) {
+      printf("%u ", ba->heap[page_id]);
+    }
+    printf("\n");
+    return;
+  }
+  for (uint64_t z = 0; z < heap_size(ba->max_level); z++) {
+    // the blocks past n_pages may not be stored
+    if (get_first_page_index_from_block_index(ba, z) < ba->n_pages) {
+      printf("%u ", heap_get(ba, z));
+    }
+  }
+  printf("\n");
+}
+
+#ifdef BUDDY_DEBUG
+// checks the blocks on the path from the root to page_id and their buddies,
+// which hold every block that propagate and coalesce change for an operation
+// on the page
+static void verify_page_path(struct buddy_allocator_s *ba, uint64_t page_id) {
+  uint64_t i = 0;
+  while (verify_node(ba, i)) {
+    const uint64_t right = heap_right(i);
+    if (page_id < get_first_page_index_from_block_index(ba, right)) {
+      verify_node(ba, right);
+      i = heap_left(i);
+    } else {
+      verify_node(ba, heap_left(i));
+      i = right;
+    }
+  }
+}
+#endif
+
+// with BUDDY_DEBUG, checks the tree after a call that succeeded on the pages
+// from page_id, in O(log n). the last page covers the blocks split off the
+// end of an exact allocation
+static inline void debug_check(struct buddy_allocator_s *ba, uint64_t page_id,
+                               uint64_t n_pages, buddy_status_t status) {
+#ifdef BUDDY_DEBUG
+  if (status != BUDDY_STATUS_SUCCESS ||
+      (ba->flags & (BUDDY_FLAG_LOCKFREE | BUDDY_FLAG_BITMAP))) {
+    return;
+  }
+  verify_page_path(ba, page_id);
+  if (n_pages > 1) {
+    verify_page_path(ba, page_id + n_pages - 1);
+  }
+#else
+  (void)ba;
+  (void)page_id;
+  (void)n_pages;
+  (void)status;
+#endif
+}
+
+[[nodiscard("allocations may fail")]]
+static buddy_status_t page_alloc(struct buddy_allocator_s *ba,
+                                 uint64_t n_pages, uint64_t *page_id) {
+  assert(ba->state == BUDDY_STATE_READY, "allocator state is not ready\n");
+
+  // can't allocate 0 pages, round up to 1
+  if (n_pages == 0) {
+    n_pages = 1;
+  }
+
+  // could never allocate
+  if (n_pages > uint64_pow2(ba->max_level)) {
+    return BUDDY_STATUS_INVAL;
+  }
+
+  const uint8_t allocation_level = ba->max_level - uint64_ceil_log2(n_pages);
+
+  if (ba->flags & BUDDY_FLAG_LOCKFREE) {
+    return nb_page_alloc(ba, allocation_level, page_id);
+  }
+  if (ba->flags & BUDDY_FLAG_BITMAP) {
+    return bm_page_alloc(ba, ba->max_level - allocation_level, page_id);
+  }
+
+  uint64_t block_index;
+  // a held block of the same order is still allocated in the tree
+  if ((ba->flags & BUDDY_FLAG_DEFER) &&
+      defer_pop(ba, ba->max_level - allocation_level, &block_index)) {
+    stats_alloc(ba, uint64_pow2(ba->max_level - allocation_level));
+    *page_id = get_first_page_index_from_block_index(ba, block_index);
+    return BUDDY_STATUS_SUCCESS;
+  }
+
+  // we could theoretically allocate, but the structure is full, unless
+  // merging the held blocks makes room
+  if (allocation_level < heap_get(ba, 0) &&
+      (!defer_flush(ba) || allocation_level < heap_get(ba, 0))) {
+    stats_failed(ba);
+    return BUDDY_STATUS_NOMEM;
+  }
+
+  // split blocks to get a slot of the correct size
+  block_index = acquire_empty_slot(ba, allocation_level);
+
+  // mark this block as allocated and update parent blocks
+  heap_set(ba, block_index, BUDDY_LEVEL_ALLOCATED);
+  mark_head(ba, block_index);
+  // update parent blocks
+  propagate(ba, block_index);
+  stats_alloc(ba, uint64_pow2(ba->max_level - allocation_level));
+
+  // success
+  *page_id = get_first_page_index_from_block_index(ba, block_index);
+  return BUDDY_STATUS_SUCCESS;
+}
+
+[[nodiscard("allocations may fail")]]
+buddy_status_t buddy_page_alloc(struct buddy_allocator_s *ba, uint64_t n_pages,
+                                uint64_t *page_id) {
+  const buddy_status_t s = page_alloc(ba, n_pages, page_id);
+  trace(ba, BUDDY_TRACE_ALLOC, n_pages,
+        s == BUDDY_STATUS_SUCCESS ? *page_id : 0, s);
+  debug_check(ba, s == BUDDY_STATUS_SUCCESS ? *page_id : 0, n_pages, s);
+  return s;
+}
+
+static buddy_status_t page_free(struct buddy_allocator_s *ba,
+                                uint64_t page_id) {
+  assert(ba->state == BUDDY_STATE_READY, "allocator state is not ready\n");
+
+  if (ba->flags & BUDDY_FLAG_LOCKFREE) {
+    return nb_page_free(ba, page_id);
+  }
+  if (ba->flags & BUDDY_FLAG_BITMAP) {
+    return bm_page_free(ba, page_id);
+  }
+
+  uint64_t block_index;
+  buddy_status_t get_status =
+      get_block_index_from_head(ba, page_id, &block_index);
+  if (get_status != BUDDY_STATUS_SUCCESS) {
+    return get_status;
+  }
+
+  stats_free(ba, uint64_pow2(ba->max_level - heap_level(block_index)));
+  if (defer_push(ba, block_index)) {
+    return BUDDY_STATUS_SUCCESS;
+  }
+  // mark block as free and coalesce blocks starting from that point
+  const uint64_t coalesced_block_index = release_block(ba, block_index);
+  // then update free space on the parent blocks
+  propagate(ba, coalesced_block_index);
+
+  return BUDDY_STATUS_SUCCESS;
+}
+
+buddy_status_t buddy_page_free(struct buddy_allocator_s *ba, uint64_t page_id) {
+  const buddy_status_t s = page_free(ba, page_id);
+  trace(ba, BUDDY_TRACE_FREE, 0, page_id, s);
+  debug_check(ba, page_id, 0, s);
+  return s;
+}
+
+// allocates exactly n_pages pages from the block at block_index, which must be
+// wholly free or wholly allocated.
+// the block is split along the binary digits of n_pages: each halving either
+// allocates the left half whole and continues right, or leaves the right half
+// free and continues left. the pieces are contiguous and in decreasing size.
+static void trim_block(struct buddy_allocator_s *ba, uint64_t block_index,
+                       uint64_t n_pages) {
+  heap_ref_t node = heap_node(ba, block_index);
+  uint8_t level = heap_level(block_index);
+  uint64_t size = uint64_pow2(ba->max_level - level);
+  while (n_pages != size) {
+    const uint64_t half = size / 2;
+    heap_ref_t left_node = heap_left_node(ba, block_index, node);
+    heap_ref_t right_node = heap_right_node(ba, block_index, node);
+    node_set(ba, left_node, level + 1);
+    node_set(ba, right_node, level + 1);
+    if (n_pages > half) {
+      node_set(ba, left_node, BUDDY_LEVEL_ALLOCATED);
+      mark_head(ba, heap_left(block_index));
+      n_pages -= half;
+      block_index = heap_right(block_index);
+      node = right_node;
+    } else {
+      stats_add_free(ba, level + 1);
+      block_index = heap_left(block_index);
+      node = left_node;
+    }
+    level++;
+    size = half;
+  }
+
+  node_set(ba, node, BUDDY_LEVEL_ALLOCATED);
+  mark_head(ba, block_index);
+  // every node that was split is an ancestor of the last piece
+  propagate(ba, block_index);
+}
+
+[[nodiscard("allocations may fail")]]
+static buddy_status_t page_alloc_exact(struct buddy_allocator_s *ba,
+                                       uint64_t n_pages, uint64_t *page_id) {
+  assert(ba->state == BUDDY_STATE_READY, "allocator state is not ready\n");
+
+  // can't allocate 0 pages, round up to 1
+  if (n_pages == 0) {
+    n_pages = 1;
+  }
+
+  // could never allocate
+  if (n_pages > uint64_pow2(ba->max_level)) {
+    return BUDDY_STATUS_INVAL;
+  }
+
+  // only the tree can hold an allocation made of several blocks
+  if (ba->flags & (BUDDY_FLAG_LOCKFREE | BUDDY_FLAG_BITMAP)) {
+    return page_alloc(ba, n_pages, page_id);
+  }
+
+  const uint8_t allocation_level = ba->max_level - uint64_ceil_log2(n_pages);
+
+  // we could theoretically allocate, but the structure is full, unless
+  // merging the held blocks makes room
+  if (allocation_level < heap_get(ba, 0) &&
+      (!defer_flush(ba) || allocation_level < heap_get(ba, 0))) {
+    stats_failed(ba);
+    return BUDDY_STATUS_NOMEM;
+  }
+
+  const uint64_t block_index = acquire_empty_slot(ba, allocation_level);
+  trim_block(ba, block_index, n_pages);
+  ba->stats.saved_pages +=
+      uint64_pow2(ba->max_level - allocation_level) - n_pages;
+  stats_alloc(ba, n_pages);
+
+  *page_id = get_first_page_index_from_block_index(ba, block_index);
+  return BUDDY_STATUS_SUCCESS;
+}
+
+[[nodiscard("allocations may fail")]]
+buddy_status_t buddy_page_alloc_exact(struct buddy_allocator_s *ba,
+                                      uint64_t n_pages, uint64_t *page_id) {
+  const buddy_status_t s = page_alloc_exact(ba, n_pages, page_id);
+  trace(ba, BUDDY_TRACE_ALLOC_EXACT, n_pages,
+        s == BUDDY_STATUS_SUCCESS ? *page_id : 0, s);
+  debug_check(ba, s == BUDDY_STATUS_SUCCESS ? *page_id : 0, n_pages, s);
+  return s;
+}
+
+static buddy_status_t page_free_exact(struct buddy_allocator_s *ba,
+                                      uint64_t page_id, uint64_t n_pages) {
+  assert(ba->state == BUDDY_STATE_READY, "allocator state is not ready\n");
+
+  if (n_pages == 0) {
+    n_pages = 1;
+  }
+
+  if (n_pages > uint64_pow2(ba->max_level)) {
+    return BUDDY_STATUS_INVAL;
+  }
+
+  if (ba->flags & BUDDY_FLAG_LOCKFREE) {
+    uint64_t block_index;
+    buddy_status_t s = nb_get_block_index(ba, page_id, &block_index);
+    if (s != BUDDY_STATUS_SUCCESS) {
+      return s;
+    }
+    if (heap_level(block_index) != ba->max_level - uint64_ceil_log2(n_pages)) {
+      return BUDDY_STATUS_NO_SUCH_ALLOCATION;
+    }
+    nb_free_node(ba, block_index, 0);
+    stats_free(ba, uint64_pow2(ba->max_level - heap_level(block_index)));
+    return BUDDY_STATUS_SUCCESS;
+  }
+  if (ba->flags & BUDDY_FLAG_BITMAP) {
+    uint8_t order;
+    buddy_status_t s = bm_get_order(ba, page_id, &order);
+    if (s != BUDDY_STATUS_SUCCESS) {
+      return s;
+    }
+    if (order != uint64_ceil_log2(n_pages)) {
+      return BUDDY_STATUS_NO_SUCH_ALLOCATION;
+    }
+    return bm_page_free(ba, page_id);
+  }
+
+  // find every piece before freeing any, so that a bad call changes nothing
+  uint64_t pieces[64];
+  uint64_t n_pieces = 0;
+  uint64_t remaining = n_pages;
+  uint64_t piece_page_id = page_id;
+  while (remaining != 0) {
+    const uint8_t piece_log2 = uint64_log2(remaining);
+    uint64_t block_index;
+    buddy_status_t s =
+        get_block_index_from_head(ba, piece_page_id, &block_index);
+    if (s != BUDDY_STATUS_SUCCESS) {
+      return s;
+    }
+    if (heap_level(block_index) != ba->max_level - piece_log2) {
+      return BUDDY_STATUS_NO_SUCH_ALLOCATION;
+    }
+    pieces[n_pieces++] = block_index;
+    remaining -= uint64_pow2(piece_log2);
+    piece_page_id += uint64_pow2(piece_log2);
+  }
+
+  // the pieces are in page order, so they can share ancestor updates the same
+  // way buddy_page_free_bulk does
+  for (uint64_t i = 0; i < n_pieces; i++) {
+    uint8_t top_level = 0;
+    if (i + 1 < n_pieces) {
+      top_level = shared_top_level(
+          ba, get_first_page_index_from_block_index(ba, pieces[i]),
+          get_first_page_index_from_block_index(ba, pieces[i + 1]));
+    }
+    propagate_to(ba, release_block(ba, pieces[i]), top_level);
+  }
+
+  ba->stats.saved_pages -= uint64_pow2(uint64_ceil_log2(n_pages)) - n_pages;
+  stats_free(ba, n_pages);
+  return BUDDY_STATUS_SUCCESS;
+}
+
+buddy_status_t buddy_page_free_exact(struct buddy_allocator_s *ba,
+                                     uint64_t page_id, uint64_t n_pages) {
+  const buddy_status_t s = page_free_exact(ba, page_id, n_pages);
+  trace(ba, BUDDY_TRACE_FREE_EXACT, n_pages, page_id, s);
+  debug_check(ba, page_id, n_pages, s);
+  return s;
+}
+
+uint64_t buddy_get_saved_pages(struct buddy_allocator_s *ba) {
+  return ba->stats.saved_pages;
+}
+
+void buddy_get_stats(struct buddy_allocator_s *ba,
+                     struct buddy_stats_s *stats) {
+  assert(ba->state == BUDDY_STATE_READY, "allocator state is not ready\n");
+
+  *stats = ba->stats;
+  if (ba->flags & BUDDY_FLAG_LOCKFREE) {
+    // the copy above may have torn these, other threads update them
+    stats->allocated_pages =
+        __atomic_load_n(&ba->stats.allocated_pages, __ATOMIC_RELAXED);
+    stats->n_allocs = __atomic_load_n(&ba->stats.n_allocs, __ATOMIC_RELAXED);
+    stats->n_frees = __atomic_load_n(&ba->stats.n_frees, __ATOMIC_RELAXED);
+    stats->n_failed = __atomic_load_n(&ba->stats.n_failed, __ATOMIC_RELAXED);
+  }
+  stats->free_pages = stats->usable_pages - stats->allocated_pages;
+
+  stats->largest_free_pages = 0;
+  if (ba->flags & BUDDY_FLAG_BITMAP) {
+    if (ba->bm_orders != 0) {
+      stats->largest_free_pages = uint64_pow2(uint64_log2(ba->bm_orders));
+    }
+  } else if (!(ba->flags & BUDDY_FLAG_LOCKFREE)) {
+    const uint8_t root = heap_get(ba, 0);
+    if (root <= ba->max_level) {
+      stats->largest_free_pages = uint64_pow2(ba->max_level - root);
+    }
+    // the held blocks are free to the caller, though not merged
+    for (uint8_t order = 0; order < DEFER_ORDERS; order++) {
+      stats->free_blocks[order] += ba->defer_count[order];
+      if (ba->defer_count[order] != 0 &&
+          stats->largest_free_pages < uint64_pow2(order)) {
+        stats->largest_free_pages = uint64_pow2(order);
+      }
+    }
+  }
+
+  stats->fragmentation = 0;
+  if (stats->free_pages != 0 && stats->largest_free_pages != 0) {
+    stats->fragmentation = 1.0 - (double)stats->largest_free_pages /
+                                     (double)stats->free_pages;
+  }
+}
+
+/// SNAPSHOT FUNCTIONS
+// a snapshot is a snapshot_header_s followed by the memory of the allocator
+// as it is, buddy_get_bytes_flags(n_pages, flags) bytes of it. neither the
+// struct nor the heap hold pointers, so the copy works at any address, but
+// only in a build with the same layout and struct
+
+// "BSNP"
+#define SNAPSHOT_MAGIC 0x504e5342
+#define SNAPSHOT_VERSION 1
+
+struct snapshot_header_s {
+  uint32_t magic;
+  uint16_t version;
+  // the BUDDY_LAYOUT of the build that wrote it
+  uint8_t layout;
+  // 0, so that a later version can give it a meaning
+  uint8_t reserved;
+  // sizeof(struct buddy_allocator_s) in the build that wrote it
+  uint64_t struct_bytes;
+  uint64_t n_pages;
+  buddy_flags_t flags;
+  // the bytes of allocator memory after the header
+  uint64_t bytes;
+  // of the bytes after the header
+  uint64_t checksum;
+};
+
+// FNV-1a over 8 byte words, so that checking a large heap is bound by memory
+// bandwidth rather than by the multiplies
+static uint64_t snapshot_checksum(const uint8_t *p, uint64_t n) {
+  uint64_t h = 0xcbf29ce484222325;
+  uint64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t word;
+    memcpy(&word, p + i, 8);
+    h = (h ^ word) * 0x100000001b3;
+  }
+  for (; i < n; i++) {
+    h = (h ^ p[i]) * 0x100000001b3;
+  }
+  return h;
+}
+
+// reads the header of the snapshot in buf, and checks that this build can
+// restore it
+static buddy_status_t snapshot_read_header(const void *buf, uint64_t bytes,
+                                           struct snapshot_header_s *header) {
+  if (bytes < sizeof(struct snapshot_header_s)) {
+    return BUDDY_STATUS_INVAL;
+  }
+  memcpy(header, buf, sizeof(struct snapshot_header_s));
+  if (header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION ||
+      header->layout != BUDDY_LAYOUT || header->reserved != 0 ||
+      header->struct_bytes != sizeof(struct buddy_allocator_s) ||
+      header->n_pages == 0 ||
+      header->bytes !=
+          buddy_get_bytes_flags(header->n_pages, header->flags) ||
+      bytes - sizeof(struct snapshot_header_s) < header->bytes) {
+    return BUDDY_STATUS_INVAL;
+  }
+  return BUDDY_STATUS_SUCCESS;
+}
+
+uint64_t buddy_snapshot_get_bytes(struct buddy_allocator_s *ba) {
+  return sizeof(struct snapshot_header_s) +
+         buddy_get_bytes_flags(ba->n_pages, ba->flags);
+}
+
+buddy_status_t buddy_snapshot(struct buddy_allocator_s *ba, void *buf,
+                              uint64_t bytes) {
+  assert(ba->state == BUDDY_STATE_READY, "allocator state is not ready\n");
+  if (bytes < buddy_snapshot_get_bytes(ba)) {
+    return BUDDY_STATUS_INVAL;
+  }
+
+  struct snapshot_header_s header = {
+      .magic = SNAPSHOT_MAGIC,
+      .version = SNAPSHOT_VERSION,
+      .layout = BUDDY_LAYOUT,
+      .struct_bytes = sizeof(struct buddy_allocator_s),
+      .n_pages = ba->n_pages,
+      .flags = ba->flags,
+      .bytes = buddy_get_bytes_flags(ba->n_pages, ba->flags),
+  };
+  uint8_t *body = (uint8_t *)buf + sizeof(struct snapshot_header_s);
+  memcpy(body, ba, header.bytes);
+  header.checksum = snapshot_checksum(body, header.bytes);
+  memcpy(buf, &header, sizeof(struct snapshot_header_s));
+  return BUDDY_STATUS_SUCCESS;
+}
+
+buddy_status_t buddy_restore_get_bytes(const void *buf, uint64_t bytes,
+                                       uint64_t *ba_bytes) {
+  struct snapshot_header_s header;
+  buddy_status_t s = snapshot_read_header(buf, bytes, &header);
+  if (s != BUDDY_STATUS_SUCCESS) {
+    return s;
+  }
+  *ba_bytes = header.bytes;
+  return BUDDY_STATUS_SUCCESS;
+}
+
+buddy_status_t buddy_restore(struct buddy_allocator_s *ba, const void *buf,
+                             uint64_t bytes) {
+  struct snapshot_header_s header;
+  buddy_status_t s = snapshot_read_header(buf, bytes, &header);
+  if (s != BUDDY_STATUS_SUCCESS) {
+    return s;
+  }
+  const uint8_t *body = (const uint8_t *)buf + sizeof(struct snapshot_header_s);
+  if (snapshot_checksum(body, header.bytes) != header.checksum) {
+    return BUDDY_STATUS_INVAL;
+  }
+
+  memcpy(ba, body, header.bytes);
+  if (ba->n_pages != header.n_pages || ba->flags != header.flags ||
+      ba->state != BUDDY_STATE_READY) {
+    return BUDDY_STATUS_INVAL;
+  }
+  if (!(ba->flags & BUDDY_FLAG_BITMAP)) {
+    heap_layout_rebase(ba);
+  }
+  // the journal belonged to the allocator the snapshot was taken of
+  ba->journal = NULL;
+#ifdef BUDDY_TRACE
+  // a new heap as far as this process's trace is concerned
+  ba->trace_heap = buddy_trace_heap_id();
+#endif
+  return BUDDY_STATUS_SUCCESS;
+}
+
+/// JOURNAL FUNCTIONS
+// the allocator's side of buddy_journal.c. the journal sees the tree as bytes
+// from heap_base, so the notes of any layout are replayed the same way
+
+buddy_status_t buddy_journal_attach(struct buddy_allocator_s *ba,
+                                    struct buddy_journal_s *journal) {
+  if (ba->state != BUDDY_STATE_READY ||
+      (ba->flags & (BUDDY_FLAG_LOCKFREE | BUDDY_FLAG_BITMAP))) {
+    return BUDDY_STATUS_INVAL;
+  }
+  // the held blocks are freed in the stats but not in the tree
+  (void)defer_flush(ba);
+  ba->journal = journal;
+  return BUDDY_STATUS_SUCCESS;
+}
+
+void buddy_journal_get_counters(struct buddy_allocator_s *ba,
+                                struct buddy_journal_counters_s *counters) {
+  counters->allocated_pages = ba->stats.allocated_pages;
+  counters->saved_pages = ba->stats.saved_pages;
+  counters->n_allocs = ba->stats.n_allocs;
+  counters->n_frees = ba->stats.n_frees;
+  counters->n_failed = ba->stats.n_failed;
+  counters->next_fit_page = ba->next_fit_page;
+}
+
+buddy_status_t
+buddy_journal_replay(struct buddy_allocator_s *ba, const uint64_t *notes,
+                     uint64_t n_notes,
+                     const struct buddy_journal_counters_s *counters) {
+  const uint64_t tree_bytes = heap_tree_bytes(ba->n_pages);
+  for (uint64_t i = 0; i < n_notes; i++) {
+    if ((notes[i] >> 8) >= tree_bytes) {
+      return BUDDY_STATUS_INVAL;
+    }
+  }
+
+  uint8_t *base = heap_base(ba);
+  for (uint64_t i = 0; i < n_notes; i++) {
+    base[notes[i] >> 8] = (uint8_t)notes[i];
+  }
+  ba->stats.allocated_pages = counters->allocated_pages;
+  ba->stats.saved_pages = counters->saved_pages;
+  ba->stats.n_allocs = counters->n_allocs;
+  ba->stats.n_frees = counters->n_frees;
+  ba->stats.n_failed = counters->n_failed;
+  ba->next_fit_page = counters->next_fit_page;
+  memset(ba->stats.free_blocks, 0, sizeof(ba->stats.free_blocks));
+  count_free_blocks(ba, 0, heap_node(ba, 0), 0, ba->stats.free_blocks);
+  // pages taken offline or put back online show in the tree alone
+  ba->stats.usable_pages = ba->stats.allocated_pages;
+  for (uint8_t order = 0; order <= ba->max_level; order++) {
+    ba->stats.usable_pages += ba->stats.free_blocks[order] << order;
+  }
+  return BUDDY_STATUS_SUCCESS;
+}
+
+// finds the ancestor at new_level that the block at block_index grows into in
+// place. the block must be the first half of each ancestor up to the new
+// level, and every second half must be wholly free
+static bool grow_target(struct buddy_allocator_s *ba, uint64_t block_index,
+                        uint8_t new_level, uint64_t *index, heap_ref_t *node) {
+  *index = block_index;
+  *node = heap_node(ba, block_index);
+  for (uint8_t l = heap_level(block_index); l > new_level; l--) {
+    if (*index % 2 != 1 ||
+        node_get(ba, heap_sibling_node(ba, *index, *node)) != l) {
+      return false;
+    }
+    *node = heap_parent_node(ba, *index, *node);
+    *index = heap_parent(*index);
+  }
+  return true;
+}
+
+static buddy_status_t page_realloc(struct buddy_allocator_s *ba,
+                                   uint64_t page_id, uint64_t n_pages) {
+  assert(ba->state == BUDDY_STATE_READY, "allocator state is not ready\n");
+
+  // can't allocate 0 pages, round up to 1
+  if (n_pages == 0) {
+    n_pages = 1;
+  }
+
+  // could never allocate
+  if (n_pages > uint64_pow2(ba->max_level)) {
+    return BUDDY_STATUS_INVAL;
+  }
+
+  if (ba->flags & BUDDY_FLAG_BITMAP) {
+    uint8_t order;
+    buddy_status_t s = bm_get_order(ba, page_id, &order);
+    if (s != BUDDY_STATUS_SUCCESS) {
+      return s;
+    }
+    return bm_page_realloc(ba, page_id, order, uint64_ceil_log2(n_pages));
+  }
+
+  uint64_t block_index;
+  buddy_status_t s;
+  if (ba->flags & BUDDY_FLAG_LOCKFREE) {
+    s = nb_get_block_index(ba, page_id, &block_index);
+  } else {
+    s = get_block_index_from_head(ba, page_id, &block_index);
+  }
+  if (s != BUDDY_STATUS_SUCCESS) {
+    return s;
+  }
+
+  const uint8_t level = heap_level(block_index);
+  const uint8_t new_level = ba->max_level - uint64_ceil_log2(n_pages);
+  if (new_level == level) {
+    return BUDDY_STATUS_SUCCESS;
+  }
+
+  // a lock-free block can't change level without racing its ancestors
+  if (ba->flags & BUDDY_FLAG_LOCKFREE) {
+    return BUDDY_STATUS_NOMEM;
+  }
+
+  if (new_level > level) {
+    // shrink: keep splitting off the upper half until the block is small
+    // enough, the upper halves are free again
+    trim_block(ba, block_index, uint64_pow2(ba->max_level - new_level));
+    ba->stats.allocated_pages -= uint64_pow2(ba->max_level - level) -
+                                 uint64_pow2(ba->max_level - new_level);
+    return BUDDY_STATUS_SUCCESS;
+  }
+
+  // grow, unless the buddies it needs are held back by BUDDY_FLAG_DEFER
+  uint64_t index;
+  heap_ref_t node;
+  if (!grow_target(ba, block_index, new_level, &index, &node) &&
+      (!defer_flush(ba) ||
+       !grow_target(ba, block_index, new_level, &index, &node))) {
+    return BUDDY_STATUS_NOMEM;
+  }
+
+  // the blocks below are not looked at again until this one is split
+  node_set(ba, node, BUDDY_LEVEL_ALLOCATED);
+  mark_head(ba, index);
+  propagate(ba, index);
+  for (uint8_t l = level; l > new_level; l--) {
+    // the free buddy taken over at l
+    stats_remove_free(ba, l);
+  }
+  ba->stats.allocated_pages += uint64_pow2(ba->max_level - new_level) -
+                               uint64_pow2(ba->max_level - level);
+  return BUDDY_STATUS_SUCCESS;
+}
+
+buddy_status_t buddy_page_realloc(struct buddy_allocator_s *ba,
+                                  uint64_t page_id, uint64_t n_pages) {
+  const buddy_status_t s = page_realloc(ba, page_id, n_pages);
+  trace(ba, BUDDY_TRACE_REALLOC, n_pages, page_id, s);
+  debug_check(ba, page_id, n_pages, s);
+  return s;
+}
+
+// allocates up to count blocks at allocation_level from the subtree at index,
+// writing their first pages to page_ids. every node it touches is recomputed
+// on the way out, so no propagation is needed below the caller.
+// returns how many blocks were allocated
+static uint64_t harvest(struct buddy_allocator_s *ba, uint64_t index,
+                        heap_ref_t node, uint8_t level,
+                        const uint8_t allocation_level, uint64_t count,
+                        uint64_t *page_ids) {
+  if (count == 0 || node_get(ba, node) > allocation_level) {
+    // nothing that fits in this subtree
+    return 0;
+  }
+
+  if (node_get(ba, node) == level) {
+    if (level == allocation_level) {
+      node_set(ba, node, BUDDY_LEVEL_ALLOCATED);
+      mark_head(ba, index);
+      stats_remove_free(ba, level);
+      stats_alloc(ba, uint64_pow2(ba->max_level - level));
+      page_ids[0] = get_first_page_index_from_block_index(ba, index);
+      return 1;
+    }
+    // split block (the smallest level is now one of the children)
+    node_set(ba, node, level + 1);
+    node_set(ba, heap_left_node(ba, index, node), level + 1);
+    node_set(ba, heap_right_node(ba, index, node), level + 1);
+    stats_split(ba, level);
+  }
+
+  uint64_t first = heap_left(index);
+  uint64_t second = heap_right(index);
+  heap_ref_t first_node = heap_left_node(ba, index, node);
+  heap_ref_t second_node = heap_right_node(ba, index, node);
+  // same preference as acquire_empty_slot, fill up smaller free blocks first.
+  // the placement policies harvest in address order
+  if (!(ba->flags & (BUDDY_FLAG_LOWEST_FIT | BUDDY_FLAG_NEXT_FIT)) &&
+      node_get(ba, first_node) < node_get(ba, second_node) &&
+      allocation_level >= node_get(ba, second_node)) {
+    first = heap_right(index);
+    second = heap_left(index);
+    first_node = second_node;
+    second_node = heap_left_node(ba, index, node);
+  }
+
+  uint64_t n = harvest(ba, first, first_node, level + 1, allocation_level,
+                       count, page_ids);
+  n += harvest(ba, second, second_node, level + 1, allocation_level, count - n,
+               page_ids + n);
+
+  node_set(ba, node,
+           parent_free_level(ba, node_get(ba, first_node),
+                             node_get(ba, second_node)));
+  return n;
+}
+
+[[nodiscard("allocations may fail")]]
+static uint64_t page_alloc_bulk(struct buddy_allocator_s *ba,
+                                uint64_t n_pages, uint64_t count,
+                                uint64_t *page_ids) {
+  assert(ba->state == BUDDY_STATE_READY, "allocator state is not ready\n");
+
+  // can't allocate 0 pages, round up to 1
+  if (n_pages == 0) {
+    n_pages = 1;
+  }
+
+  // could never allocate
+  if (n_pages > uint64_pow2(ba->max_level)) {
+    return 0;
+  }
+
+  if (ba->flags & (BUDDY_FLAG_LOCKFREE | BUDDY_FLAG_BITMAP)) {
+    uint64_t n = 0;
+    while (n < count &&
+           page_alloc(ba, n_pages, &page_ids[n]) == BUDDY_STATUS_SUCCESS) {
+      n++;
+    }
+    return n;
+  }
+
+  const uint8_t allocation_level = ba->max_level - uint64_ceil_log2(n_pages);
+  uint64_t n = harvest(ba, 0, heap_node(ba, 0), 0, allocation_level, count,
+                       page_ids);
+  if (n < count && defer_flush(ba)) {
+    n += harvest(ba, 0, heap_node(ba, 0), 0, allocation_level, count - n,
+                 page_ids + n);
+  }
+  if (n < count) {
+    // counted once, like the failed call that ends the loop above
+    stats_failed(ba);
+  }
+  return n;
+}
+
+[[nodiscard("allocations may fail")]]
+uint64_t buddy_page_alloc_bulk(struct buddy_allocator_s *ba, uint64_t n_pages,
+                               uint64_t count, uint64_t *page_ids) {
+  const uint64_t n = page_alloc_bulk(ba, n_pages, count, page_ids);
+  // one record per block, as if each had been allocated on its own
+  for (uint64_t i = 0; i < n; i++) {
+    trace(ba, BUDDY_TRACE_ALLOC, n_pages, page_ids[i], BUDDY_STATUS_SUCCESS);
+    debug_check(ba, page_ids[i], n_pages, BUDDY_STATUS_SUCCESS);
+  }
+  return n;
+}
+
+static int uint64_compare(const void *a, const void *b) {
+  const uint64_t x = *(const uint64_t *)a;
+  const uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+uint64_t buddy_page_free_bulk(struct buddy_allocator_s *ba, uint64_t *page_ids,
+                              uint64_t count) {
+  assert(ba->state == BUDDY_STATE_READY, "allocator state is not ready\n");
+
+  if (ba->flags & (BUDDY_FLAG_LOCKFREE | BUDDY_FLAG_BITMAP)) {
+    uint64_t n = 0;
+    for (uint64_t i = 0; i < count; i++) {
+      n += buddy_page_free(ba, page_ids[i]) == BUDDY_STATUS_SUCCESS;
+    }
+    return n;
+  }
+
+  // in page order, every ancestor is shared by a contiguous run of frees. each
+  // free only recomputes the ancestors that no later free in the batch is
+  // below, so every ancestor is recomputed once, after its last free
+  qsort(page_ids, count, sizeof(uint64_t), uint64_compare);
+
+  uint64_t n = 0;
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t block_index;
+    uint64_t walk_start;
+    if (get_block_index_from_head(ba, page_ids[i], &block_index) ==
+        BUDDY_STATUS_SUCCESS) {
+      stats_free(ba, uint64_pow2(ba->max_level - heap_level(block_index)));
+      // mark block as free and coalesce blocks starting from that point
+      walk_start = release_block(ba, block_index);
+      n++;
+      trace(ba, BUDDY_TRACE_FREE, 0, page_ids[i], BUDDY_STATUS_SUCCESS);
+    } else {
+      trace(ba, BUDDY_TRACE_FREE, 0, page_ids[i],
+            BUDDY_STATUS_NO_SUCH_ALLOCATION);
+      // the ancestors of the block containing the page may still need
+      // updates from earlier frees
+      get_block_index_from_page_index(ba, page_ids[i], &walk_start);
+    }
+
+    uint8_t top_level = 0;
+    if (i + 1 < count) {
+      // stop below the lowest ancestor shared with the next free
+      top_level = shared_top_level(ba, page_ids[i], page_ids[i + 1]);
+    }
+    propagate_to(ba, walk_start, top_level);
+  }
+  // only once every ancestor is recomputed
+  for (uint64_t i = 0; i < count; i++) {
+    debug_check(ba, page_ids[i], 0, BUDDY_STATUS_SUCCESS);
+  }
+  return n;
+}
+
+buddy_status_t buddy_page_size_of(struct buddy_allocator_s *ba,
+                                  uint64_t page_id, uint64_t *n_pages) {
+  assert(ba->state == BUDDY_STATE_READY, "allocator state is not ready\n");
+
+  if (ba->flags & BUDDY_FLAG_BITMAP) {
+    uint8_t order;
+    buddy_status_t s = bm_get_order(ba, page_id, &order);
+    if (s != BUDDY_STATUS_SUCCESS) {
+      return s;
+    }
+    *n_pages = uint64_pow2(order);
+    return BUDDY_STATUS_SUCCESS;
+  }
+
+  uint64_t block_index;
+  buddy_status_t s;
+  if (ba->flags & BUDDY_FLAG_LOCKFREE) {
+    s = nb_get_block_index(ba, page_id, &block_index);
+  } else {
+    s = get_block_index_from_head(ba, page_id, &block_index);
+  }
+  if (s != BUDDY_STATUS_SUCCESS) {
+    return s;
+  }
+
+  *n_pages = uint64_pow2(ba->max_level - heap_level(block_index));
+  return BUDDY_STATUS_SUCCESS;
+}
+
+/// DEFRAG FUNCTIONS
+// buddy_defrag_plan weighs every block of the order asked for by what is
+// allocated in it, and keeps the cheapest one whose allocations fit in the
+// free blocks outside of it
+
+// what it takes to empty one block of the tree
+struct defrag_cost_s {
+  // the allocated pages and blocks within it
+  uint64_t pages;
+  uint64_t blocks;
+  // for each order, the allocated and the wholly free blocks within it
+  uint64_t moved[BUDDY_STATS_ORDERS];
+  uint64_t free[BUDDY_STATS_ORDERS];
+};
+
+// counts what is in the subtree at index, depth first without a stack. gives
+// up when it holds unusable pages, or more than max_blocks allocated blocks or
+// max_pages allocated pages
+static bool defrag_cost(struct buddy_allocator_s *ba, uint64_t index,
+                        uint64_t max_blocks, uint64_t max_pages,
+                        struct defrag_cost_s *cost) {
+  memset(cost, 0, sizeof(*cost));
+  uint64_t i = index;
+  while (true) {
+    const uint8_t level = heap_level(i);
+    const uint8_t order = ba->max_level - level;
+    const uint8_t v = heap_get(ba, i);
+    if (v == BUDDY_LEVEL_UNUSABLE) {
+      return false;
+    } else if (v == BUDDY_LEVEL_ALLOCATED) {
+      cost->pages += uint64_pow2(order);
+      cost->blocks++;
+      cost->moved[order]++;
+      if (cost->blocks > max_blocks || cost->pages > max_pages) {
+        return false;
+      }
+    } else if (v == level) {
+      cost->free[order]++;
+    } else {
+      // split, at least one descendant is busy
+      i = heap_left(i);
+      continue;
+    }
+    // climb out of the subtrees that are done, then go to the next one
+    while (i != index && i == heap_right(heap_parent(i))) {
+      i = heap_parent(i);
+    }
+    if (i == index) {
+      return true;
+    }
+    i++;
+  }
+}
+
+// whether the allocations counted in cost fit in the free blocks outside of
+// the block they were counted in. the sizes are powers of 2, so placing them
+// largest first always works if, for every order, the allocations of that
+// order and up fit in the free blocks of that order and up
+static bool defrag_fits(struct buddy_allocator_s *ba,
+                        const struct defrag_cost_s *cost) {
+  uint64_t needed = 0;
+  uint64_t room = 0;
+  for (uint8_t order = ba->max_level + 1; order-- > 0;) {
+    needed += cost->moved[order] << order;
+    room += (ba->stats.free_blocks[order] - cost->free[order]) << order;
+    if (needed > room) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// sets moves to the allocations in the subtree at index, in page order
+static uint64_t defrag_moves(struct buddy_allocator_s *ba, uint64_t index,
+                             struct buddy_move_s *moves) {
+  uint64_t n = 0;
+  uint64_t i = index;
+  while (true) {
+    const uint8_t v = heap_get(ba, i);
+    if (v == BUDDY_LEVEL_ALLOCATED) {
+      moves[n++] = (struct buddy_move_s){
+          .page_id = get_first_page_index_from_block_index(ba, i),
+          .n_pages = uint64_pow2(ba->max_level - heap_level(i)),
+      };
+    } else if (v != heap_level(i)) {
+      i = heap_left(i);
+      continue;
+    }
+    while (i != index && i == heap_right(heap_parent(i))) {
+      i = heap_parent(i);
+    }
+    if (i == index) {
+      return n;
+    }
+    i++;
+  }
+}
+
+// largest first, then in page order
+static int defrag_move_compare(const void *a, const void *b) {
+  const struct buddy_move_s *x = a;
+  const struct buddy_move_s *y = b;
+  if (x->n_pages != y->n_pages) {
+    return x->n_pages < y->n_pages ? 1 : -1;
+  }
+  return (x->page_id > y->page_id) - (x->page_id < y->page_id);
+}
+
+// picks a destination for each of the moves out of the block at index by
+// allocating them with that block walled off, then frees them again. the
+// tree merges back to the free blocks it had, so nothing is left changed
+static void defrag_destinations(struct buddy_allocator_s *ba, uint64_t index,
+                                struct buddy_move_s *moves,
+                                uint64_t n_moves) {
+  const uint8_t v = heap_get(ba, index);
+  const uint64_t next_fit_page = ba->next_fit_page;
+  heap_set(ba, index, BUDDY_LEVEL_UNUSABLE);
+  propagate(ba, index);
+
+  for (uint64_t k = 0; k < n_moves; k++) {
+    const uint8_t level = ba->max_level - uint64_log2(moves[k].n_pages);
+    const uint64_t block_index = acquire_empty_slot(ba, level);
+    heap_set(ba, block_index, BUDDY_LEVEL_ALLOCATED);
+    propagate(ba, block_index);
+    moves[k].dest_page_id =
+        get_first_page_index_from_block_index(ba, block_index);
+  }
+  for (uint64_t k = 0; k < n_moves; k++) {
+    const uint64_t block_index =
+        heap_ancestor(heap_leaf(ba, moves[k].dest_page_id),
+                      ba->max_level - uint64_log2(moves[k].n_pages));
+    propagate(ba, release_block(ba, block_index));
+  }
+
+  heap_set(ba, index, v);
+  propagate(ba, index);
+  ba->next_fit_page = next_fit_page;
+}
+
+buddy_status_t buddy_defrag_plan(struct buddy_allocator_s *ba, uint8_t order,
+                                 struct buddy_move_s *moves,
+                                 uint64_t max_moves, uint64_t *n_moves,
+                                 uint64_t *page_id) {
+  assert(ba->state == BUDDY_STATE_READY, "allocator state is not ready\n");
+
+  if ((ba->flags & (BUDDY_FLAG_LOCKFREE | BUDDY_FLAG_BITMAP)) ||
+      order > ba->max_level) {
+    return BUDDY_STATUS_INVAL;
+  }
+
+  // the held blocks would look like allocations to move
+  (void)defer_flush(ba);
+  const uint8_t target_level = ba->max_level - order;
+  *n_moves = 0;
+  bool found = false;
+  uint64_t best = 0;
+  uint64_t best_pages = UINT64_MAX;
+  uint64_t best_blocks = UINT64_MAX;
+  struct defrag_cost_s cost;
+  // depth first down to target_level, skipping what can't be emptied
+  uint64_t i = 0;
+  while (true) {
+    const uint8_t level = heap_level(i);
+    const uint8_t v = heap_get(ba, i);
+    if (v == level) {
+      // free already, nothing has to move
+      *page_id = get_first_page_index_from_block_index(ba, i);
+      return BUDDY_STATUS_SUCCESS;
+    }
+    if (level < target_level && v != BUDDY_LEVEL_ALLOCATED &&
+        v != BUDDY_LEVEL_UNUSABLE) {
+      i = heap_left(i);
+      continue;
+    }
+    if (level == target_level &&
+        defrag_cost(ba, i, max_moves, best_pages, &cost) &&
+        (cost.pages < best_pages || cost.blocks < best_blocks) &&
+        defrag_fits(ba, &cost)) {
+      found = true;
+      best = i;
+      best_pages = cost.pages;
+      best_blocks = cost.blocks;
+    }
+    while (i != 0 && i == heap_right(heap_parent(i))) {
+      i = heap_parent(i);
+    }
+    if (i == 0) {
+      break;
+    }
+    i++;
+  }
+
+  if (!found) {
+    return BUDDY_STATUS_NOMEM;
+  }
+  *n_moves = defrag_moves(ba, best, moves);
+  qsort(moves, *n_moves, sizeof(*moves), defrag_move_compare);
+  defrag_destinations(ba, best, moves, *n_moves);
+  *page_id = get_first_page_index_from_block_index(ba, best);
+  return BUDDY_STATUS_SUCCESS;
+}
+
+static buddy_status_t page_migrate(struct buddy_allocator_s *ba,
+                                   uint64_t page_id, uint64_t dest_page_id,
+                                   uint64_t *n_pages) {
+  assert(ba->state == BUDDY_STATE_READY, "allocator state is not ready\n");
+
+  if (ba->flags & (BUDDY_FLAG_LOCKFREE | BUDDY_FLAG_BITMAP)) {
+    return BUDDY_STATUS_INVAL;
+  }
+
+  uint64_t block_index;
+  buddy_status_t s = get_block_index_from_head(ba, page_id, &block_index);
+  if (s != BUDDY_STATUS_SUCCESS) {
+    return s;
+  }
+
+  const uint8_t level = heap_level(block_index);
+  *n_pages = uint64_pow2(ba->max_level - level);
+  if (dest_page_id % *n_pages != 0 ||
+      dest_page_id >= uint64_pow2(ba->max_level)) {
+    return BUDDY_STATUS_INVAL;
+  }
+  const uint64_t dest = heap_ancestor(heap_leaf(ba, dest_page_id), level);
+  if (!block_is_free(ba, dest) &&
+      (!defer_flush(ba) || !block_is_free(ba, dest))) {
+    return BUDDY_STATUS_NOMEM;
+  }
+
+  // the destination is free, so it can't overlap the allocation
+  claim_block(ba, dest);
+  propagate(ba, release_block(ba, block_index));
+  return BUDDY_STATUS_SUCCESS;
+}
+
+buddy_status_t buddy_page_migrate(struct buddy_allocator_s *ba,
+                                  uint64_t page_id, uint64_t dest_page_id) {
+  uint64_t n_pages = 0;
+  const buddy_status_t s = page_migrate(ba, page_id, dest_page_id, &n_pages);
+  if (s == BUDDY_STATUS_SUCCESS) {
+    // replayed as the free and the allocation it amounts to
+    trace(ba, BUDDY_TRACE_FREE, 0, page_id, s);
+    trace(ba, BUDDY_TRACE_ALLOC, n_pages, dest_page_id, s);
+  }
+  debug_check(ba, page_id, 0, s);
+  debug_check(ba, dest_page_id, 0, s);
+  return s;
+}
+
+/// PAGE RANGE FUNCTIONS
+// claiming a given block, and taking pages out of the heap and putting them
+// back while it is in use. each one walks one or two paths of the tree
+
+[[nodiscard("allocations may fail")]]
+static buddy_status_t page_alloc_at(struct buddy_allocator_s *ba,
+                                    uint64_t page_id, uint64_t n_pages) {
+  assert(ba->state == BUDDY_STATE_READY, "allocator state is not ready\n");
+
+  // can't allocate 0 pages, round up to 1
+  if (n_pages == 0) {
+    n_pages = 1;
+  }
+
+  if (n_pages > uint64_pow2(ba->max_level) ||
+      (ba->flags & (BUDDY_FLAG_LOCKFREE | BUDDY_FLAG_BITMAP))) {
+    return BUDDY_STATUS_INVAL;
+  }
+
+  const uint8_t allocation_level = ba->max_level - uint64_ceil_log2(n_pages);
+  const uint64_t size = uint64_pow2(ba->max_level - allocation_level);
+  if (page_id % size != 0 || page_id >= uint64_pow2(ba->max_level)) {
+    return BUDDY_STATUS_INVAL;
+  }
+
+  const uint64_t block_index =
+      heap_ancestor(heap_leaf(ba, page_id), allocation_level);
+  if (!block_is_free(ba, block_index) &&
+      (!defer_flush(ba) || !block_is_free(ba, block_index))) {
+    stats_failed(ba);
+    return BUDDY_STATUS_NOMEM;
+  }
+  claim_block(ba, block_index);
+  stats_alloc(ba, size);
+  return BUDDY_STATUS_SUCCESS;
+}
+
+[[nodiscard("allocations may fail")]]
+buddy_status_t buddy_page_alloc_at(struct buddy_allocator_s *ba,
+                                   uint64_t page_id, uint64_t n_pages) {
+  const buddy_status_t s = page_alloc_at(ba, page_id, n_pages);
+  // replayed as an allocation wherever the replaying heap puts it
+  trace(ba, BUDDY_TRACE_ALLOC, n_pages, page_id, s);
+  debug_check(ba, page_id, n_pages, s);
+  return s;
+}
+
+// checks the arguments of buddy_page_offline and buddy_page_online
+static buddy_status_t page_range_check(struct buddy_allocator_s *ba,
+                                       uint64_t min_page_id,
+                                       uint64_t max_page_id, bool unusable) {
+  assert(ba->state == BUDDY_STATE_READY, "allocator state is not ready\n");
+
+  if ((ba->flags & (BUDDY_FLAG_LOCKFREE | BUDDY_FLAG_BITMAP)) ||
+      min_page_id > max_page_id || max_page_id >= ba->n_pages) {
+    return BUDDY_STATUS_INVAL;
+  }
+  if (!range_is(ba, 0, 0, min_page_id, max_page_id, unusable)) {
+    return unusable ? BUDDY_STATUS_INVAL : BUDDY_STATUS_NOMEM;
+  }
+  return BUDDY_STATUS_SUCCESS;
+}
+
+buddy_status_t buddy_page_offline(struct buddy_allocator_s *ba,
+                                  uint64_t min_page_id,
+                                  uint64_t max_page_id) {
+  buddy_status_t s = page_range_check(ba, min_page_id, max_page_id, false);
+  if (s == BUDDY_STATUS_NOMEM && defer_flush(ba)) {
+    s = page_range_check(ba, min_page_id, max_page_id, false);
+  }
+  if (s == BUDDY_STATUS_SUCCESS) {
+    mark_range(ba, 0, heap_node(ba, 0), 0, min_page_id, max_page_id);
+    ba->stats.usable_pages -= max_page_id - min_page_id + 1;
+  }
+  debug_check(ba, min_page_id, max_page_id - min_page_id + 1, s);
+  return s;
+}
+
+buddy_status_t buddy_page_online(struct buddy_allocator_s *ba,
+                                 uint64_t min_page_id, uint64_t max_page_id) {
+  buddy_status_t s = page_range_check(ba, min_page_id, max_page_id, true);
+  if (s == BUDDY_STATUS_SUCCESS) {
+    unmark_range(ba, 0, heap_node(ba, 0), 0, min_page_id, max_page_id);
+    ba->stats.usable_pages += max_page_id - min_page_id + 1;
+  }
+  debug_check(ba, min_page_id, max_page_id - min_page_id + 1, s);
+  return s;
+}
+
+static void *page_to_ptr(const struct buddy_allocator_s *ba, uint64_t page_id) {
+  return (void *)(ba->offset + (page_id << ba->page_size_log2));
+}
+
+static uint64_t ptr_to_page(const struct buddy_allocator_s *ba, void *ptr) {
+  return ((uint64_t)ptr - ba->offset) >> ba->page_size_log2;
+}
+
+// the number of pages buddy_mem_alloc reserves for n_bytes
+static uint64_t mem_pages(const struct buddy_allocator_s *ba,
+                          uint64_t n_bytes) {
   // minimum allocation of at least 1 page
   uint64_t page_size = uint64_pow2(ba->page_size_log2);
   if (n_bytes < page_size) {
@@ -481,8 +3348,14 @@ buddy_status_t buddy_mem_alloc(struct buddy_allocator_s *ba, uint64_t n_bytes,
 
   // we do ceil log2 to get the next largest power of 2, which is guaranteed to
   // be always greater than page size
-  uint64_t n_pages =
-      uint64_pow2(uint64_ceil_log2(n_bytes) - ba->page_size_log2);
+  return uint64_pow2(uint64_ceil_log2(n_bytes) - ba->page_size_log2);
+}
+
+// returns the status of the allocation. sets mem
+[[nodiscard("allocations may fail")]]
+buddy_status_t buddy_mem_alloc(struct buddy_allocator_s *ba, uint64_t n_bytes,
+                               void **mem) {
+  uint64_t n_pages = mem_pages(ba, n_bytes);
 
   uint64_t page_id;
   buddy_status_t s = buddy_page_alloc(ba, n_pages, &page_id);
@@ -498,3 +3371,75 @@ buddy_status_t buddy_mem_alloc(struct buddy_allocator_s *ba, uint64_t n_bytes,
 buddy_status_t buddy_mem_free(struct buddy_allocator_s *ba, void *mem) {
   return buddy_page_free(ba, ptr_to_page(ba, mem));
 }
+
+[[nodiscard("allocations may fail")]]
+buddy_status_t buddy_mem_alloc_exact(struct buddy_allocator_s *ba,
+                                     uint64_t n_bytes, void **mem) {
+  // round up to whole pages only
+  uint64_t n_pages =
+      (n_bytes + uint64_pow2(ba->page_size_log2) - 1) >> ba->page_size_log2;
+
+  uint64_t page_id;
+  buddy_status_t s = buddy_page_alloc_exact(ba, n_pages, &page_id);
+  if (s != BUDDY_STATUS_SUCCESS) {
+    return s;
+  }
+
+  *mem = page_to_ptr(ba, page_id);
+  return BUDDY_STATUS_SUCCESS;
+}
+
+buddy_status_t buddy_mem_free_exact(struct buddy_allocator_s *ba, void *mem,
+                                    uint64_t n_bytes) {
+  uint64_t n_pages =
+      (n_bytes + uint64_pow2(ba->page_size_log2) - 1) >> ba->page_size_log2;
+  return buddy_page_free_exact(ba, ptr_to_page(ba, mem), n_pages);
+}
+
+[[nodiscard("allocations may fail")]]
+buddy_status_t buddy_mem_realloc(struct buddy_allocator_s *ba, void *mem,
+                                 uint64_t n_bytes, void **new_mem) {
+  if (mem == NULL) {
+    return buddy_mem_alloc(ba, n_bytes, new_mem);
+  }
+
+  uint64_t n_pages = mem_pages(ba, n_bytes);
+  buddy_status_t s = buddy_page_realloc(ba, ptr_to_page(ba, mem), n_pages);
+  if (s != BUDDY_STATUS_NOMEM) {
+    if (s == BUDDY_STATUS_SUCCESS) {
+      *new_mem = mem;
+    }
+    return s;
+  }
+
+  // can't be done in place, move it
+  uint64_t old_bytes;
+  s = buddy_mem_usable_size(ba, mem, &old_bytes);
+  if (s != BUDDY_STATUS_SUCCESS) {
+    return s;
+  }
+
+  void *moved;
+  s = buddy_mem_alloc(ba, n_bytes, &moved);
+  if (s != BUDDY_STATUS_SUCCESS) {
+    return s;
+  }
+
+  uint64_t new_bytes = n_pages << ba->page_size_log2;
+  memcpy(moved, mem, old_bytes < new_bytes ? old_bytes : new_bytes);
+  buddy_mem_free(ba, mem);
+  *new_mem = moved;
+  return BUDDY_STATUS_SUCCESS;
+}
+
+buddy_status_t buddy_mem_usable_size(struct buddy_allocator_s *ba, void *mem,
+                                     uint64_t *n_bytes) {
+  uint64_t n_pages;
+  buddy_status_t s = buddy_page_size_of(ba, ptr_to_page(ba, mem), &n_pages);
+  if (s != BUDDY_STATUS_SUCCESS) {
+    return s;
+  }
+
+  *n_bytes = n_pages << ba->page_size_log2;
+  return BUDDY_STATUS_SUCCESS;
+}
@@ -0,0 +1,188 @@
+#include "buddy_arena.h"
+
+#include <stdint.h>
+#include <threads.h>
+
+#include "buddy_allocator.h"
+#include "buddy_math.h"
+#include "debug.h"
+
+#define ARENA_LINE_BYTES 64
+
+struct arena_shard_s {
+  mtx_t lock;
+};
+
+// where the heap of a shard starts, after its lock
+#define ARENA_HEAP_OFFSET                                                      \
+  ((sizeof(struct arena_shard_s) + ARENA_LINE_BYTES - 1) &                     \
+   ~(uint64_t)(ARENA_LINE_BYTES - 1))
+
+// hands each thread a ticket the first time it allocates from any arena, the
+// home shard is the ticket modulo the number of shards
+static uint32_t arena_next_ticket = 0;
+static thread_local uint32_t arena_ticket = UINT32_MAX;
+
+static inline uint64_t arena_round_up(uint64_t bytes) {
+  return (bytes + ARENA_LINE_BYTES - 1) & ~(uint64_t)(ARENA_LINE_BYTES - 1);
+}
+
+static inline struct arena_shard_s *arena_shard(struct buddy_arena_s *as,
+                                                uint32_t shard) {
+  return (struct arena_shard_s *)(uintptr_t)(as->shards +
+                                             shard * as->shard_stride);
+}
+
+static inline struct buddy_allocator_s *arena_heap(struct buddy_arena_s *as,
+                                                   uint32_t shard) {
+  return (struct buddy_allocator_s *)(uintptr_t)(as->shards +
+                                                 shard * as->shard_stride +
+                                                 ARENA_HEAP_OFFSET);
+}
+
+// the number of pages in the given shard
+static inline uint64_t arena_pages(uint64_t n_pages, uint64_t shard_pages,
+                                   uint32_t shard) {
+  const uint64_t first = shard * shard_pages;
+  return n_pages - first < shard_pages ? n_pages - first : shard_pages;
+}
+
+static uint32_t arena_home(struct buddy_arena_s *as) {
+  if (arena_ticket == UINT32_MAX) {
+    arena_ticket = __atomic_fetch_add(&arena_next_ticket, 1, __ATOMIC_RELAXED);
+  }
+  return arena_ticket % as->n_shards;
+}
+
+static void arena_lock(struct buddy_arena_s *as, uint32_t shard) {
+  if (!(as->flags & BUDDY_FLAG_LOCKFREE)) {
+    mtx_lock(&arena_shard(as, shard)->lock);
+  }
+}
+
+static void arena_unlock(struct buddy_arena_s *as, uint32_t shard) {
+  if (!(as->flags & BUDDY_FLAG_LOCKFREE)) {
+    mtx_unlock(&arena_shard(as, shard)->lock);
+  }
+}
+
+uint64_t buddy_arena_get_bytes(uint64_t n_pages, uint32_t n_shards,
+                               buddy_flags_t flags) {
+  assert(n_shards != 0 && n_shards <= n_pages,
+         "n_shards must be between 1 and n_pages\n");
+
+  const uint64_t shard_pages = (n_pages + n_shards - 1) / n_shards;
+  const uint64_t stride = arena_round_up(
+      ARENA_HEAP_OFFSET + buddy_get_bytes_flags(shard_pages, flags));
+  return sizeof(struct buddy_arena_s) + n_shards * stride;
+}
+
+void buddy_arena_init(struct buddy_arena_s *as, uint64_t n_pages,
+                      uint64_t page_size, uint64_t offset, uint32_t n_shards,
+                      buddy_flags_t flags) {
+  assert(n_shards != 0 && n_shards <= n_pages,
+         "n_shards must be between 1 and n_pages\n");
+  assert(uint64_is_power_of_2(page_size), "page size must be a power of 2");
+
+  as->shard_pages = (n_pages + n_shards - 1) / n_shards;
+  as->n_shards = (uint32_t)((n_pages + as->shard_pages - 1) / as->shard_pages);
+  as->shard_stride = arena_round_up(
+      ARENA_HEAP_OFFSET + buddy_get_bytes_flags(as->shard_pages, flags));
+  as->offset = offset;
+  as->page_size_log2 = uint64_log2(page_size);
+  as->flags = flags;
+
+  for (uint32_t shard = 0; shard < as->n_shards; shard++) {
+    mtx_init(&arena_shard(as, shard)->lock, mtx_plain);
+    buddy_init_flags(arena_heap(as, shard),
+                     arena_pages(n_pages, as->shard_pages, shard), page_size,
+                     offset + ((shard * as->shard_pages) << as->page_size_log2),
+                     flags);
+  }
+}
+
+void buddy_arena_mark_unusable(struct buddy_arena_s *as, uint64_t min_page_id,
+                               uint64_t max_page_id) {
+  for (uint32_t shard = 0; shard < as->n_shards; shard++) {
+    const uint64_t first = shard * as->shard_pages;
+    const uint64_t last = first + as->shard_pages - 1;
+    if (max_page_id < first || min_page_id > last) {
+      continue;
+    }
+    buddy_mark_unusable(arena_heap(as, shard),
+                        (min_page_id > first ? min_page_id : first) - first,
+                        (max_page_id < last ? max_page_id : last) - first);
+  }
+}
+
+void buddy_arena_ready(struct buddy_arena_s *as) {
+  for (uint32_t shard = 0; shard < as->n_shards; shard++) {
+    buddy_ready(arena_heap(as, shard));
+  }
+}
+
+void buddy_arena_destroy(struct buddy_arena_s *as) {
+  for (uint32_t shard = 0; shard < as->n_shards; shard++) {
+    mtx_destroy(&arena_shard(as, shard)->lock);
+  }
+}
+
+[[nodiscard("allocations may fail")]]
+buddy_status_t buddy_arena_page_alloc(struct buddy_arena_s *as,
+                                      uint64_t n_pages, uint64_t *page_id) {
+  // try the home shard first, then steal from the others in turn
+  const uint32_t home = arena_home(as);
+  buddy_status_t status = BUDDY_STATUS_INVAL;
+  for (uint32_t i = 0; i < as->n_shards; i++) {
+    const uint32_t shard = (home + i) % as->n_shards;
+    uint64_t local_page_id;
+    arena_lock(as, shard);
+    buddy_status_t s =
+        buddy_page_alloc(arena_heap(as, shard), n_pages, &local_page_id);
+    arena_unlock(as, shard);
+    if (s == BUDDY_STATUS_SUCCESS) {
+      *page_id = shard * as->shard_pages + local_page_id;
+      return BUDDY_STATUS_SUCCESS;
+    }
+    // a shard that is too small for n_pages doesn't mean the others are
+    if (s == BUDDY_STATUS_NOMEM) {
+      status = s;
+    }
+  }
+  return status;
+}
+
+buddy_status_t buddy_arena_page_free(struct buddy_arena_s *as,
+                                     uint64_t page_id) {
+  const uint64_t shard = page_id / as->shard_pages;
+  if (shard >= as->n_shards) {
+    return BUDDY_STATUS_NO_SUCH_ALLOCATION;
+  }
+
+  arena_lock(as, (uint32_t)shard);
+  buddy_status_t s = buddy_page_free(arena_heap(as, (uint32_t)shard),
+                                     page_id - shard * as->shard_pages);
+  arena_unlock(as, (uint32_t)shard);
+  return s;
+}
+
+[[nodiscard("allocations may fail")]]
+buddy_status_t buddy_arena_mem_alloc(struct buddy_arena_s *as,
+                                     uint64_t n_bytes, void **mem) {
+  // the shards round up to a power of 2 pages
+  const uint64_t page_size = uint64_pow2(as->page_size_log2);
+  uint64_t page_id;
+  buddy_status_t s = buddy_arena_page_alloc(
+      as, (n_bytes + page_size - 1) >> as->page_size_log2, &page_id);
+  if (s != BUDDY_STATUS_SUCCESS) {
+    return s;
+  }
+
+  *mem = (void *)(as->offset + (page_id << as->page_size_log2));
+  return BUDDY_STATUS_SUCCESS;
+}
+
+buddy_status_t buddy_arena_mem_free(struct buddy_arena_s *as, void *mem) {
+  return buddy_arena_page_free(
+      as, ((uint64_t)mem - as->offset) >> as->page_size_log2);
+}
@@ -0,0 +1,451 @@
+// fsync, ftruncate and open are not part of strict c23
+#define _DEFAULT_SOURCE
+
+#include "buddy_journal.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "buddy_allocator.h"
+
+// the snapshot file is a journal_file_s followed by a buddy_snapshot. the log
+// is a journal_file_s followed by batches, each a journal_batch_s followed by
+// its notes. both files carry the number of the checkpoint they belong to, so
+// that a crash between writing the new snapshot and emptying the log can't
+// replay an older log over a newer snapshot
+
+// "BJSN"
+#define JOURNAL_SNAPSHOT_MAGIC 0x4e534a42
+// "BJLG"
+#define JOURNAL_LOG_MAGIC 0x474c4a42
+// "BJBT"
+#define JOURNAL_BATCH_MAGIC 0x54424a42
+#define JOURNAL_VERSION 1
+
+struct journal_file_s {
+  uint32_t magic;
+  uint32_t version;
+  // the checkpoint the file belongs to
+  uint64_t checkpoint;
+};
+
+struct journal_batch_s {
+  uint32_t magic;
+  uint32_t reserved;
+  uint64_t n_notes;
+  // as of the end of the batch
+  struct buddy_journal_counters_s counters;
+  // of n_notes, counters and the notes
+  uint64_t checksum;
+};
+
+struct buddy_journal_s {
+  struct buddy_allocator_s *ba;
+  char *snapshot_path;
+  char *log_path;
+  // the log, open for appending
+  int log_fd;
+  uint64_t checkpoint;
+  uint64_t log_bytes;
+  // the notes since the last commit
+  uint64_t *notes;
+  uint64_t n_notes;
+  uint64_t capacity;
+  // as of the last commit or checkpoint
+  struct buddy_journal_counters_s committed;
+  // the log can't be appended to, because a note was dropped for lack of
+  // memory or a checkpoint failed halfway. the next commit checkpoints instead
+  bool must_checkpoint;
+};
+
+// FNV-1a over 8 byte words, like the snapshot checksum
+static uint64_t journal_checksum(uint64_t h, const void *p, uint64_t n) {
+  const uint8_t *bytes = p;
+  uint64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t word;
+    memcpy(&word, bytes + i, 8);
+    h = (h ^ word) * 0x100000001b3;
+  }
+  for (; i < n; i++) {
+    h = (h ^ bytes[i]) * 0x100000001b3;
+  }
+  return h;
+}
+
+static uint64_t journal_batch_checksum(const struct journal_batch_s *batch,
+                                       const uint64_t *notes) {
+  uint64_t h = 0xcbf29ce484222325;
+  h = journal_checksum(h, &batch->n_notes, sizeof(batch->n_notes));
+  h = journal_checksum(h, &batch->counters, sizeof(batch->counters));
+  return journal_checksum(h, notes, batch->n_notes * sizeof(uint64_t));
+}
+
+static bool journal_write_all(int fd, const void *buf, uint64_t bytes) {
+  const uint8_t *p = buf;
+  while (bytes > 0) {
+    const ssize_t written = write(fd, p, bytes);
+    if (written <= 0) {
+      return false;
+    }
+    p += written;
+    bytes -= (uint64_t)written;
+  }
+  return true;
+}
+
+// makes a rename into the directory of path durable
+static bool journal_sync_dir(const char *path) {
+  const char *slash = strrchr(path, '/');
+  char *dir = slash == NULL ? strdup(".")
+                            : strndup(path, (size_t)(slash - path + 1));
+  if (dir == NULL) {
+    return false;
+  }
+  const int fd = open(dir, O_RDONLY);
+  free(dir);
+  if (fd < 0) {
+    return false;
+  }
+  const bool ok = fsync(fd) == 0;
+  close(fd);
+  return ok;
+}
+
+// writes a file at path as a whole: to path.tmp first, then renamed over path
+static bool journal_replace(const char *path, const void *head,
+                            uint64_t head_bytes, const void *body,
+                            uint64_t body_bytes) {
+  const uint64_t length = strlen(path);
+  char *tmp = malloc(length + 5);
+  if (tmp == NULL) {
+    return false;
+  }
+  memcpy(tmp, path, length);
+  memcpy(tmp + length, ".tmp", 5);
+
+  const int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool ok = fd >= 0;
+  if (ok) {
+    ok = journal_write_all(fd, head, head_bytes) &&
+         journal_write_all(fd, body, body_bytes) && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+  }
+  ok = ok && rename(tmp, path) == 0 && journal_sync_dir(path);
+  free(tmp);
+  return ok;
+}
+
+buddy_status_t buddy_journal_checkpoint(struct buddy_journal_s *journal) {
+  const uint64_t bytes = buddy_snapshot_get_bytes(journal->ba);
+  void *snapshot = malloc(bytes);
+  if (snapshot == NULL) {
+    return BUDDY_STATUS_NOMEM;
+  }
+  buddy_status_t s = buddy_snapshot(journal->ba, snapshot, bytes);
+  if (s != BUDDY_STATUS_SUCCESS) {
+    free(snapshot);
+    return s;
+  }
+
+  // the snapshot first: until the log is replaced, the old log is ignored
+  // because it belongs to an older checkpoint
+  const struct journal_file_s snapshot_head = {
+      .magic = JOURNAL_SNAPSHOT_MAGIC,
+      .version = JOURNAL_VERSION,
+      .checkpoint = journal->checkpoint + 1,
+  };
+  const bool ok = journal_replace(journal->snapshot_path, &snapshot_head,
+                                  sizeof(snapshot_head), snapshot, bytes);
+  free(snapshot);
+  // the new snapshot may be in place, and the log no longer belong to it
+  journal->must_checkpoint = true;
+  if (!ok) {
+    return BUDDY_STATUS_INVAL;
+  }
+
+  const struct journal_file_s log_head = {
+      .magic = JOURNAL_LOG_MAGIC,
+      .version = JOURNAL_VERSION,
+      .checkpoint = journal->checkpoint + 1,
+  };
+  if (!journal_replace(journal->log_path, &log_head, sizeof(log_head), NULL,
+                       0)) {
+    return BUDDY_STATUS_INVAL;
+  }
+  const int fd = open(journal->log_path, O_WRONLY | O_APPEND);
+  if (fd < 0) {
+    return BUDDY_STATUS_INVAL;
+  }
+  if (journal->log_fd >= 0) {
+    close(journal->log_fd);
+  }
+  journal->log_fd = fd;
+  journal->checkpoint++;
+  journal->log_bytes = sizeof(log_head);
+  // the snapshot holds them
+  journal->n_notes = 0;
+  journal->must_checkpoint = false;
+  buddy_journal_get_counters(journal->ba, &journal->committed);
+  return BUDDY_STATUS_SUCCESS;
+}
+
+buddy_status_t buddy_journal_open(struct buddy_allocator_s *ba,
+                                  const char *snapshot_path,
+                                  const char *log_path,
+                                  struct buddy_journal_s **journal) {
+  struct buddy_journal_s *j = calloc(1, sizeof(struct buddy_journal_s));
+  if (j == NULL) {
+    return BUDDY_STATUS_NOMEM;
+  }
+  j->ba = ba;
+  j->log_fd = -1;
+  j->snapshot_path = strdup(snapshot_path);
+  j->log_path = strdup(log_path);
+  if (j->snapshot_path == NULL || j->log_path == NULL) {
+    buddy_journal_close(j);
+    return BUDDY_STATUS_NOMEM;
+  }
+
+  // carry on from the checkpoint already there, so that its number only grows
+  FILE *f = fopen(snapshot_path, "rb");
+  if (f != NULL) {
+    struct journal_file_s head;
+    if (fread(&head, sizeof(head), 1, f) == 1 &&
+        head.magic == JOURNAL_SNAPSHOT_MAGIC) {
+      j->checkpoint = head.checkpoint;
+    }
+    fclose(f);
+  }
+
+  buddy_status_t s = buddy_journal_attach(ba, j);
+  if (s == BUDDY_STATUS_SUCCESS) {
+    s = buddy_journal_checkpoint(j);
+    if (s != BUDDY_STATUS_SUCCESS) {
+      buddy_journal_attach(ba, NULL);
+    }
+  }
+  if (s != BUDDY_STATUS_SUCCESS) {
+    if (j->log_fd >= 0) {
+      close(j->log_fd);
+      j->log_fd = -1;
+    }
+    buddy_journal_close(j);
+    return s;
+  }
+  *journal = j;
+  return BUDDY_STATUS_SUCCESS;
+}
+
+void buddy_journal_note(struct buddy_journal_s *journal, uint64_t offset,
+                        uint8_t value) {
+  if (journal->n_notes == journal->capacity) {
+    const uint64_t grown =
+        journal->capacity == 0 ? 1024 : journal->capacity * 2;
+    uint64_t *bigger = realloc(journal->notes, grown * sizeof(uint64_t));
+    if (bigger == NULL) {
+      journal->must_checkpoint = true;
+      return;
+    }
+    journal->notes = bigger;
+    journal->capacity = grown;
+  }
+  journal->notes[journal->n_notes++] = offset << 8 | value;
+}
+
+buddy_status_t buddy_journal_commit(struct buddy_journal_s *journal) {
+  if (journal->must_checkpoint) {
+    return buddy_journal_checkpoint(journal);
+  }
+
+  struct journal_batch_s batch = {
+      .magic = JOURNAL_BATCH_MAGIC,
+      .n_notes = journal->n_notes,
+  };
+  buddy_journal_get_counters(journal->ba, &batch.counters);
+  if (batch.n_notes == 0 &&
+      memcmp(&batch.counters, &journal->committed, sizeof(batch.counters)) ==
+          0) {
+    // nothing happened since
+    return BUDDY_STATUS_SUCCESS;
+  }
+  batch.checksum = journal_batch_checksum(&batch, journal->notes);
+
+  // a batch cut short is found by its checksum, and cut off the log, so that
+  // the next batch is not appended after garbage
+  const uint64_t bytes = sizeof(batch) + journal->n_notes * sizeof(uint64_t);
+  if (!journal_write_all(journal->log_fd, &batch, sizeof(batch)) ||
+      !journal_write_all(journal->log_fd, journal->notes,
+                         journal->n_notes * sizeof(uint64_t)) ||
+      fsync(journal->log_fd) != 0) {
+    if (ftruncate(journal->log_fd, (off_t)journal->log_bytes) != 0) {
+      // can't tell what is in the log anymore
+      journal->must_checkpoint = true;
+    }
+    return BUDDY_STATUS_INVAL;
+  }
+  journal->log_bytes += bytes;
+  journal->n_notes = 0;
+  journal->committed = batch.counters;
+
+  if (journal->log_bytes >= BUDDY_JOURNAL_CHECKPOINT_BYTES) {
+    return buddy_journal_checkpoint(journal);
+  }
+  return BUDDY_STATUS_SUCCESS;
+}
+
+buddy_status_t buddy_journal_close(struct buddy_journal_s *journal) {
+  buddy_status_t s = BUDDY_STATUS_SUCCESS;
+  if (journal->log_fd >= 0) {
+    s = buddy_journal_commit(journal);
+    close(journal->log_fd);
+    buddy_journal_attach(journal->ba, NULL);
+  }
+  free(journal->notes);
+  free(journal->log_path);
+  free(journal->snapshot_path);
+  free(journal);
+  return s;
+}
+
+// reads the whole file at path into a new buffer. returns NULL if it can't
+static uint8_t *journal_read(const char *path, uint64_t *bytes) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    return NULL;
+  }
+  uint8_t *buf = NULL;
+  if (fseek(f, 0, SEEK_END) == 0) {
+    const long length = ftell(f);
+    if (length >= 0 && fseek(f, 0, SEEK_SET) == 0) {
+      *bytes = (uint64_t)length;
+      buf = malloc(*bytes + 1);
+      if (buf != NULL && fread(buf, 1, *bytes, f) != *bytes) {
+        free(buf);
+        buf = NULL;
+      }
+    }
+  }
+  fclose(f);
+  return buf;
+}
+
+// reads the snapshot file at path. sets checkpoint, and snapshot to where the
+// buddy_snapshot starts in the returned buffer
+static uint8_t *journal_read_snapshot(const char *path, uint64_t *checkpoint,
+                                      const uint8_t **snapshot,
+                                      uint64_t *bytes) {
+  uint64_t file_bytes;
+  uint8_t *buf = journal_read(path, &file_bytes);
+  if (buf == NULL) {
+    return NULL;
+  }
+  struct journal_file_s head;
+  if (file_bytes < sizeof(head)) {
+    free(buf);
+    return NULL;
+  }
+  memcpy(&head, buf, sizeof(head));
+  if (head.magic != JOURNAL_SNAPSHOT_MAGIC || head.version != JOURNAL_VERSION) {
+    free(buf);
+    return NULL;
+  }
+  *checkpoint = head.checkpoint;
+  *snapshot = buf + sizeof(head);
+  *bytes = file_bytes - sizeof(head);
+  return buf;
+}
+
+buddy_status_t buddy_journal_recover_get_bytes(const char *snapshot_path,
+                                               uint64_t *ba_bytes) {
+  uint64_t checkpoint;
+  const uint8_t *snapshot;
+  uint64_t bytes;
+  uint8_t *buf =
+      journal_read_snapshot(snapshot_path, &checkpoint, &snapshot, &bytes);
+  if (buf == NULL) {
+    return BUDDY_STATUS_INVAL;
+  }
+  const buddy_status_t s = buddy_restore_get_bytes(snapshot, bytes, ba_bytes);
+  free(buf);
+  return s;
+}
+
+buddy_status_t buddy_journal_recover(struct buddy_allocator_s *ba,
+                                     const char *snapshot_path,
+                                     const char *log_path) {
+  uint64_t checkpoint;
+  const uint8_t *snapshot;
+  uint64_t bytes;
+  uint8_t *buf =
+      journal_read_snapshot(snapshot_path, &checkpoint, &snapshot, &bytes);
+  if (buf == NULL) {
+    return BUDDY_STATUS_INVAL;
+  }
+  buddy_status_t s = buddy_restore(ba, snapshot, bytes);
+  free(buf);
+  if (s != BUDDY_STATUS_SUCCESS) {
+    return s;
+  }
+
+  uint64_t log_bytes;
+  uint8_t *log = journal_read(log_path, &log_bytes);
+  if (log == NULL) {
+    // nothing was committed after the checkpoint
+    return BUDDY_STATUS_SUCCESS;
+  }
+  struct journal_file_s head;
+  if (log_bytes < sizeof(head)) {
+    free(log);
+    return BUDDY_STATUS_SUCCESS;
+  }
+  memcpy(&head, log, sizeof(head));
+  if (head.magic != JOURNAL_LOG_MAGIC || head.version != JOURNAL_VERSION ||
+      head.checkpoint != checkpoint) {
+    // the log of an older checkpoint, whose batches the snapshot already holds
+    free(log);
+    return BUDDY_STATUS_SUCCESS;
+  }
+
+  // gather the notes of every whole batch, so that the free blocks are only
+  // recounted once
+  uint64_t *notes = NULL;
+  uint64_t n_notes = 0;
+  struct buddy_journal_counters_s counters;
+  buddy_journal_get_counters(ba, &counters);
+  uint64_t at = sizeof(head);
+  while (log_bytes - at >= sizeof(struct journal_batch_s)) {
+    struct journal_batch_s batch;
+    memcpy(&batch, log + at, sizeof(batch));
+    const uint64_t left = log_bytes - at - sizeof(batch);
+    if (batch.magic != JOURNAL_BATCH_MAGIC ||
+        batch.n_notes > left / sizeof(uint64_t)) {
+      break;
+    }
+    uint64_t *grown =
+        realloc(notes, (n_notes + batch.n_notes + 1) * sizeof(uint64_t));
+    if (grown == NULL) {
+      free(notes);
+      free(log);
+      return BUDDY_STATUS_NOMEM;
+    }
+    notes = grown;
+    memcpy(notes + n_notes, log + at + sizeof(batch),
+           batch.n_notes * sizeof(uint64_t));
+    if (journal_batch_checksum(&batch, notes + n_notes) != batch.checksum) {
+      break;
+    }
+    n_notes += batch.n_notes;
+    counters = batch.counters;
+    at += sizeof(batch) + batch.n_notes * sizeof(uint64_t);
+  }
+  free(log);
+
+  s = buddy_journal_replay(ba, notes, n_notes, &counters);
+  free(notes);
+  return s;
+}
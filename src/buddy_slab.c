@@ -0,0 +1,210 @@
+#include "buddy_slab.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <threads.h>
+
+#include "buddy_allocator.h"
+#include "buddy_math.h"
+#include "debug.h"
+
+struct buddy_slab_header_s {
+  // links in the partial list of the size class
+  struct buddy_slab_header_s *prev;
+  struct buddy_slab_header_s *next;
+  // the first free object, each free object holds a pointer to the next one
+  void *free_list;
+  uint32_t object_size;
+  // the number of objects handed out
+  uint32_t n_used;
+  // the number of objects the slab holds
+  uint32_t capacity;
+  uint8_t size_class;
+};
+
+// objects start this far into a slab, which keeps them 16 byte aligned
+#define SLAB_HEADER_BYTES                                                      \
+  ((sizeof(struct buddy_slab_header_s) + 15) & ~(uint64_t)15)
+
+static void slab_lock(struct buddy_slab_s *sa) {
+  if (sa->lock != NULL) {
+    mtx_lock(sa->lock);
+  }
+}
+
+static void slab_unlock(struct buddy_slab_s *sa) {
+  if (sa->lock != NULL) {
+    mtx_unlock(sa->lock);
+  }
+}
+
+static void slab_push(struct buddy_slab_s *sa,
+                      struct buddy_slab_header_s *slab) {
+  struct buddy_slab_header_s *head = sa->partial[slab->size_class];
+  slab->prev = NULL;
+  slab->next = head;
+  if (head != NULL) {
+    head->prev = slab;
+  }
+  sa->partial[slab->size_class] = slab;
+}
+
+static void slab_remove(struct buddy_slab_s *sa,
+                        struct buddy_slab_header_s *slab) {
+  if (slab->prev != NULL) {
+    slab->prev->next = slab->next;
+  } else {
+    sa->partial[slab->size_class] = slab->next;
+  }
+  if (slab->next != NULL) {
+    slab->next->prev = slab->prev;
+  }
+}
+
+// takes a new slab for the size class from the heap and puts it on the
+// partial list
+static buddy_status_t slab_grow(struct buddy_slab_s *sa, uint8_t size_class) {
+  void *mem;
+  slab_lock(sa);
+  buddy_status_t s = buddy_mem_alloc(sa->ba, sa->slab_bytes, &mem);
+  slab_unlock(sa);
+  if (s != BUDDY_STATUS_SUCCESS) {
+    return s;
+  }
+
+  const uintptr_t base = (uintptr_t)mem;
+  assert((base & (sa->slab_bytes - 1)) == 0,
+         "slabs must be aligned to slab_bytes, check the heap offset\n");
+
+  struct buddy_slab_header_s *slab = (struct buddy_slab_header_s *)base;
+  slab->object_size = (uint32_t)uint64_pow2(BUDDY_SLAB_MIN_ORDER + size_class);
+  slab->capacity =
+      (uint32_t)((sa->slab_bytes - SLAB_HEADER_BYTES) / slab->object_size);
+  slab->n_used = 0;
+  slab->size_class = size_class;
+
+  // thread the objects together in address order
+  slab->free_list = NULL;
+  for (uint32_t i = slab->capacity; i > 0; i--) {
+    void **object = (void **)(base + SLAB_HEADER_BYTES +
+                              (i - 1) * (uint64_t)slab->object_size);
+    *object = slab->free_list;
+    slab->free_list = object;
+  }
+
+  slab_push(sa, slab);
+  sa->n_slabs++;
+  return BUDDY_STATUS_SUCCESS;
+}
+
+// gives an empty slab back to the heap
+static void slab_release(struct buddy_slab_s *sa,
+                         struct buddy_slab_header_s *slab) {
+  slab_remove(sa, slab);
+  slab_lock(sa);
+  buddy_mem_free(sa->ba, slab);
+  slab_unlock(sa);
+  sa->n_slabs--;
+}
+
+void buddy_slab_init(struct buddy_slab_s *sa, struct buddy_allocator_s *ba,
+                     mtx_t *lock, uint64_t slab_bytes) {
+  assert(uint64_is_power_of_2(slab_bytes), "slab_bytes must be a power of 2\n");
+  assert(slab_bytes >= SLAB_HEADER_BYTES +
+                           2 * uint64_pow2(BUDDY_SLAB_MIN_ORDER),
+         "slab_bytes must fit at least two of the smallest objects\n");
+
+  sa->ba = ba;
+  sa->lock = lock;
+  sa->slab_bytes = slab_bytes;
+  sa->n_slabs = 0;
+  for (uint8_t size_class = 0; size_class < BUDDY_SLAB_CLASSES; size_class++) {
+    sa->partial[size_class] = NULL;
+  }
+}
+
+[[nodiscard("allocations may fail")]]
+buddy_status_t buddy_slab_alloc(struct buddy_slab_s *sa, uint64_t n_bytes,
+                                void **mem) {
+  const uint8_t min_order = BUDDY_SLAB_MIN_ORDER;
+  const uint8_t order =
+      n_bytes <= uint64_pow2(min_order) ? min_order : uint64_ceil_log2(n_bytes);
+  const uint8_t size_class = order - min_order;
+
+  if (size_class >= BUDDY_SLAB_CLASSES ||
+      2 * uint64_pow2(order) > sa->slab_bytes - SLAB_HEADER_BYTES) {
+    // too large for a slab. taking at least a whole slab keeps the pointer
+    // aligned to slab_bytes, which is how a free tells the two apart
+    slab_lock(sa);
+    buddy_status_t s = buddy_mem_alloc(
+        sa->ba, n_bytes < sa->slab_bytes ? sa->slab_bytes : n_bytes, mem);
+    slab_unlock(sa);
+    return s;
+  }
+
+  if (sa->partial[size_class] == NULL) {
+    buddy_status_t s = slab_grow(sa, size_class);
+    if (s != BUDDY_STATUS_SUCCESS) {
+      return s;
+    }
+  }
+
+  struct buddy_slab_header_s *slab = sa->partial[size_class];
+  void **object = slab->free_list;
+  slab->free_list = *object;
+  slab->n_used++;
+  if (slab->n_used == slab->capacity) {
+    // full slabs are on no list until an object comes back
+    slab_remove(sa, slab);
+  }
+
+  *mem = object;
+  return BUDDY_STATUS_SUCCESS;
+}
+
+buddy_status_t buddy_slab_free(struct buddy_slab_s *sa, void *mem) {
+  const uintptr_t address = (uintptr_t)mem;
+  const uintptr_t base = address & ~(uintptr_t)(sa->slab_bytes - 1);
+  if (address == base) {
+    // objects never start a slab, so this came from the heap directly
+    slab_lock(sa);
+    buddy_status_t s = buddy_mem_free(sa->ba, mem);
+    slab_unlock(sa);
+    return s;
+  }
+
+  struct buddy_slab_header_s *slab = (struct buddy_slab_header_s *)base;
+  if (address < base + SLAB_HEADER_BYTES ||
+      (address - base - SLAB_HEADER_BYTES) % slab->object_size != 0) {
+    return BUDDY_STATUS_INVAL;
+  }
+
+  if (slab->n_used == slab->capacity) {
+    slab_push(sa, slab);
+  }
+
+  void **object = mem;
+  *object = slab->free_list;
+  slab->free_list = object;
+  slab->n_used--;
+
+  // keep a lone empty slab around for the next allocation
+  if (slab->n_used == 0 &&
+      (sa->partial[slab->size_class] != slab || slab->next != NULL)) {
+    slab_release(sa, slab);
+  }
+  return BUDDY_STATUS_SUCCESS;
+}
+
+void buddy_slab_drain(struct buddy_slab_s *sa) {
+  for (uint8_t size_class = 0; size_class < BUDDY_SLAB_CLASSES; size_class++) {
+    struct buddy_slab_header_s *slab = sa->partial[size_class];
+    while (slab != NULL) {
+      struct buddy_slab_header_s *next = slab->next;
+      if (slab->n_used == 0) {
+        slab_release(sa, slab);
+      }
+      slab = next;
+    }
+  }
+}
@@ -0,0 +1,169 @@
+#include "buddy_tcache.h"
+
+#include <stdint.h>
+#include <threads.h>
+
+#include "buddy_allocator.h"
+#include "buddy_math.h"
+#include "debug.h"
+
+static void tcache_lock(struct buddy_tcache_s *tc) {
+  if (tc->lock != NULL) {
+    mtx_lock(tc->lock);
+  }
+}
+
+static void tcache_unlock(struct buddy_tcache_s *tc) {
+  if (tc->lock != NULL) {
+    mtx_unlock(tc->lock);
+  }
+}
+
+// allocates blocks from the heap until the order holds low_watermark blocks
+static buddy_status_t tcache_refill(struct buddy_tcache_s *tc, uint8_t order) {
+  buddy_status_t s = BUDDY_STATUS_SUCCESS;
+  tcache_lock(tc);
+  tc->count[order] += (uint32_t)buddy_page_alloc_bulk(
+      tc->ba, uint64_pow2(order), tc->low_watermark - tc->count[order],
+      &tc->page_ids[order][tc->count[order]]);
+  if (tc->count[order] == 0) {
+    // find out why the heap could not give us anything
+    s = buddy_page_alloc(tc->ba, uint64_pow2(order), &tc->page_ids[order][0]);
+    if (s == BUDDY_STATUS_SUCCESS) {
+      tc->count[order]++;
+    }
+  }
+  tcache_unlock(tc);
+  return s;
+}
+
+// returns blocks to the heap until the order holds target blocks
+static void tcache_flush(struct buddy_tcache_s *tc, uint8_t order,
+                         uint32_t target) {
+  if (tc->count[order] <= target) {
+    return;
+  }
+  tcache_lock(tc);
+  // the blocks are checked against the heap on the way out rather than on the
+  // way in, so that a free into the cache never looks at the heap. this also
+  // catches most blocks that another cache already gave back
+  for (uint32_t i = target; i < tc->count[order]; i++) {
+    uint64_t n_pages;
+    assert(buddy_page_size_of(tc->ba, tc->page_ids[order][i], &n_pages) ==
+                   BUDDY_STATUS_SUCCESS &&
+               n_pages == uint64_pow2(order),
+           "a block freed into a thread cache is not an allocation of its "
+           "size\n");
+  }
+  const uint64_t n = buddy_page_free_bulk(
+      tc->ba, &tc->page_ids[order][target], tc->count[order] - target);
+  assert(n == tc->count[order] - target,
+         "a cached block is no longer allocated in the heap\n");
+  tc->count[order] = target;
+  tcache_unlock(tc);
+}
+
+// whether page_id may be cached under order. cached blocks are still
+// allocated in the heap, so only the cache can catch a second free. with
+// BUDDY_DEBUG the heap is asked whether it is an allocation of that size
+static buddy_status_t tcache_check(struct buddy_tcache_s *tc, uint8_t order,
+                                   uint64_t page_id) {
+#ifdef BUDDY_DEBUG
+  uint64_t n_pages;
+  tcache_lock(tc);
+  buddy_status_t s = buddy_page_size_of(tc->ba, page_id, &n_pages);
+  tcache_unlock(tc);
+  if (s != BUDDY_STATUS_SUCCESS) {
+    return s;
+  }
+  if (n_pages != uint64_pow2(order)) {
+    return BUDDY_STATUS_NO_SUCH_ALLOCATION;
+  }
+#endif
+  for (uint32_t i = 0; i < tc->count[order]; i++) {
+    if (tc->page_ids[order][i] == page_id) {
+      return BUDDY_STATUS_NO_SUCH_ALLOCATION;
+    }
+  }
+  return BUDDY_STATUS_SUCCESS;
+}
+
+void buddy_tcache_init(struct buddy_tcache_s *tc, struct buddy_allocator_s *ba,
+                       mtx_t *lock, uint32_t low_watermark,
+                       uint32_t high_watermark) {
+  assert(low_watermark >= 1, "low watermark must be at least 1\n");
+  assert(low_watermark < high_watermark,
+         "low watermark must be less than the high watermark\n");
+  assert(high_watermark <= BUDDY_TCACHE_CAPACITY,
+         "high watermark must be at most BUDDY_TCACHE_CAPACITY\n");
+
+  tc->ba = ba;
+  tc->lock = lock;
+  tc->low_watermark = low_watermark;
+  tc->high_watermark = high_watermark;
+  for (uint8_t order = 0; order <= BUDDY_TCACHE_MAX_ORDER; order++) {
+    tc->count[order] = 0;
+  }
+}
+
+[[nodiscard("allocations may fail")]]
+buddy_status_t buddy_tcache_page_alloc(struct buddy_tcache_s *tc,
+                                       uint64_t n_pages, uint64_t *page_id) {
+  // can't allocate 0 pages, round up to 1
+  if (n_pages == 0) {
+    n_pages = 1;
+  }
+
+  const uint8_t order = uint64_ceil_log2(n_pages);
+  if (order > BUDDY_TCACHE_MAX_ORDER) {
+    tcache_lock(tc);
+    buddy_status_t s = buddy_page_alloc(tc->ba, n_pages, page_id);
+    tcache_unlock(tc);
+    return s;
+  }
+
+  if (tc->count[order] == 0) {
+    buddy_status_t s = tcache_refill(tc, order);
+    if (s != BUDDY_STATUS_SUCCESS) {
+      return s;
+    }
+  }
+
+  tc->count[order]--;
+  *page_id = tc->page_ids[order][tc->count[order]];
+  return BUDDY_STATUS_SUCCESS;
+}
+
+buddy_status_t buddy_tcache_page_free(struct buddy_tcache_s *tc,
+                                      uint64_t page_id, uint64_t n_pages) {
+  if (n_pages == 0) {
+    n_pages = 1;
+  }
+
+  const uint8_t order = uint64_ceil_log2(n_pages);
+  if (order > BUDDY_TCACHE_MAX_ORDER) {
+    tcache_lock(tc);
+    buddy_status_t s = buddy_page_free(tc->ba, page_id);
+    tcache_unlock(tc);
+    return s;
+  }
+
+  buddy_status_t s = tcache_check(tc, order, page_id);
+  if (s != BUDDY_STATUS_SUCCESS) {
+    return s;
+  }
+
+  if (tc->count[order] >= tc->high_watermark) {
+    tcache_flush(tc, order, tc->low_watermark);
+  }
+
+  tc->page_ids[order][tc->count[order]] = page_id;
+  tc->count[order]++;
+  return BUDDY_STATUS_SUCCESS;
+}
+
+void buddy_tcache_drain(struct buddy_tcache_s *tc) {
+  for (uint8_t order = 0; order <= BUDDY_TCACHE_MAX_ORDER; order++) {
+    tcache_flush(tc, order, 0);
+  }
+}
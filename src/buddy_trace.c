@@ -0,0 +1,175 @@
+#include "buddy_trace.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+
+#include "buddy_allocator.h"
+
+// the records of one thread. only that thread writes the records and head,
+// only the dumper writes dumped and collected
+struct trace_ring_s {
+  struct trace_ring_s *next;
+  // the number of records ever written, the next one goes to
+  // head % BUDDY_TRACE_RING
+  uint64_t head;
+  // the number of records already dumped
+  uint64_t dumped;
+  // what dumped becomes once the dump in progress is written
+  uint64_t collected;
+  struct buddy_trace_record_s records[BUDDY_TRACE_RING];
+};
+
+#if (BUDDY_TRACE_RING & (BUDDY_TRACE_RING - 1)) != 0
+#error "BUDDY_TRACE_RING must be a power of 2"
+#endif
+
+// every ring ever made, newest first. a ring outlives its thread, so that its
+// last records can still be dumped
+static struct trace_ring_s *trace_rings;
+static thread_local struct trace_ring_s *trace_ring;
+static uint16_t trace_heaps;
+
+uint16_t buddy_trace_heap_id(void) {
+  return __atomic_fetch_add(&trace_heaps, 1, __ATOMIC_RELAXED);
+}
+
+static struct trace_ring_s *trace_ring_new(void) {
+  struct trace_ring_s *ring = calloc(1, sizeof(struct trace_ring_s));
+  if (ring == NULL) {
+    return NULL;
+  }
+  ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, false,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+  }
+  return ring;
+}
+
+void buddy_trace_record(uint16_t heap, uint8_t op, uint64_t n_pages,
+                        uint64_t page_id, buddy_status_t status) {
+  if (trace_ring == NULL) {
+    trace_ring = trace_ring_new();
+    if (trace_ring == NULL) {
+      // nowhere to put it
+      return;
+    }
+  }
+
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  const uint64_t head = trace_ring->head;
+  struct buddy_trace_record_s *r =
+      &trace_ring->records[head % BUDDY_TRACE_RING];
+  r->ns = (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+  r->page_id = page_id;
+  r->n_pages = n_pages > UINT32_MAX ? UINT32_MAX : (uint32_t)n_pages;
+  r->op = op;
+  r->status = (uint8_t)status;
+  r->heap = heap;
+  // publish the record to the dumper
+  __atomic_store_n(&trace_ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static int trace_compare(const void *a, const void *b) {
+  const uint64_t x = ((const struct buddy_trace_record_s *)a)->ns;
+  const uint64_t y = ((const struct buddy_trace_record_s *)b)->ns;
+  return (x > y) - (x < y);
+}
+
+// copies the records of ring that were not dumped yet to the end of buf,
+// growing it as needed. returns false if it can't be grown
+static bool trace_collect(struct trace_ring_s *ring,
+                          struct buddy_trace_record_s **buf, uint64_t *n,
+                          uint64_t *capacity, uint64_t *lost) {
+  const uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint64_t start = ring->dumped;
+  if (head - start > BUDDY_TRACE_RING) {
+    *lost += head - BUDDY_TRACE_RING - start;
+    start = head - BUDDY_TRACE_RING;
+  }
+
+  if (*n + (head - start) > *capacity) {
+    uint64_t grown = *capacity == 0 ? BUDDY_TRACE_RING : *capacity * 2;
+    while (*n + (head - start) > grown) {
+      grown *= 2;
+    }
+    struct buddy_trace_record_s *bigger =
+        realloc(*buf, grown * sizeof(struct buddy_trace_record_s));
+    if (bigger == NULL) {
+      return false;
+    }
+    *buf = bigger;
+    *capacity = grown;
+  }
+
+  for (uint64_t i = start; i < head; i++) {
+    (*buf)[*n + i - start] = ring->records[i % BUDDY_TRACE_RING];
+  }
+
+  // the thread kept going while we copied, anything it lapped may be torn
+  const uint64_t after = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  if (after - start > BUDDY_TRACE_RING) {
+    uint64_t torn = after - BUDDY_TRACE_RING - start;
+    if (torn > head - start) {
+      torn = head - start;
+    }
+    memmove(*buf + *n, *buf + *n + torn,
+            (head - start - torn) * sizeof(struct buddy_trace_record_s));
+    *lost += torn;
+    start += torn;
+  }
+  *n += head - start;
+  ring->collected = head;
+  return true;
+}
+
+buddy_status_t buddy_trace_dump(const char *path, uint64_t *lost) {
+  *lost = 0;
+  struct buddy_trace_record_s *buf = NULL;
+  uint64_t n = 0;
+  uint64_t capacity = 0;
+  struct trace_ring_s *rings = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE);
+  for (struct trace_ring_s *ring = rings; ring != NULL; ring = ring->next) {
+    if (!trace_collect(ring, &buf, &n, &capacity, lost)) {
+      free(buf);
+      return BUDDY_STATUS_NOMEM;
+    }
+  }
+  // interleave the threads
+  if (n != 0) {
+    qsort(buf, n, sizeof(struct buddy_trace_record_s), trace_compare);
+  }
+
+  FILE *f = fopen(path, "ab");
+  if (f == NULL) {
+    free(buf);
+    return BUDDY_STATUS_INVAL;
+  }
+  bool ok = fseek(f, 0, SEEK_END) == 0;
+  if (ok && ftell(f) == 0) {
+    const struct buddy_trace_header_s header = {
+        .magic = BUDDY_TRACE_MAGIC,
+        .version = BUDDY_TRACE_VERSION,
+        .record_bytes = sizeof(struct buddy_trace_record_s),
+    };
+    ok = fwrite(&header, sizeof(header), 1, f) == 1;
+  }
+  if (ok && n != 0) {
+    ok = fwrite(buf, sizeof(struct buddy_trace_record_s), n, f) == n;
+  }
+  ok = fclose(f) == 0 && ok;
+  free(buf);
+  if (!ok) {
+    // the next dump tries these records again
+    return BUDDY_STATUS_INVAL;
+  }
+
+  for (struct trace_ring_s *ring = rings; ring != NULL; ring = ring->next) {
+    ring->dumped = ring->collected;
+  }
+  return BUDDY_STATUS_SUCCESS;
+}
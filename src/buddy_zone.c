@@ -0,0 +1,165 @@
+#include "buddy_zone.h"
+
+#include <stdint.h>
+
+#include "buddy_allocator.h"
+#include "buddy_math.h"
+#include "debug.h"
+
+#define ZONE_LINE_BYTES 64
+
+static inline uint64_t zone_round_up(uint64_t bytes) {
+  return (bytes + ZONE_LINE_BYTES - 1) & ~(uint64_t)(ZONE_LINE_BYTES - 1);
+}
+
+// the number of whole pages inside a range, and the first of them
+static uint64_t zone_pages(const struct buddy_zone_range_s *range,
+                           uint8_t page_size_log2, uint64_t *base) {
+  const uint64_t mask = uint64_pow2(page_size_log2) - 1;
+  const uint64_t first = (range->base + mask) & ~mask;
+  const uint64_t end = (range->base + range->n_bytes) & ~mask;
+  *base = first;
+  return end > first ? (end - first) >> page_size_log2 : 0;
+}
+
+static inline struct buddy_allocator_s *zone_heap(struct buddy_zones_s *zs,
+                                                  uint32_t zone) {
+  return (struct buddy_allocator_s *)(uintptr_t)(zs->heaps +
+                                                 zs->zones[zone].heap_offset);
+}
+
+uint64_t buddy_zones_get_bytes(const struct buddy_zone_range_s *ranges,
+                               uint32_t n_ranges, uint64_t page_size,
+                               buddy_flags_t flags) {
+  assert(n_ranges != 0 && n_ranges <= BUDDY_ZONES_MAX,
+         "n_ranges must be between 1 and BUDDY_ZONES_MAX\n");
+  assert(uint64_is_power_of_2(page_size), "page size must be a power of 2");
+
+  uint64_t bytes = sizeof(struct buddy_zones_s);
+  for (uint32_t i = 0; i < n_ranges; i++) {
+    uint64_t base;
+    const uint64_t n_pages = zone_pages(&ranges[i], uint64_log2(page_size),
+                                        &base);
+    assert(n_pages != 0, "every range must hold at least one page\n");
+    bytes += zone_round_up(buddy_get_bytes_flags(n_pages, flags));
+  }
+  return bytes;
+}
+
+void buddy_zones_init(struct buddy_zones_s *zs,
+                      const struct buddy_zone_range_s *ranges,
+                      uint32_t n_ranges, uint64_t page_size,
+                      buddy_flags_t flags) {
+  assert(n_ranges != 0 && n_ranges <= BUDDY_ZONES_MAX,
+         "n_ranges must be between 1 and BUDDY_ZONES_MAX\n");
+  assert(uint64_is_power_of_2(page_size), "page size must be a power of 2");
+
+  zs->n_zones = n_ranges;
+  zs->page_size_log2 = uint64_log2(page_size);
+
+  uint64_t heap_offset = 0;
+  for (uint32_t zone = 0; zone < n_ranges; zone++) {
+    uint64_t base;
+    const uint64_t n_pages =
+        zone_pages(&ranges[zone], zs->page_size_log2, &base);
+    assert(n_pages != 0, "every range must hold at least one page\n");
+
+    zs->zones[zone].base = base;
+    zs->zones[zone].end = base + (n_pages << zs->page_size_log2);
+    zs->zones[zone].heap_offset = heap_offset;
+    heap_offset += zone_round_up(buddy_get_bytes_flags(n_pages, flags));
+    buddy_init_flags(zone_heap(zs, zone), n_pages, page_size, base, flags);
+
+    // insertion sort by base, there are only a few zones
+    uint32_t i = zone;
+    while (i > 0 && zs->zones[zs->by_base[i - 1]].base > base) {
+      zs->by_base[i] = zs->by_base[i - 1];
+      i--;
+    }
+    zs->by_base[i] = (uint8_t)zone;
+  }
+
+  for (uint32_t i = 1; i < n_ranges; i++) {
+    assert(zs->zones[zs->by_base[i - 1]].end <=
+               zs->zones[zs->by_base[i]].base,
+           "ranges must not overlap\n");
+  }
+}
+
+void buddy_zones_ready(struct buddy_zones_s *zs) {
+  for (uint32_t zone = 0; zone < zs->n_zones; zone++) {
+    buddy_ready(zone_heap(zs, zone));
+  }
+}
+
+struct buddy_allocator_s *buddy_zones_heap(struct buddy_zones_s *zs,
+                                           uint32_t zone) {
+  assert(zone < zs->n_zones, "zone out of range\n");
+  return zone_heap(zs, zone);
+}
+
+buddy_status_t buddy_zones_find(struct buddy_zones_s *zs, void *mem,
+                                uint32_t *zone) {
+  // binary search for the last zone starting at or before mem
+  const uint64_t address = (uint64_t)mem;
+  uint32_t lo = 0;
+  uint32_t hi = zs->n_zones;
+  while (lo < hi) {
+    const uint32_t mid = (lo + hi) / 2;
+    if (zs->zones[zs->by_base[mid]].base <= address) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0 || address >= zs->zones[zs->by_base[lo - 1]].end) {
+    return BUDDY_STATUS_NO_SUCH_ALLOCATION;
+  }
+
+  *zone = zs->by_base[lo - 1];
+  return BUDDY_STATUS_SUCCESS;
+}
+
+[[nodiscard("allocations may fail")]]
+buddy_status_t buddy_zones_mem_alloc(struct buddy_zones_s *zs,
+                                     uint64_t n_bytes, void **mem) {
+  return buddy_zones_mem_alloc_from(zs, 0, n_bytes, mem);
+}
+
+[[nodiscard("allocations may fail")]]
+buddy_status_t buddy_zones_mem_alloc_from(struct buddy_zones_s *zs,
+                                          uint32_t zone, uint64_t n_bytes,
+                                          void **mem) {
+  if (zone >= zs->n_zones) {
+    return BUDDY_STATUS_INVAL;
+  }
+
+  buddy_status_t s = buddy_mem_alloc(zone_heap(zs, zone), n_bytes, mem);
+  if (s == BUDDY_STATUS_SUCCESS) {
+    return s;
+  }
+  // a zone that is too small for n_bytes doesn't mean the others are
+  buddy_status_t status = s;
+  for (uint32_t other = 0; other < zs->n_zones; other++) {
+    if (other == zone) {
+      continue;
+    }
+    s = buddy_mem_alloc(zone_heap(zs, other), n_bytes, mem);
+    if (s == BUDDY_STATUS_SUCCESS) {
+      return s;
+    }
+    if (s == BUDDY_STATUS_NOMEM) {
+      status = s;
+    }
+  }
+  return status;
+}
+
+buddy_status_t buddy_zones_mem_free(struct buddy_zones_s *zs, void *mem) {
+  uint32_t zone;
+  buddy_status_t s = buddy_zones_find(zs, mem, &zone);
+  if (s != BUDDY_STATUS_SUCCESS) {
+    return s;
+  }
+  return buddy_mem_free(zone_heap(zs, zone), mem);
+}